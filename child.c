@@ -143,5 +143,10 @@ static int log_stats( ftp_child_t *child )
 	log_info("The client transferred %llu kilobytes\n", 
 		(unsigned long long) child->xfer_info.total_down / 1024 );
 
+	if( child->xfer_info.prefetch_issued )
+		log_info("Prefetched %llu files, %llu were retrieved\n",
+			(unsigned long long) child->xfer_info.prefetch_issued,
+			(unsigned long long) child->xfer_info.prefetch_hits );
+
 	return FTP_SUCCESS;
 }
@@ -21,6 +21,7 @@ typedef struct ftp_child
 
 	char path[FTP_MAX_PATH];
 	char filename[FTP_MAX_NAME];
+	char filepath[FTP_MAX_REAL_PATH];
 	ftp_xfer_info_t xfer_info;
 
 	bool xfer_in_progress;
@@ -21,5 +21,7 @@ extern int add_command_list( const cmd_handler_t[] );
 /* According to man 3 readdir */
 #define D_NAME_MAX	256
 #define XFER_BLOCK_SIZE	( (off_t)4096 )
+#define STORE_BUFFER_SIZE	( (size_t)65536 )
+#define ZERO_BUFFER_SIZE	65536
 
 #endif /* __FTPCOMMAND_H__ */
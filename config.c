@@ -30,7 +30,16 @@ static config_table_t core_config_table[] =
 { "AllowAnonymous",TYPE_BOOL, &config.allow_anon },
 { "AllowSymlinks", TYPE_BOOL, &config.allow_links },
 { "AnonRootDir",   TYPE_STR,  &config.anon_root_dir },
+{ "DedupDir",      TYPE_STR,  &config.dedup_dir },
+{ "DedupMinSize",  TYPE_INT,  &config.dedup_min_size },
+{ "DeflateLevel",  TYPE_INT,  &config.deflate_level },
+{ "HotCacheMaxFile", TYPE_INT, &config.hot_cache_max_file },
+{ "HotCacheSize",  TYPE_INT,  &config.hot_cache_size },
+{ "HotCacheThreshold", TYPE_INT, &config.hot_cache_threshold },
 { "IdleTimeout",   TYPE_INT,  &config.idle_timeout },
+{ "ListCacheSize", TYPE_INT,  &config.list_cache_size },
+{ "ListCacheTime", TYPE_INT,  &config.list_cache_time },
+{ "ListThreads",   TYPE_INT,  &config.list_threads },
 { "LocalPort",     TYPE_INT,  &config.port},
 { "LogFile",       TYPE_STR,  &config.logfile },
 { "LogToFile",     TYPE_BOOL, &config.log_to_file },
@@ -38,8 +47,26 @@ static config_table_t core_config_table[] =
 { "MaxClients",    TYPE_INT,  &config.max_clients},
 { "PasvPortEnd",   TYPE_INT,  &config.pasv_port_end },
 { "PasvPortStart", TYPE_INT,  &config.pasv_port_start },
+{ "PopularityFile", TYPE_STR, &config.popular_file },
+{ "PrefetchFiles", TYPE_INT,  &config.prefetch_files },
+{ "PrefetchSize",  TYPE_INT,  &config.prefetch_size },
+{ "ReplicationPolicy", TYPE_STR, &config.replica_policy_name },
+{ "ReplicationQueue", TYPE_STR, &config.replica_queue },
+{ "ReplicationRules", TYPE_STR, &config.replica_rules },
 { "ServerName",    TYPE_STR,  &config.servername },
+{ "StagingDir",    TYPE_STR,  &config.staging_dir },
+{ "StagingSize",   TYPE_INT,  &config.staging_size },
+{ "StatCacheTime", TYPE_INT,  &config.stat_cache_time },
+{ "StatListSize",  TYPE_INT,  &config.stat_list_size },
+{ "TierDir",       TYPE_STR,  &config.tier_dir },
+{ "TierSize",      TYPE_INT,  &config.tier_size },
+{ "TierThreshold", TYPE_INT,  &config.tier_threshold },
 { "TransferRate",  TYPE_INT,  &config.throttle_rate },
+{ "UnionMinFree",  TYPE_INT,  &config.union_min_free },
+{ "UploadGroupCommit", TYPE_BOOL, &config.group_commit },
+{ "UploadSync",    TYPE_STR,  &config.upload_sync_name },
+{ "UploadSyncInterval", TYPE_INT, &config.upload_sync_interval },
+{ "WarmupSize",    TYPE_INT,  &config.warmup_size },
 {0}
 };
 
@@ -328,6 +355,35 @@ int load_defaults()
 	config.allow_links	= DEFAULT_ALLOW_LINKS;
 	config.syslog		= DEFAULT_SYSLOG;
 	config.allow_anon	= DEFAULT_ALLOW_ANON;
+	config.hot_cache_size	= DEFAULT_HOT_CACHE_SIZE;
+	config.hot_cache_threshold = DEFAULT_HOT_CACHE_THRESHOLD;
+	config.hot_cache_max_file = DEFAULT_HOT_CACHE_MAX_FILE;
+	config.prefetch_files	= DEFAULT_PREFETCH_FILES;
+	config.prefetch_size	= DEFAULT_PREFETCH_SIZE;
+	config.warmup_size	= DEFAULT_WARMUP_SIZE;
+	config.popular_file	= NULL;
+	config.upload_sync	= UPLOAD_SYNC_NONE;
+	config.upload_sync_name	= NULL;
+	config.upload_sync_interval = DEFAULT_UPLOAD_SYNC_INTERVAL;
+	config.group_commit	= DEFAULT_GROUP_COMMIT;
+	config.deflate_level	= DEFAULT_DEFLATE_LEVEL;
+	config.replica_policy	= REPLICA_FAIL;
+	config.replica_policy_name = NULL;
+	config.replica_rules	= NULL;
+	config.replica_queue	= NULL;
+	config.staging_dir	= NULL;
+	config.staging_size	= DEFAULT_STAGING_SIZE;
+	config.tier_dir		= NULL;
+	config.tier_size	= DEFAULT_TIER_SIZE;
+	config.tier_threshold	= DEFAULT_TIER_THRESHOLD;
+	config.union_min_free	= DEFAULT_UNION_MIN_FREE;
+	config.dedup_dir	= NULL;
+	config.dedup_min_size	= DEFAULT_DEDUP_MIN_SIZE;
+	config.stat_cache_time	= DEFAULT_STAT_CACHE_TIME;
+	config.stat_list_size	= DEFAULT_STAT_LIST_SIZE;
+	config.list_threads	= DEFAULT_LIST_THREADS;
+	config.list_cache_size	= DEFAULT_LIST_CACHE_SIZE;
+	config.list_cache_time	= DEFAULT_LIST_CACHE_TIME;
 	config.anon_root_dir	= NULL;
 	config.servername	= NULL;
 
@@ -383,6 +439,107 @@ static int check_config(void)
 		return FTP_ERROR;
 	}
 
+	if( config.hot_cache_size < 0 || config.hot_cache_max_file < 0 ||
+	    config.hot_cache_threshold < 1 )
+	{
+		log_fatal("Invalid hot file cache settings\n");
+		return FTP_ERROR;
+	}
+
+	if( config.prefetch_size < 0 )
+	{
+		log_fatal("Invalid prefetch size: %d kB\n",
+				config.prefetch_size );
+		return FTP_ERROR;
+	}
+
+	if( config.upload_sync_name == NULL ||
+	    strcasecmp( config.upload_sync_name, "none" ) == 0 )
+		config.upload_sync = UPLOAD_SYNC_NONE;
+	else if( strcasecmp( config.upload_sync_name, "close" ) == 0 )
+		config.upload_sync = UPLOAD_SYNC_CLOSE;
+	else if( strcasecmp( config.upload_sync_name, "writebehind" ) == 0 )
+		config.upload_sync = UPLOAD_SYNC_WRITEBEHIND;
+	else
+	{
+		log_fatal("Unknown upload sync policy: %s\n",
+				config.upload_sync_name );
+		return FTP_ERROR;
+	}
+
+	if( config.replica_policy_name == NULL ||
+	    strcasecmp( config.replica_policy_name, "fail" ) == 0 )
+		config.replica_policy = REPLICA_FAIL;
+	else if( strcasecmp( config.replica_policy_name, "degrade" ) == 0 )
+		config.replica_policy = REPLICA_DEGRADE;
+	else
+	{
+		log_fatal("Unknown replication policy: %s\n",
+				config.replica_policy_name );
+		return FTP_ERROR;
+	}
+
+	if( config.staging_size < 0 )
+	{
+		log_fatal("Invalid staging size: %d MB\n", config.staging_size );
+		return FTP_ERROR;
+	}
+
+	if( config.tier_size < 0 || config.tier_threshold < 1 )
+	{
+		log_fatal("Invalid cache tier size or threshold\n");
+		return FTP_ERROR;
+	}
+
+	if( config.dedup_min_size < 0 )
+	{
+		log_fatal("Invalid dedup minimum size: %d kB\n",
+				config.dedup_min_size );
+		return FTP_ERROR;
+	}
+
+	if( config.list_threads < 0 ||
+	    config.list_threads > STAT_POOL_MAX_THREADS )
+	{
+		log_fatal("Invalid number of list threads: %d\n",
+				config.list_threads );
+		return FTP_ERROR;
+	}
+
+	if( config.list_cache_size < 0 || config.list_cache_time < 0 )
+	{
+		log_fatal("Invalid listing cache size or time\n");
+		return FTP_ERROR;
+	}
+
+	if( config.stat_cache_time < 0 )
+	{
+		log_fatal("Invalid stat cache time: %d ms\n",
+				config.stat_cache_time );
+		return FTP_ERROR;
+	}
+
+	if( config.stat_list_size < 0 ||
+	    config.stat_list_size > STREAM_BUFFER_SIZE / 1024 )
+	{
+		log_fatal("Invalid STAT listing size: %d kB\n",
+				config.stat_list_size );
+		return FTP_ERROR;
+	}
+
+	if( config.deflate_level < 1 || config.deflate_level > 9 )
+	{
+		log_fatal("Invalid deflate level: %d\n", config.deflate_level );
+		return FTP_ERROR;
+	}
+
+	if( config.upload_sync_interval < 1 )
+	{
+		log_fatal("Invalid upload sync interval: %d MB\n",
+				config.upload_sync_interval );
+		return FTP_ERROR;
+	}
+
 	if( config.allow_anon && config.anon_root_dir == NULL )
 	{
 		log_fatal("No anonymous root directory set\n");
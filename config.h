@@ -19,6 +19,13 @@ enum parse_error
 	FTP_PARSER_NOMEM
 };
 
+enum upload_sync
+{
+	UPLOAD_SYNC_NONE,		/* Leave it to the kernel */
+	UPLOAD_SYNC_CLOSE,		/* fdatasync before replying */
+	UPLOAD_SYNC_WRITEBEHIND		/* Write back every few MB */
+};
+
 typedef struct ftp_config 
 {
 	int port;
@@ -28,14 +35,43 @@ typedef struct ftp_config
 	int pasv_port_start;
 	int pasv_port_end;
 	int idle_timeout;
+	int hot_cache_size;
+	int hot_cache_threshold;
+	int hot_cache_max_file;
+	int prefetch_files;
+	int prefetch_size;
+	int warmup_size;
+	int upload_sync;
+	int upload_sync_interval;
+	int deflate_level;
+	int replica_policy;
+	int staging_size;
+	int tier_size;
+	int tier_threshold;
+	int union_min_free;
+	int dedup_min_size;
+	int stat_cache_time;
+	int stat_list_size;
+	int list_threads;
+	int list_cache_size;
+	int list_cache_time;
 	bool debug;
 	bool allow_anon;
 	bool allow_links;
 	bool log_to_file;
 	bool syslog;
+	bool group_commit;
 	char *anon_root_dir;
 	char *servername;
 	char *logfile;
+	char *popular_file;
+	char *upload_sync_name;
+	char *replica_policy_name;
+	char *replica_rules;
+	char *replica_queue;
+	char *staging_dir;
+	char *tier_dir;
+	char *dedup_dir;
 } ftp_config_t;
 
 extern const char *config_path;
@@ -54,5 +90,24 @@ extern ftp_config_t config;
 #define DEFAULT_DEBUG			false
 #define DEFAULT_ALLOW_LINKS		false
 #define DEFAULT_SYSLOG			false
+#define DEFAULT_HOT_CACHE_SIZE		0
+#define DEFAULT_HOT_CACHE_THRESHOLD	16
+#define DEFAULT_HOT_CACHE_MAX_FILE	1024
+#define DEFAULT_PREFETCH_FILES		4
+#define DEFAULT_PREFETCH_SIZE		1024
+#define DEFAULT_WARMUP_SIZE		0
+#define DEFAULT_UPLOAD_SYNC_INTERVAL	8
+#define DEFAULT_GROUP_COMMIT		false
+#define DEFAULT_DEFLATE_LEVEL		6
+#define DEFAULT_STAGING_SIZE		1024
+#define DEFAULT_TIER_SIZE		10240
+#define DEFAULT_TIER_THRESHOLD		4
+#define DEFAULT_UNION_MIN_FREE		1024
+#define DEFAULT_DEDUP_MIN_SIZE		64
+#define DEFAULT_STAT_CACHE_TIME		1000
+#define DEFAULT_STAT_LIST_SIZE		16
+#define DEFAULT_LIST_THREADS		0
+#define DEFAULT_LIST_CACHE_SIZE		0
+#define DEFAULT_LIST_CACHE_TIME		30
 
 #endif /* __FTPCONFIG_H__ */
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#include <arpa/inet.h>
 
 #include "ftp.h"
 
@@ -23,6 +24,10 @@ static cmd_handler_t core_command_list[] = {
 	{ "LIST", &dolist, true,  true , false },
 	{ "MDTM", &domdtm, true,  false, true  },
 	{ "MKD",  &domkd,  true,  false, true  },
+	{ "MLSD", &domlsd, true,  true , false },
+	{ "MLST", &domlst, true,  false, false },
+	{ "MODE", &domode, true,  false, true  },
+	{ "NLST", &donlst, true,  true , false },
 	{ "NOOP", &donoop, false, false, false },
 	{ "OPTS", &doopts, false, false, false },
 	{ "PASS", &dopass, false, false, false },
@@ -33,7 +38,9 @@ static cmd_handler_t core_command_list[] = {
 	{ "DELE", &dodele, true,  false, true  },
 	{ "RETR", &doretr, true,  true , true  },
 	{ "RMD",  &dormd,  true,  false, true  },
+	{ "SITE", &dosite, true,  false, true  },
 	{ "SIZE", &dosize, true,  false, true  },
+	{ "STAT", &dostat, true,  false, false },
 	{ "SYST", &dosyst, false, false, false },
 	{ "TYPE", &dotype, true,  false, true  },
 	{ "USER", &douser, false, false, false },
@@ -95,6 +102,93 @@ int dotype (ftp_session_t *session)
 }
 
 		
+int domode (ftp_session_t *session)
+{
+	ftp_conn_t *conn = &session->conn;
+
+	/* A data connection kept open by MODE B is of no use to another */
+	if( conn->data_sock >= 0 )
+	{
+		close( conn->data_sock );
+		conn->data_sock = -1;
+	}
+
+	switch( toupper( session->command.arg[0] ) )
+	{
+	case 'S':
+		session->mode = XFER_MODE_STREAM;
+		reply(conn, "200 MODE is now STREAM\r\n");
+		break;
+	case 'B':
+		session->mode = XFER_MODE_BLOCK;
+		reply(conn, "200 MODE is now BLOCK\r\n");
+		break;
+	case 'Z':
+		session->mode = XFER_MODE_DEFLATE;
+		reply(conn, "200 MODE is now DEFLATE\r\n");
+		break;
+	default:
+		reply(conn, "504 Unsupported transfer mode\r\n");
+		break;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Buffered writer on the data connection, which compresses in MODE Z */
+int data_outbuf( ftp_session_t *session, outbuf_t *out, int fd )
+{
+	if( outbuf_init( out, fd ) != FTP_SUCCESS )
+		return FTP_ERROR;
+
+	if( session->mode == XFER_MODE_BLOCK )
+		outbuf_block( out );
+
+	if( session->mode == XFER_MODE_DEFLATE &&
+	    outbuf_deflate( out, config.deflate_level ) != FTP_SUCCESS )
+	{
+		outbuf_free( out );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Buffered reader on the data connection, which decompresses in MODE Z */
+int data_inbuf( ftp_session_t *session, inbuf_t *in, int fd )
+{
+	if( inbuf_init( in, fd ) != FTP_SUCCESS )
+		return FTP_ERROR;
+
+	if( session->mode == XFER_MODE_BLOCK )
+		inbuf_block( in );
+
+	if( session->mode == XFER_MODE_DEFLATE &&
+	    inbuf_inflate( in ) != FTP_SUCCESS )
+	{
+		inbuf_free( in );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Done with the data connection. In MODE B it stays open for the next
+ * transfer, unless this one went wrong */
+void close_data_conn( ftp_session_t *session, int status )
+{
+	ftp_conn_t *conn = &session->conn;
+
+	if( conn->data_sock < 0 )
+		return;
+
+	if( session->mode == XFER_MODE_BLOCK && status == FTP_SUCCESS )
+		return;
+
+	close( conn->data_sock );
+	conn->data_sock = -1;
+}
+
 int dopwd (ftp_session_t *session)
 {
 	ftp_conn_t *conn = &session->conn;
@@ -149,6 +243,12 @@ int dopasv (ftp_session_t *session)
 		close(conn->pasv_sock);
 		conn->pasv_sock = -1;
 	}
+
+	if( conn->data_sock >= 0 )
+	{
+		close( conn->data_sock );
+		conn->data_sock = -1;
+	}
 	
 	/* param now contains our own IP in big endian */
 	memcpy( ip, &conn->host_addr.s_addr, 4 );
@@ -230,7 +330,7 @@ int domdtm (ftp_session_t *session)
 
 	/* This will need exactly 14 bytes and a nul byte */
 	snprintf(date, 15, "%04d%02d%02d%02d%02d%02d", 
-		tm.tm_year + 1900, tm.tm_mon, tm.tm_mday, 
+		tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, 
 		tm.tm_hour, tm.tm_min, tm.tm_sec );
 	
 	reply_format(conn, "213 %s\r\n", date );
@@ -245,6 +345,50 @@ int doquit (ftp_session_t *session)
 }
 
 
+/* STAT with a path lists it, see stat_listing(). Without one it tells how
+ * the session is doing */
+int dostat (ftp_session_t *session)
+{
+	char *arg = trim_whitespace( session->command.arg );
+	ftp_conn_t *conn = &session->conn;
+	ftp_xfer_info_t *info = &session->info;
+
+	if( *arg != '\0' )
+		return stat_listing( session, arg );
+
+	reply( conn, "211-FTP server status:\r\n" );
+	reply_format( conn, " Connected from %s\r\n",
+			inet_ntoa( conn->client_addr ) );
+	reply_format( conn, " Logged in as %s\r\n",
+			session->login.anonymous ? "anonymous" :
+			session->login.user );
+	reply_format( conn, " Working directory is %s\r\n",
+			session->virt_path );
+	reply_format( conn, " MODE %c\r\n", session->mode );
+
+	if( conn->data_sock != -1 )
+		reply( conn, " Data connection open\r\n" );
+	else if( conn->pasv_sock != -1 )
+		reply( conn, " Waiting for a passive data connection\r\n" );
+	else
+		reply( conn, " No data connection\r\n" );
+
+	if( session->restart_pos > 0 )
+		reply_format( conn, " Restarting at %lld\r\n",
+				(long long) session->restart_pos );
+
+	reply_format( conn, " %llu kB downloaded, %llu kB uploaded\r\n",
+			(unsigned long long) info->total_down / 1024,
+			(unsigned long long) info->total_up / 1024 );
+	reply_format( conn, " %llu files read ahead, %llu of them "
+			"retrieved\r\n",
+			(unsigned long long) info->prefetch_issued,
+			(unsigned long long) info->prefetch_hits );
+	reply( conn, "211 End of status\r\n" );
+
+	return FTP_SUCCESS;
+}
+
 int dofeat (ftp_session_t *session)
 {
 	ftp_conn_t *conn = &session->conn;
@@ -252,6 +396,8 @@ int dofeat (ftp_session_t *session)
 	reply(conn, "211-Extensions supported:\r\n");
 	reply(conn, " SIZE\r\n");
 	reply(conn, " MDTM\r\n");
+	reply(conn, " MODE Z\r\n");
+	mlst_feature( session );
 	reply(conn, "211 End.\r\n");
 
 	return FTP_SUCCESS;
@@ -259,6 +405,12 @@ int dofeat (ftp_session_t *session)
 
 int doopts (ftp_session_t *session)
 {
+	char *arg = trim_whitespace( session->command.arg );
+
+	if( strncasecmp( arg, "MLST", 4 ) == 0 &&
+	    ( arg[4] == '\0' || isblank( arg[4] ) ) )
+		return mlst_options( session, arg + 4 );
+
 	reply( &session->conn, "501 No such command\r\n");
 	return FTP_SUCCESS;
 }
@@ -290,28 +442,24 @@ int dorest( ftp_session_t *session )
 	return FTP_SUCCESS;
 }
 
-static int transfer_file
+/* Send COUNT bytes of FILE starting at FILE_OFFSET with sendfile */
+static int send_file_range
 	( ftp_session_t *session, stream_t data, stream_t file, 
 	  off_t file_offset, off_t count)
 {
-	int blocks, i, ret;
-	off_t remainder, remainder_offset;
-
-	gettimeofday( &session->info.xfer_start, NULL );
-	session->info.xfer_probe = session->info.xfer_start;
-	session->info.xfer_len = session->info.probe_len = 0;
-	blocks =    count / XFER_BLOCK_SIZE;
-	remainder = count % XFER_BLOCK_SIZE;
+	off_t end = file_offset + count;
+	ssize_t ret;
 
 	/* Send blocks of data and throttle the connection.
 	 * This is a busy loop, so handle signals */
-	for( i = 0; i < blocks; i++ )
+	while( file_offset < end )
 	{
-		off_t block_offset = file_offset + i * XFER_BLOCK_SIZE;
+		size_t len = end - file_offset < XFER_BLOCK_SIZE ?
+				end - file_offset : XFER_BLOCK_SIZE;
 
 		while( (ret = 
-			splice_stream( data, NULL, file, &block_offset, 
-				XFER_BLOCK_SIZE )) == -1 )
+			splice_stream( data, NULL, file, &file_offset, len ))
+				== -1 )
 		{
 			switch( errno )
 			{
@@ -330,89 +478,568 @@ static int transfer_file
 			}
 		}
 
+		/* The file shrunk under our feet */
 		if( ret == 0 )
 			return FTP_ABOR;
 
-		session->info.xfer_len  += XFER_BLOCK_SIZE;
-		session->info.probe_len += XFER_BLOCK_SIZE;
+		session->info.xfer_len  += ret;
+		session->info.probe_len += ret;
 
 		throttle_pause( session );
 
 		if( server_handle_signal() )
 			return FTP_QUIT;
 	}
-	
-	/* Send the remaining data < XFER_BLOCK_SIZE */
 
-	remainder_offset = file_offset + count - remainder;
+	return FTP_SUCCESS;
+}
+
+/* A hole in a sparse file reads as zeros, so don't bother the disk */
+static int send_zeros( ftp_session_t *session, stream_t data, off_t count )
+{
+	static char zeros[ZERO_BUFFER_SIZE];
 
-	while( splice_stream( data, NULL, file, &remainder_offset, 
-			remainder ) == -1 )
+	while( count > 0 )
 	{
-		switch( errno )
+		size_t len = count < ZERO_BUFFER_SIZE ? count : ZERO_BUFFER_SIZE;
+
+		if( sendall( data.fd, zeros, len, 0 ) == -1 )
 		{
-		case EINTR:
-			if( server_handle_signal() )
-				return FTP_QUIT;
-			else
+			if( errno == EPIPE || errno == ECONNRESET )
+				return FTP_ABOR;
+			log_fatal("Send error: %m\n");
+			return FTP_ERROR;
+		}
+
+		count -= len;
+		session->info.xfer_len  += len;
+		session->info.probe_len += len;
+
+		throttle_pause( session );
+
+		if( server_handle_signal() )
+			return FTP_QUIT;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* In MODE Z the file has to pass through the compressor, so it is read
+ * instead of being sent with sendfile */
+static int deflate_file_range
+	( ftp_session_t *session, outbuf_t *out, stream_t file,
+	  off_t file_offset, off_t count )
+{
+	static char buf[STREAM_BUFFER_SIZE];
+	off_t end = file_offset + count;
+	ssize_t ret;
+
+	while( file_offset < end )
+	{
+		size_t len = end - file_offset < STREAM_BUFFER_SIZE ?
+				end - file_offset : STREAM_BUFFER_SIZE;
+
+		ret = pread( file.fd, buf, len, file_offset );
+		if( ret == -1 )
+		{
+			if( errno == EINTR )
 				continue;
-			break;
-		case EPIPE:
-		case ECONNRESET:
+			log_warn("Read error: %m\n");
+			return FTP_ERROR;
+		}
+
+		/* The file shrunk under our feet */
+		if( ret == 0 )
 			return FTP_ABOR;
-		default:
-			log_fatal("Splice error: %m\n");
+
+		if( outbuf_write( out, buf, ret ) == -1 )
+		{
+			if( errno == EPIPE || errno == ECONNRESET )
+				return FTP_ABOR;
+			log_fatal("Send error: %m\n");
 			return FTP_ERROR;
 		}
-	}
 
-	session->info.xfer_len += remainder;
+		file_offset += ret;
+		session->info.xfer_len  += ret;
+		session->info.probe_len += ret;
+
+		throttle_pause( session );
+
+		if( server_handle_signal() )
+			return FTP_QUIT;
+	}
 
 	return FTP_SUCCESS;
 }
 
-int store_file( ftp_session_t *session, stream_t file, stream_t data )
+/* Send COUNT bytes of FILE, or zeros for a HOLE. In MODE B each chunk
+ * handed to sendfile gets a block header of its own */
+static int send_range
+	( ftp_session_t *session, outbuf_t *out, stream_t data, stream_t file,
+	  off_t file_offset, off_t count, bool hole )
+{
+	int ret = FTP_SUCCESS;
+
+	if( !out->block )
+		return hole ? send_zeros( session, data, count ) :
+			send_file_range( session, data, file, file_offset,
+					count );
+
+	while( count > 0 && ret == FTP_SUCCESS )
+	{
+		off_t len = count < BLOCK_MAX_SIZE ? count : BLOCK_MAX_SIZE;
+
+		if( send_block_header( data.fd, 0, len ) == -1 )
+		{
+			if( errno == EPIPE || errno == ECONNRESET )
+				return FTP_ABOR;
+			log_fatal("Send error: %m\n");
+			return FTP_ERROR;
+		}
+
+		ret = hole ? send_zeros( session, data, len ) :
+			send_file_range( session, data, file, file_offset,
+					len );
+
+		file_offset += len;
+		count -= len;
+	}
+
+	return ret;
+}
+
+/* Send COUNT bytes of FILE, starting at FILE_OFFSET, after whatever OUT
+ * still holds. If the file is SPARSE, the holes are found with SEEK_DATA
+ * and SEEK_HOLE and sent as zeros */
+int send_file
+	( ftp_session_t *session, outbuf_t *out, stream_t file,
+	  off_t file_offset, off_t count, bool sparse )
+{
+	off_t end = file_offset + count;
+	stream_t data;
+	int ret = FTP_SUCCESS;
+
+	if( out->z )
+		return deflate_file_range( session, out, file, file_offset,
+				count );
+
+	if( outbuf_flush( out ) == -1 )
+	{
+		if( errno == EPIPE || errno == ECONNRESET )
+			return FTP_ABOR;
+		log_fatal("Send error: %m\n");
+		return FTP_ERROR;
+	}
+
+	data.fd = out->fd;
+	data.type = S_SOCKET;
+
+	while( file_offset < end && ret == FTP_SUCCESS )
+	{
+		off_t data_start = file_offset, data_end = end;
+
+		if( sparse )
+		{
+			data_start = lseek( file.fd, file_offset, SEEK_DATA );
+			if( data_start == -1 && errno == ENXIO )
+				data_start = end; /* Only a hole left */
+			else if( data_start == -1 )
+				data_start = file_offset;
+			else
+				data_end = lseek( file.fd, data_start,
+						SEEK_HOLE );
+
+			if( data_start > end )
+				data_start = end;
+			if( data_end == -1 || data_end > end )
+				data_end = end;
+		}
+
+		if( data_start > file_offset )
+		{
+			ret = send_range( session, out, data, file,
+					file_offset, data_start - file_offset,
+					true );
+			file_offset = data_start;
+			continue;
+		}
+
+		ret = send_range( session, out, data, file, file_offset,
+				data_end - file_offset, false );
+		file_offset = data_end;
+	}
+
+	return ret;
+}
+
+static int transfer_file
+	( ftp_session_t *session, outbuf_t *out, stream_t file,
+	  off_t file_offset, off_t count, bool sparse )
 {
 	int ret;
+
+	gettimeofday( &session->info.xfer_start, NULL );
+	session->info.xfer_probe = session->info.xfer_start;
+	session->info.xfer_len = session->info.probe_len = 0;
+
+	ret = send_file( session, out, file, file_offset, count, sparse );
+
+	if( ret == FTP_SUCCESS && outbuf_finish( out ) == -1 )
+	{
+		if( errno == EPIPE || errno == ECONNRESET )
+			return FTP_ABOR;
+		log_fatal("Send error: %m\n");
+		return FTP_ERROR;
+	}
+
+	return ret;
+}
+
+static bool is_hole_block( const char *buf, size_t len, size_t pos,
+		off_t offset, off_t sparse_from, size_t blksize )
+{
+	return	offset + (off_t) pos >= sparse_from &&
+		( offset + pos ) % blksize == 0 &&
+		pos + blksize <= len &&
+		is_zero_block( buf + pos, blksize );
+}
+
+/* Write LEN bytes of BUF at OFFSET, but skip the aligned blocks of zeros
+ * past SPARSE_FROM. Those are left as holes.
+ * TAIL_HOLE tells whether the last block was skipped */
+static int write_sparse( int fd, const char *buf, size_t len, off_t offset,
+		off_t sparse_from, size_t blksize, bool *tail_hole )
+{
+	size_t pos = 0, end;
+
+	while( pos < len )
+	{
+		if( is_hole_block( buf, len, pos, offset, sparse_from,
+					blksize ) )
+		{
+			*tail_hole = true;
+			pos += blksize;
+			continue;
+		}
+
+		/* Gather everything up to the next block of zeros */
+		end = pos + blksize - ( offset + pos ) % blksize;
+		while( end < len && !is_hole_block( buf, len, end, offset,
+					sparse_from, blksize ) )
+			end += blksize;
+		if( end > len )
+			end = len;
+
+		if( pwriteall( fd, buf + pos, end - pos, offset + pos ) == -1 )
+			return FTP_ERROR;
+
+		*tail_hole = false;
+		pos = end;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Splice LEN bytes out of the pipe PIPEFD into FD at OFFSET */
+static int splice_all( int pipefd, int fd, off_t *offset, size_t len )
+{
+	while( len > 0 )
+	{
+		ssize_t done;
+
+		done = splice( pipefd, NULL, fd, offset, len, SPLICE_F_MOVE );
+		if( done == -1 && errno == EINTR )
+			continue;
+		if( done <= 0 )
+			return -1;
+
+		len -= done;
+	}
+
+	return 0;
+}
+
+/* MODE S upload with a secondary copy. The data goes from the socket into
+ * a pipe, tee() duplicates it into a second pipe, and each pipe is spliced
+ * into its file, so both copies are written without a pass through user
+ * space. Blocks of zeros are written out here, there is no buffer to look
+ * for them in */
+static int store_tee( ftp_session_t *session, stream_t file, stream_t data,
+		replica_t *rep )
+{
+	int ret = FTP_SUCCESS;
+	int in[2], copy[2];
 	off_t offset = session->restart_pos;
+	off_t rep_offset = offset;
+	writeback_t wb;
+
+	if( pipe( in ) == -1 )
+	{
+		log_warn("Unable to create pipe: %m\n");
+		return FTP_ERROR;
+	}
+
+	if( pipe( copy ) == -1 )
+	{
+		log_warn("Unable to create pipe: %m\n");
+		close( in[0] );
+		close( in[1] );
+		return FTP_ERROR;
+	}
+
+	/* Bigger pipes mean fewer trips through the loop. Not fatal */
+	fcntl( in[1], F_SETPIPE_SZ, REPLICA_PIPE_SIZE );
+	fcntl( copy[1], F_SETPIPE_SZ, REPLICA_PIPE_SIZE );
 
 	gettimeofday( &session->info.xfer_start, NULL );
 	session->info.xfer_probe = session->info.xfer_start;
 	session->info.xfer_len = session->info.probe_len = 0;
+	writeback_begin( &wb, offset );
 
-	while(ret = splice_stream( file, &offset, data, 0, XFER_BLOCK_SIZE))
+	for(;;)
 	{
-		if( ret == -1 )
+		ssize_t len;
+
+		len = splice( data.fd, NULL, in[1], NULL, REPLICA_PIPE_SIZE,
+				SPLICE_F_MOVE | SPLICE_F_MORE );
+		if( len == -1 )
 		{
 			switch(errno)
 			{
 			case EINTR:
 				if( server_handle_signal() )
-					return FTP_QUIT;
+					ret = FTP_QUIT;
 				else
 					continue;
 				break;
 			case EPIPE:
 			case ECONNRESET:
-				return FTP_ABOR;
+				ret = FTP_ABOR;
+				break;
 			default:
-				log_fatal("Splice error: %m\n");
-				return FTP_ERROR;
+				log_fatal("Receive error: %m\n");
+				ret = FTP_ERROR;
+				break;
+			}
+			break;
+		}
+
+		if( len == 0 )
+			break;
+
+		session->info.probe_len += len;
+		session->info.xfer_len  += len;
+
+		/* tee() always starts at the front of the pipe, so whatever it
+		 * duplicated has to be consumed before the next round */
+		while( len > 0 && ret == FTP_SUCCESS )
+		{
+			ssize_t n = len;
+
+			if( rep->fd != -1 )
+			{
+				n = tee( in[0], copy[1], len, 0 );
+				if( n == -1 && errno == EINTR )
+					continue;
+				if( n <= 0 )
+				{
+					log_warn("Unable to duplicate upload: %m\n");
+					ret = FTP_ERROR;
+					break;
+				}
+
+				if( splice_all( copy[0], rep->fd, &rep_offset, n )
+						== -1 )
+					ret = replica_failed( rep );
+			}
+
+			if( ret == FTP_SUCCESS &&
+			    splice_all( in[0], file.fd, &offset, n ) == -1 )
+			{
+				log_warn("Unable to write upload: %m\n");
+				ret = FTP_ERROR;
+			}
+
+			len -= n;
+		}
+
+		if( ret != FTP_SUCCESS )
+			break;
+
+		writeback_written( &wb, file.fd, offset );
+
+		throttle_pause( session );
+
+		if( signal_flag )
+			if( server_handle_signal() )
+			{
+				ret = FTP_QUIT;
+				break;
+			}
+	}
+
+	close( in[0] );
+	close( in[1] );
+	close( copy[0] );
+	close( copy[1] );
+
+	if( ret != FTP_SUCCESS )
+		return ret;
+
+	return writeback_finish( &wb, file.fd, offset );
+}
+
+int store_file( ftp_session_t *session, stream_t file, stream_t data,
+		replica_t *rep, sha256_t *sha )
+{
+	int ret = FTP_SUCCESS;
+	off_t offset = session->restart_pos;
+	off_t sparse_from;
+	size_t blksize, bufsize, have = 0;
+	bool tail_hole = false, rep_tail_hole = false, eof = false;
+	bool unpack = ( session->mode != XFER_MODE_STREAM );
+	struct stat st;
+	writeback_t wb;
+	inbuf_t in;
+	char *buf;
+
+	if( fstat( file.fd, &st ) == -1 )
+	{
+		log_warn("Unable to stat upload: %m\n");
+		return FTP_ERROR;
+	}
+
+	/* Hashing needs the data in user space anyway */
+	if( !unpack && rep->fd != -1 && sha == NULL )
+		return store_tee( session, file, data, rep );
+
+	/* Zeros past the current end of the file don't need to be written,
+	 * that part of the file reads back as zeros anyway */
+	sparse_from = st.st_size;
+	blksize = st.st_blksize > 0 ? st.st_blksize : 4096;
+	bufsize = STORE_BUFFER_SIZE > 2 * blksize ? STORE_BUFFER_SIZE :
+			2 * blksize;
+
+	buf = malloc( bufsize );
+	if( buf == NULL )
+	{
+		FATAL_MEM( bufsize );
+		return FTP_ERROR;
+	}
+
+	/* MODE B and MODE Z need the data taken out of the stream */
+	if( unpack && data_inbuf( session, &in, data.fd ) != FTP_SUCCESS )
+	{
+		free( buf );
+		return FTP_ERROR;
+	}
+
+	gettimeofday( &session->info.xfer_start, NULL );
+	session->info.xfer_probe = session->info.xfer_start;
+	session->info.xfer_len = session->info.probe_len = 0;
+	writeback_begin( &wb, offset );
+
+	while( !eof )
+	{
+		ssize_t len;
+		size_t flush, tail;
+
+		if( unpack )
+			len = inbuf_read( &in, buf + have, bufsize - have );
+		else
+			len = read( data.fd, buf + have, bufsize - have );
+		if( len == -1 )
+		{
+			switch(errno)
+			{
+			case EINTR:
+				if( server_handle_signal() )
+					ret = FTP_QUIT;
+				else
+					continue;
+				break;
+			case EPIPE:
+			case ECONNRESET:
+				ret = FTP_ABOR;
+				break;
+			default:
+				log_fatal("Receive error: %m\n");
+				ret = FTP_ERROR;
+				break;
 			}
+			break;
 		}
 		
-		session->info.probe_len += ret;
-		session->info.xfer_len  += ret;
+		eof = ( len == 0 );
+		have += len;
+
+		session->info.probe_len += len;
+		session->info.xfer_len  += len;
+
+		/* Keep a partial block around until the rest of it arrives,
+		 * so blocks of zeros split over two reads are still found.
+		 * After REST the first block can start before this buffer,
+		 * only the part of it in here is held back. The buffer holds
+		 * two blocks, so it can't fill up with what is held back */
+		tail = eof ? 0 : ( offset + have ) % blksize;
+		flush = tail < have ? have - tail : 0;
+		if( flush == 0 )
+			continue;
+
+		if( sha )
+			sha256_update( sha, buf, flush );
+
+		if( write_sparse( file.fd, buf, flush, offset, sparse_from,
+				blksize, &tail_hole ) != FTP_SUCCESS )
+		{
+			log_warn("Unable to write upload: %m\n");
+			ret = FTP_ERROR;
+			break;
+		}
+
+		/* The copy starts out as empty as the upload, so its holes
+		 * are in the same places */
+		if( rep->fd != -1 && write_sparse( rep->fd, buf, flush, offset,
+				sparse_from, blksize, &rep_tail_hole ) != FTP_SUCCESS &&
+		    ( ret = replica_failed( rep ) ) != FTP_SUCCESS )
+			break;
+
+		memmove( buf, buf + flush, have - flush );
+		have -= flush;
+		offset += flush;
+
+		writeback_written( &wb, file.fd, offset );
 
 		throttle_pause( session );
 
 		if( signal_flag )
 			if( server_handle_signal() )
-				return FTP_QUIT;
+			{
+				ret = FTP_QUIT;
+				break;
+			}
+	}
+
+	free( buf );
+	if( unpack )
+		inbuf_free( &in );
+
+	if( ret != FTP_SUCCESS )
+		return ret;
 
+	/* Nothing was written for the zeros at the end */
+	if( tail_hole && ftruncate( file.fd, offset ) == -1 )
+	{
+		log_warn("Unable to extend upload: %m\n");
+		return FTP_ERROR;
 	}
 
-	return FTP_SUCCESS;
+	if( rep_tail_hole && rep->fd != -1 && ftruncate( rep->fd, offset ) == -1 )
+		if( replica_failed( rep ) != FTP_SUCCESS )
+			return FTP_FAIL;
+
+	return writeback_finish( &wb, file.fd, offset );
 
 }
 
@@ -424,7 +1051,9 @@ int doretr (ftp_session_t *session)
 	off_t filesize, offset;
 	ftp_conn_t *conn = &session->conn;
 	int ret, fd;
-	stream_t file, data;
+	bool cached;
+	stream_t file;
+	outbuf_t out;
 
 	basename = find_basename( argument );
 
@@ -441,43 +1070,66 @@ int doretr (ftp_session_t *session)
 		return FTP_SUCCESS;
 	}
 	
+	/* A whole directory goes out as one tar archive */
+	if( S_ISDIR( statfile.st_mode ) )
+		return send_tar( session, argument );
+
 	if( !S_ISREG( statfile.st_mode ) )
 	{
 		reply( conn, "550 Can only retrieve regular files\r\n" );
 		return FTP_SUCCESS;
 	}
 
-	fd = vfs_open( session->virt_path, argument, O_RDONLY );
+	/* Not fatal, the masterserver just won't see which file it was */
+	vfs_resolve( session->virt_path, argument, session->filepath,
+			FTP_MAX_REAL_PATH );
+
+	/* Popular files are served straight from memory */
+	fd = hot_cache_lookup( &statfile );
+	cached = ( fd != -1 );
+
+	if( !cached )
+		fd = vfs_open( session->virt_path, argument, O_RDONLY );
 	if( fd == -1 )
 	{
 		failed_vfs_reply( conn );
 		return FTP_SUCCESS;
 	}
+
+	/* The stat above may come from the cache, or from an index that was
+	 * left behind as out of date while opening. The size sent has to be
+	 * that of the file that is open */
+	if( !cached && vfs_fstat( fd, &statfile ) == -1 )
+	{
+		vfs_close( fd );
+		failed_vfs_reply( conn );
+		return FTP_SUCCESS;
+	}
 	file.fd = fd;
 	file.type = S_FILE;
 
 	conn->data_sock = accept_data_conn( conn );
 	if( conn->data_sock == -1 )
 	{
-		vfs_close(fd);
+		if( !cached )
+			vfs_close(fd);
 		return FTP_SUCCESS;
 	}
 	else if( conn->data_sock == -2 )
 	{
-		vfs_close(fd);
+		if( !cached )
+			vfs_close(fd);
 		return FTP_QUIT;
 	}
 
-	data.fd = conn->data_sock;
-	data.type = S_SOCKET;
-
 	offset = session->restart_pos;
 	filesize = statfile.st_size;
 
 	if( offset > filesize )
 	{
-		vfs_close( fd );
-		close( conn->data_sock );
+		if( !cached )
+			vfs_close( fd );
+		close_data_conn( session, FTP_SUCCESS );
 		reply_format(conn,
 			"451 Restarting position %llu too "
 			"large for file %s of size %llu\r\n",
@@ -487,12 +1139,27 @@ int doretr (ftp_session_t *session)
 		return FTP_SUCCESS;
 	}
 
+	if( data_outbuf( session, &out, conn->data_sock ) != FTP_SUCCESS )
+	{
+		if( !cached )
+			vfs_close( fd );
+		close_data_conn( session, FTP_ERROR );
+		reply(conn, "451 Local error in processing\r\n");
+		return FTP_SUCCESS;
+	}
+
 	reply(conn, "125 Data connection OK, transfer starting\r\n");
 	session->info.xfer_status = 0;
+	session->info.upload = false;
+
+	prefetch_next( session, argument );
 
 	send_state( session, T_XFER_START );
 
-	ret = transfer_file(session, data, file, offset, filesize - offset);
+	/* Fewer blocks than the size needs means there are holes */
+	ret = transfer_file(session, &out, file, vfs_offset( fd ) + offset,
+			filesize - offset, statfile.st_blocks * 512 < filesize );
+	outbuf_free( &out );
 
 	if( ret == FTP_SUCCESS )
 		reply(conn, "226 File transfer successful\r\n");
@@ -507,8 +1174,10 @@ int doretr (ftp_session_t *session)
 	
 	send_state( session, T_XFER_STOP );
 
-	vfs_close(fd);
-	close(conn->data_sock);
+	/* The memfd is shared by every transfer of this file */
+	if( !cached )
+		vfs_close(fd);
+	close_data_conn( session, ret );
 
 	return FTP_SUCCESS;
 }
@@ -520,6 +1189,10 @@ int dostor( ftp_session_t *session )
 	const char *basename;
 	int fd, ret;
 	stream_t file, data;
+	replica_t rep;
+	staging_t stage;
+	sha256_t sha;
+	bool hash;
 
 	basename = find_basename( pathname );
 
@@ -530,38 +1203,88 @@ int dostor( ftp_session_t *session )
 		return FTP_SUCCESS;
 	}
 
-	fd = vfs_creat( session->virt_path, pathname, 0777 );
-	if( fd  == -1 )
+	vfs_resolve( session->virt_path, pathname, session->filepath,
+			FTP_MAX_REAL_PATH );
+
+	if( vfs_virtual( session->virt_path, pathname, session->virt_filepath,
+			FTP_MAX_PATH ) == -1 )
 	{
 		failed_vfs_reply( conn );
 		return FTP_SUCCESS;
 	}
-	file.fd = fd;
-	file.type = S_FILE;
 
-	fd = accept_data_conn( conn );
-	if( fd == -1 )
+	/* The secondary copy goes first, there is nothing to undo if the
+	 * policy doesn't allow going on without it */
+	if( replica_open( &rep, session->virt_filepath ) != FTP_SUCCESS )
 	{
-		vfs_close( fd );
+		reply(conn, "451 Unable to write secondary copy\r\n");
 		return FTP_SUCCESS;
 	}
-	else if( fd == -2 )
+
+	/* Staged uploads leave an empty file in place until the migrator
+	 * moves them there. It is created while the staged file is locked */
+	staging_open( &stage, session->filepath );
+
+	fd = vfs_creat( session->virt_path, pathname, 0777 );
+	if( fd  == -1 )
+	{
+		staging_close( &stage, FTP_FAIL );
+		replica_close( &rep, FTP_FAIL );
+		failed_vfs_reply( conn );
+		return FTP_SUCCESS;
+	}
+	file.fd = stage.fd != -1 ? stage.fd : fd;
+	file.type = S_FILE;
+
+	conn->data_sock = accept_data_conn( conn );
+	if( conn->data_sock < 0 )
 	{
 		vfs_close( fd );
-		return FTP_QUIT;
+		staging_close( &stage, FTP_FAIL );
+		replica_close( &rep, FTP_FAIL );
+		return conn->data_sock == -1 ? FTP_SUCCESS : FTP_QUIT;
 	}
-	data.fd = fd;
+	data.fd = conn->data_sock;
 	data.type = S_SOCKET;
 
 	reply(conn, "125 Data connection OK, transfer starting\r\n");
 	session->info.xfer_status = 0;
+	session->info.upload = true;
 
 	send_state( session, T_XFER_START );
 
-	ret = store_file( session, file, data );
+	/* Staged uploads aren't at their real path yet */
+	hash = dedup_wanted( session ) && stage.fd == -1;
+	if( hash )
+		sha256_init( &sha );
+
+	ret = store_file( session, file, data, &rep, hash ? &sha : NULL );
+
+	/* The copy has to be on disk before the client hears it went well */
+	ret = replica_close( &rep, ret );
+	if( ret == FTP_SUCCESS && rep.failed )
+		send_state( session, T_REPAIR );
+
+	if( ret == FTP_SUCCESS && hash )
+	{
+		unsigned char digest[SHA256_DIGEST_SIZE];
+
+		sha256_final( &sha, digest );
+		dedup_commit( session->filepath, fd, digest );
+	}
+
+	/* Queued for migration before the masterserver hears we're done */
+	if( staging_close( &stage, ret ) )
+		send_state( session, T_MIGRATE );
+
+	/* A policy that doesn't allow a single copy rejects the upload */
+	if( ret == FTP_FAIL )
+		vfs_unlink( session->virt_path, pathname );
 
 	if( ret == FTP_SUCCESS )
 		reply(conn, "226 File transfer successful\r\n");
+	else if ( ret == FTP_FAIL )
+		reply(conn, "451 Unable to write secondary copy\r\n");
 	else if ( ret == FTP_ABOR )
 		reply(conn, "426 File transfer aborted\r\n");
 	else
@@ -572,8 +1295,8 @@ int dostor( ftp_session_t *session )
 
 	send_state( session, T_XFER_STOP );
 
-	vfs_close( file.fd );
-	close( data.fd );
+	vfs_close( fd );
+	close_data_conn( session, ret );
 
 	return FTP_SUCCESS;
 }
@@ -4,12 +4,14 @@
 extern int dosyst (ftp_session_t *session);
 extern int donoop (ftp_session_t *session);
 extern int dotype (ftp_session_t *session);
+extern int domode (ftp_session_t *session);
 extern int douser (ftp_session_t *session);
 extern int dopwd  (ftp_session_t *session);
 extern int docwd  (ftp_session_t *session);
 extern int docdup (ftp_session_t *session);
 extern int dopasv (ftp_session_t *session);
 extern int dosize (ftp_session_t *session);
+extern int dostat (ftp_session_t *session);
 extern int domdtm (ftp_session_t *session);
 extern int doquit (ftp_session_t *session);
 extern int dofeat (ftp_session_t *session);
@@ -26,4 +28,10 @@ extern int dodele (ftp_session_t *session);
 
 extern int init_core_commands(void);
 
+extern int data_outbuf( ftp_session_t *, outbuf_t *, int fd );
+extern int data_inbuf( ftp_session_t *, inbuf_t *, int fd );
+extern void close_data_conn( ftp_session_t *, int status );
+extern int send_file( ftp_session_t *, outbuf_t *, stream_t file,
+		off_t offset, off_t count, bool sparse );
+
 #endif
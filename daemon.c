@@ -3,6 +3,7 @@
 #include <signal.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
@@ -15,6 +16,7 @@ static pid_t fork_server(ftp_child_t *, int,int,int*);
 static int pre_server( ftp_child_t *head, int socket );
 static int handle_client( int, ftp_child_t *, int [] );
 static int daemon_handle_signal( ftp_child_t *list );
+static int tick_timeout(void);
 
 /* Listen to FTP port, waiting for connections */
 int init_masterserver(int *server_socket, int *pipefds )
@@ -75,8 +77,8 @@ int init_masterserver(int *server_socket, int *pipefds )
 int daemon_main( int server_socket, int* pipefds )
 {
 	ftp_child_t *head;
-	struct pollfd poll_fd[2];
-	int numfds = 2;
+	struct pollfd poll_fd[4];
+	int numfds = 4;
 	int ret = FTP_SUCCESS;
 	
 	poll_fd[0].fd		= server_socket;
@@ -87,6 +89,16 @@ int daemon_main( int server_socket, int* pipefds )
 	poll_fd[1].events	= POLLIN;
 	poll_fd[1].revents	= 0;
 
+	/* Invalidation of the hot file cache, ignored by poll if disabled */
+	poll_fd[2].fd		= hot_cache_fd();
+	poll_fd[2].events	= POLLIN;
+	poll_fd[2].revents	= 0;
+
+	/* Same for the listing cache */
+	poll_fd[3].fd		= list_cache_fd();
+	poll_fd[3].events	= POLLIN;
+	poll_fd[3].revents	= 0;
+
 	log_info("All subsystems loaded, starting FTP server\n");
 
 	/* Head of the linked list */
@@ -106,42 +118,79 @@ int daemon_main( int server_socket, int* pipefds )
 	{
 		int poll_ret;
 
-		poll_ret = poll( poll_fd, numfds, -1 );
+		/* Wake up for the next tick, also when nobody is around */
+		poll_ret = poll( poll_fd, numfds, tick_timeout() );
 
-		if(poll_ret == 0 || ( poll_ret == -1 && errno == EINTR ) )
-			continue;
-		else if(poll_ret == -1 && errno != EINTR )
+		if( poll_ret == -1 && errno != EINTR )
 		{
 			log_fatal("Unable to poll socket: %m\n");
 			break;
 		}
 
-		if( poll_fd[0].revents & POLLIN )
+		/* Timed out or interrupted, then only the ticks are due */
+		if( poll_ret > 0 )
 		{
-			ret = handle_client( server_socket, head, pipefds );
+			if( poll_fd[0].revents & POLLIN )
+			{
+				ret = handle_client( server_socket, head,
+						pipefds );
 
-			if(ret != FTP_SUCCESS)
-				break;
-		}
+				if(ret != FTP_SUCCESS)
+					break;
+			}
 
-		if( poll_fd[1].revents & POLLIN )
-		{
-			ret = recv_state( pipefds[0], head );
+			if( poll_fd[1].revents & POLLIN )
+			{
+				ret = recv_state( pipefds[0], head );
 
-			if( ret != FTP_SUCCESS )
-				break;
+				if( ret != FTP_SUCCESS )
+					break;
+			}
+
+			if( poll_fd[2].revents & POLLIN )
+				hot_cache_handle_events();
+
+			if( poll_fd[3].revents & POLLIN )
+				list_cache_handle_events();
 		}
+
+		popular_tick();
+		replica_tick();
+		staging_tick();
+		tier_tick();
+		dedup_tick();
 	}
 	
 	remove_all_clients( head, ret != FTP_QUIT );
 	free(head);
 
 	if( ret != FTP_QUIT )
+	{
+		save_popular_table();
 		log_info( "FTP daemon shutting down\n");
+	}
 		
 	return 0;
 }
 
+/* Milliseconds until the first of the ticks is due, -1 if none is */
+static int tick_timeout(void)
+{
+	time_t due[] = { popular_next_tick(), replica_next_tick(),
+		staging_next_tick(), tier_next_tick(), dedup_next_tick() };
+	time_t now = time( NULL ), first = -1;
+	unsigned int i;
+
+	for( i = 0; i < sizeof due / sizeof *due; i++ )
+		if( due[i] != -1 && ( first == -1 || due[i] < first ) )
+			first = due[i];
+
+	if( first == -1 )
+		return -1;
+
+	return first <= now ? 0 : ( first - now ) * 1000;
+}
+
 /* Returns FTP_SUCCESS the clients forked off successfully
  * Returns FTP_ERROR otherwise
  * Returns FTP_QUIT when the client quits */
@@ -215,11 +264,18 @@ int daemon_handle_signal( ftp_child_t *list )
 	if( signal_flag & RECV_SIGCHLD )
 	{
 		pid_t deadchild;
+		int status = 0;
 		
-		signal_flag &= !RECV_SIGCHLD;
+		signal_flag &= ~RECV_SIGCHLD;
 		
-		deadchild = waitpid( -1, NULL, WNOHANG );
-		remove_client( list, deadchild );		
+		/* Signals of children that died together arrive as one */
+		while( ( deadchild = waitpid( -1, &status, WNOHANG ) ) > 0 )
+			if( !page_warmup_reaped( deadchild ) &&
+			    !replica_repair_reaped( deadchild ) &&
+			    !staging_migrate_reaped( deadchild ) &&
+			    !tier_promote_reaped( deadchild, status ) &&
+			    !dedup_gc_reaped( deadchild ) )
+				remove_client( list, deadchild );
 	}
 	
 	if( signal_flag )
@@ -0,0 +1,208 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static int object_path( const unsigned char digest[SHA256_DIGEST_SIZE],
+		char *dst, size_t len );
+static int collect_garbage( const char *path, const struct stat *st,
+		int flag, struct FTW *ftw );
+static __noreturn void dedup_gc(void);
+
+static time_t last_gc = 0;
+static pid_t gc_pid = -1;
+static unsigned int gc_removed = 0;
+
+/* Objects are spread over 256 directories by the first byte of their
+ * SHA-256, like git does */
+static int object_path( const unsigned char digest[SHA256_DIGEST_SIZE],
+		char *dst, size_t len )
+{
+	static const char hex[] = "0123456789abcdef";
+	char name[2 * SHA256_DIGEST_SIZE + 2];
+	int i, j;
+
+	for( i = j = 0; i < SHA256_DIGEST_SIZE; i++ )
+	{
+		name[j++] = hex[digest[i] >> 4];
+		name[j++] = hex[digest[i] & 0xf];
+		if( i == 0 )
+			name[j++] = '/';
+	}
+	name[j] = '\0';
+
+	if( snprintf( dst, len, "%s/%s", config.dedup_dir, name ) >= (int) len )
+		return -1;
+
+	return 0;
+}
+
+/* Only uploads of whole files can be looked up by their hash */
+bool dedup_wanted( const ftp_session_t *session )
+{
+	return config.dedup_dir != NULL && session->restart_pos == 0 &&
+		session->filepath[0] != '\0';
+}
+
+/* The upload at REAL, open as FD, has the SHA-256 DIGEST. If the store has
+ * these contents already, REAL becomes a hardlink to them. Otherwise REAL
+ * goes into the store, for the next upload to find. Uploads of different
+ * users aren't merged, they could change each other's files */
+int dedup_commit( const char *real, int fd,
+		const unsigned char digest[SHA256_DIGEST_SIZE] )
+{
+	char object[FTP_MAX_REAL_PATH], tmp[FTP_MAX_REAL_PATH + 32];
+	struct stat st, obj;
+	int tries;
+
+	if( fstat( fd, &st ) == -1 || !S_ISREG( st.st_mode ) ||
+	    st.st_size < (off_t) config.dedup_min_size * 1024 )
+		return FTP_SUCCESS;
+
+	if( object_path( digest, object, sizeof object ) == -1 )
+		return FTP_FAIL;
+
+	for( tries = 0; tries < 3; tries++ )
+	{
+		if( link( real, object ) == 0 )
+			return FTP_SUCCESS;
+
+		if( errno == ENOENT && make_parent_dirs( object ) == 0 &&
+		    link( real, object ) == 0 )
+			return FTP_SUCCESS;
+
+		if( errno != EEXIST )
+		{
+			log_warn("Unable to store '%s': %m\n", real );
+			return FTP_FAIL;
+		}
+
+		if( stat( object, &obj ) == -1 )
+			continue;	/* Collected as garbage just now */
+
+		if( obj.st_ino == st.st_ino && obj.st_dev == st.st_dev )
+			return FTP_SUCCESS;
+
+		if( obj.st_size != st.st_size || obj.st_uid != st.st_uid )
+			return FTP_SUCCESS;
+
+		/* Link next to REAL and rename over it, so REAL never
+		 * disappears */
+		snprintf( tmp, sizeof tmp, "%s.dedup-%d", real, (int) getpid() );
+		if( link( object, tmp ) == -1 )
+		{
+			if( errno == ENOENT )
+				continue;
+			log_warn("Unable to link '%s': %m\n", real );
+			return FTP_FAIL;
+		}
+
+		if( rename( tmp, real ) == -1 )
+		{
+			log_warn("Unable to replace '%s': %m\n", real );
+			unlink( tmp );
+			return FTP_FAIL;
+		}
+
+		log_dbg("Deduplicated '%s'\n", real );
+
+		return FTP_SUCCESS;
+	}
+
+	return FTP_FAIL;
+}
+
+/* An object nobody links to anymore */
+static int collect_garbage( const char *path, const struct stat *st,
+		int flag, struct FTW *ftw )
+{
+	(void) ftw;
+
+	if( signal_flag )
+		return 1;
+
+	if( flag == FTW_F && S_ISREG( st->st_mode ) && st->st_nlink == 1 &&
+	    unlink( path ) == 0 )
+		gc_removed++;
+
+	return 0;
+}
+
+static void dedup_gc(void)
+{
+	prctl( PR_SET_PDEATHSIG, SIGTERM );
+	setpriority( PRIO_PROCESS, 0, 19 );
+
+	nftw( config.dedup_dir, collect_garbage, 16, FTW_PHYS );
+
+	if( gc_removed > 0 )
+		log_info("Removed %u unused objects from the store\n",
+				gc_removed );
+
+	_exit( 0 );
+}
+
+/* When the next collection is due, or -1 while one runs */
+time_t dedup_next_tick(void)
+{
+	if( config.dedup_dir == NULL || gc_pid != -1 )
+		return -1;
+
+	/* The first tick starts the clock */
+	if( last_gc == 0 )
+		return 0;
+
+	return last_gc + DEDUP_GC_INTERVAL;
+}
+
+/* Called from the main loop, collects garbage every now and then */
+int dedup_tick(void)
+{
+	pid_t pid;
+
+	if( config.dedup_dir == NULL || gc_pid != -1 )
+		return FTP_SUCCESS;
+
+	if( last_gc == 0 )
+		last_gc = time( NULL );
+
+	if( time( NULL ) - last_gc < DEDUP_GC_INTERVAL )
+		return FTP_SUCCESS;
+
+	last_gc = time( NULL );
+
+	pid = fork();
+	if( pid == -1 )
+	{
+		log_warn("Unable to start garbage collection: %m\n");
+		return FTP_FAIL;
+	}
+
+	if( pid == 0 )
+		dedup_gc();
+
+	gc_pid = pid;
+
+	return FTP_SUCCESS;
+}
+
+bool dedup_gc_reaped( pid_t pid )
+{
+	if( pid == -1 || pid != gc_pid )
+		return false;
+
+	gc_pid = -1;
+
+	return true;
+}
@@ -0,0 +1,17 @@
+#ifndef __DEDUP_H__
+#define __DEDUP_H__ 1
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+extern bool dedup_wanted( const ftp_session_t *session );
+extern int dedup_commit( const char *real, int fd,
+		const unsigned char digest[SHA256_DIGEST_SIZE] );
+
+extern time_t dedup_next_tick(void);
+extern int dedup_tick(void);
+extern bool dedup_gc_reaped( pid_t pid );
+
+#define DEDUP_GC_INTERVAL	3600	/* Seconds */
+
+#endif
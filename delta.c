@@ -0,0 +1,553 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static void put_be32( unsigned char *p, uint32_t v );
+static void put_be64( unsigned char *p, uint64_t v );
+static uint32_t get_be32( const unsigned char *p );
+static uint64_t get_be64( const unsigned char *p );
+static size_t choose_block_size( off_t size );
+static int send_signatures( ftp_session_t *, int fd, off_t size, size_t bs );
+static int delta_recv( ftp_session_t *, inbuf_t *, void *, size_t );
+static int copy_range( int in, off_t in_off, int out, off_t out_off,
+		off_t len, char *buf );
+static int apply_delta( ftp_session_t *session, int basis, off_t basis_size,
+		int out, int sock );
+static int replicate_patch( ftp_session_t *session, int out );
+
+static void put_be32( unsigned char *p, uint32_t v )
+{
+	p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static void put_be64( unsigned char *p, uint64_t v )
+{
+	put_be32( p, v >> 32 );
+	put_be32( p + 4, v );
+}
+
+static uint32_t get_be32( const unsigned char *p )
+{
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+	       (uint32_t) p[2] << 8  | (uint32_t) p[3];
+}
+
+static uint64_t get_be64( const unsigned char *p )
+{
+	return (uint64_t) get_be32( p ) << 32 | get_be32( p + 4 );
+}
+
+/* Like rsync, roughly the square root of the file size */
+static size_t choose_block_size( off_t size )
+{
+	size_t bs = DELTA_DEFAULT_BLOCK;
+
+	while( (off_t) ( bs * bs ) < size && bs < DELTA_MAX_BLOCK )
+		bs *= 2;
+
+	return bs;
+}
+
+static int send_signatures( ftp_session_t *session, int fd, off_t size,
+		size_t bs )
+{
+	unsigned char hdr[20], entry[4 + DELTA_STRONG_LEN];
+	unsigned char digest[SHA256_DIGEST_SIZE];
+	unsigned char *block;
+	outbuf_t out;
+	off_t offset, base = vfs_offset( fd );
+	int ret = FTP_SUCCESS;
+
+	block = malloc( bs );
+	if( block == NULL )
+	{
+		FATAL_MEM( bs );
+		return FTP_ERROR;
+	}
+
+	if( data_outbuf( session, &out, session->conn.data_sock )
+			!= FTP_SUCCESS )
+	{
+		free( block );
+		return FTP_ERROR;
+	}
+
+	memcpy( hdr, DELTA_SIG_MAGIC, 4 );
+	put_be32( hdr + 4, bs );
+	put_be64( hdr + 8, size );
+	put_be32( hdr + 16, DELTA_STRONG_LEN );
+
+	if( outbuf_write( &out, hdr, sizeof hdr ) == -1 )
+		ret = FTP_ABOR;
+
+	for( offset = 0; offset < size && ret == FTP_SUCCESS; offset += bs )
+	{
+		size_t len = size - offset < (off_t) bs ? (size_t) ( size - offset ) : bs;
+		rollsum_t sum;
+		sha256_t sha;
+
+		if( preadall( fd, block, len, base + offset ) != (ssize_t) len )
+		{
+			ret = FTP_FAIL;
+			break;
+		}
+
+		rollsum_init( &sum, block, len );
+		sha256_init( &sha );
+		sha256_update( &sha, block, len );
+		sha256_final( &sha, digest );
+
+		put_be32( entry, rollsum_digest( &sum ) );
+		memcpy( entry + 4, digest, DELTA_STRONG_LEN );
+
+		if( outbuf_write( &out, entry, sizeof entry ) == -1 )
+			ret = FTP_ABOR;
+
+		if( signal_flag && server_handle_signal() )
+			ret = FTP_QUIT;
+	}
+
+	if( ret == FTP_SUCCESS && outbuf_finish( &out ) == -1 )
+		ret = FTP_ABOR;
+
+	if( ret == FTP_ABOR && errno != EPIPE && errno != ECONNRESET )
+	{
+		log_warn("Error sending signatures: %m\n");
+		ret = FTP_ERROR;
+	}
+
+	outbuf_free( &out );
+	free( block );
+
+	return ret;
+}
+
+/* SITE RSIG <blocksize> <path>
+ * Send the block signatures of a file over the data connection. A block
+ * size of 0 lets the server choose */
+int dosite_rsig( ftp_session_t *session )
+{
+	ftp_conn_t *conn = &session->conn;
+	char *arg = session->command.arg, *path;
+	unsigned long bs;
+	struct stat st;
+	int fd, ret;
+
+	bs = strtoul( arg, &path, 10 );
+	while( isblank( *path ) )
+		path++;
+
+	if( path == arg || *path == '\0' )
+	{
+		reply( conn, "501 Usage: SITE RSIG <blocksize> <path>\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	if( vfs_stat( session->virt_path, path, &st ) == -1 )
+		return failed_vfs_reply( conn );
+
+	if( !S_ISREG( st.st_mode ) )
+	{
+		reply( conn, "550 Can only sign regular files\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	if( bs == 0 )
+		bs = choose_block_size( st.st_size );
+	else if( bs < DELTA_MIN_BLOCK || bs > DELTA_MAX_BLOCK )
+	{
+		reply( conn, "501 Invalid block size\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	fd = vfs_open( session->virt_path, path, O_RDONLY );
+	if( fd == -1 )
+		return failed_vfs_reply( conn );
+
+	conn->data_sock = accept_data_conn( conn );
+	if( conn->data_sock < 0 )
+	{
+		vfs_close( fd );
+		return conn->data_sock == -2 ? FTP_QUIT : FTP_SUCCESS;
+	}
+
+	reply( conn, "125 Data connection OK, sending signatures\r\n" );
+
+	posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+	ret = send_signatures( session, fd, st.st_size, bs );
+
+	switch( ret )
+	{
+	case FTP_SUCCESS:
+		reply( conn, "226 Signatures sent OK\r\n" );
+		break;
+	case FTP_ABOR:
+		reply( conn, "426 Transfer aborted\r\n" );
+		break;
+	case FTP_FAIL:
+		reply( conn, "451 File changed while reading\r\n" );
+		break;
+	case FTP_QUIT:
+		break;
+	case FTP_ERROR:
+	default:
+		reply( conn, "450 Error during write to data connection\r\n" );
+		break;
+	}
+
+	vfs_close( fd );
+	close_data_conn( session, ret );
+
+	return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+}
+
+/* Receive exactly LEN bytes of the delta stream */
+static int delta_recv( ftp_session_t *session, inbuf_t *in, void *buf,
+		size_t len )
+{
+	ssize_t ret;
+
+	ret = inbuf_read( in, buf, len );
+	if( ret == -1 )
+	{
+		if( errno == EPIPE || errno == ECONNRESET )
+			return FTP_ABOR;
+		log_warn("Error receiving delta: %m\n");
+		return FTP_ERROR;
+	}
+
+	session->info.xfer_len  += ret;
+	session->info.probe_len += ret;
+
+	/* The client hung up in the middle of the stream */
+	if( (size_t) ret < len )
+		return FTP_ABOR;
+
+	return FTP_SUCCESS;
+}
+
+/* Copy LEN bytes between files. copy_file_range() keeps the data in the
+ * kernel and might even share the blocks. If it can't be used here, fall
+ * back to copying through BUF */
+static int copy_range( int in, off_t in_off, int out, off_t out_off,
+		off_t len, char *buf )
+{
+	while( len > 0 )
+	{
+		ssize_t ret;
+
+		ret = copy_file_range( in, &in_off, out, &out_off, len, 0 );
+		if( ret > 0 )
+		{
+			len -= ret;
+			continue;
+		}
+		if( ret == 0 )
+			return FTP_FAIL;
+		if( errno == EINTR )
+			continue;
+		if( errno != EXDEV && errno != EINVAL && errno != ENOSYS &&
+		    errno != EOPNOTSUPP )
+			return FTP_ERROR;
+
+		ret = pread( in, buf, len < STREAM_BUFFER_SIZE ? len :
+				STREAM_BUFFER_SIZE, in_off );
+		if( ret <= 0 )
+			return ret == 0 ? FTP_FAIL : FTP_ERROR;
+		if( pwriteall( out, buf, ret, out_off ) == -1 )
+			return FTP_ERROR;
+
+		in_off  += ret;
+		out_off += ret;
+		len -= ret;
+	}
+
+	return FTP_SUCCESS;
+}
+
+static int apply_delta( ftp_session_t *session, int basis, off_t basis_size,
+		int out, int sock )
+{
+	unsigned char hdr[12];
+	char *buf;
+	inbuf_t in;
+	writeback_t wb;
+	off_t offset = 0;
+	uint64_t bs;
+	bool done = false;
+	int ret;
+
+	if( data_inbuf( session, &in, sock ) != FTP_SUCCESS )
+		return FTP_ERROR;
+
+	buf = malloc( STREAM_BUFFER_SIZE );
+	if( buf == NULL )
+	{
+		FATAL_MEM( STREAM_BUFFER_SIZE );
+		inbuf_free( &in );
+		return FTP_ERROR;
+	}
+
+	gettimeofday( &session->info.xfer_start, NULL );
+	session->info.xfer_probe = session->info.xfer_start;
+	session->info.xfer_len = session->info.probe_len = 0;
+	writeback_begin( &wb, 0 );
+
+	ret = delta_recv( session, &in, hdr, 8 );
+	if( ret == FTP_SUCCESS )
+	{
+		bs = get_be32( hdr + 4 );
+		if( memcmp( hdr, DELTA_MAGIC, 4 ) != 0 ||
+		    bs < DELTA_MIN_BLOCK || bs > DELTA_MAX_BLOCK )
+			ret = FTP_FAIL;
+	}
+
+	while( ret == FTP_SUCCESS && !done )
+	{
+		uint64_t block, len;
+
+		ret = delta_recv( session, &in, hdr, 1 );
+		if( ret != FTP_SUCCESS )
+			break;
+
+		switch( hdr[0] )
+		{
+		case 'C':
+			ret = delta_recv( session, &in, hdr, 12 );
+			if( ret != FTP_SUCCESS )
+				break;
+
+			block = get_be64( hdr );
+			len = get_be32( hdr + 8 ) * bs;
+			if( block >= (uint64_t) basis_size / bs + 1 ||
+			    (off_t) ( block * bs ) >= basis_size )
+			{
+				ret = FTP_FAIL;
+				break;
+			}
+
+			/* Only the last block can be short */
+			if( len > (uint64_t) basis_size - block * bs )
+				len = basis_size - block * bs;
+
+			ret = copy_range( basis, block * bs, out, offset,
+					len, buf );
+			offset += len;
+			break;
+		case 'D':
+			ret = delta_recv( session, &in, hdr, 4 );
+			len = get_be32( hdr );
+
+			while( ret == FTP_SUCCESS && len > 0 )
+			{
+				size_t n = len < STREAM_BUFFER_SIZE ? len :
+						STREAM_BUFFER_SIZE;
+
+				ret = delta_recv( session, &in, buf, n );
+				if( ret != FTP_SUCCESS )
+					break;
+
+				if( pwriteall( out, buf, n, offset ) == -1 )
+				{
+					log_warn("Unable to write delta: %m\n");
+					ret = FTP_ERROR;
+				}
+
+				offset += n;
+				len -= n;
+			}
+			break;
+		case 'E':
+			ret = delta_recv( session, &in, hdr, 8 );
+			if( ret == FTP_SUCCESS &&
+			    get_be64( hdr ) != (uint64_t) offset )
+				ret = FTP_FAIL;
+
+			/* Nothing may follow, in MODE B that also reads
+			 * up to the end of the last block */
+			if( ret == FTP_SUCCESS &&
+			    inbuf_read( &in, hdr, 1 ) != 0 )
+				ret = FTP_FAIL;
+			done = true;
+			break;
+		default:
+			ret = FTP_FAIL;
+			break;
+		}
+
+		writeback_written( &wb, out, offset );
+
+		throttle_pause( session );
+
+		if( signal_flag && server_handle_signal() )
+			ret = FTP_QUIT;
+	}
+
+	inbuf_free( &in );
+	free( buf );
+
+	if( ret != FTP_SUCCESS )
+		return ret;
+
+	return writeback_finish( &wb, out, offset );
+}
+
+/* Write the patched file OUT to the secondary copy, if a rule asks for
+ * one. Returns FTP_FAIL if the policy doesn't allow going on without it */
+static int replicate_patch( ftp_session_t *session, int out )
+{
+	struct stat st;
+	replica_t rep;
+	int ret;
+
+	ret = replica_open( &rep, session->virt_filepath );
+	if( ret == FTP_SUCCESS && rep.fd != -1 &&
+	    ( fstat( out, &st ) == -1 ||
+	      copy_file_data( out, rep.fd, st.st_size,
+			DELTA_CHUNK_SIZE ) == -1 ) )
+		ret = replica_failed( &rep );
+
+	ret = replica_close( &rep, ret );
+	if( ret == FTP_SUCCESS && rep.failed )
+		send_state( session, T_REPAIR );
+
+	return ret;
+}
+
+/* SITE RDELTA <path>
+ * Receive a delta against PATH over the data connection. The new version
+ * is built next to the old one and renamed over it when complete, so
+ * nobody ever sees a half-patched file */
+int dosite_rdelta( ftp_session_t *session )
+{
+	ftp_conn_t *conn = &session->conn;
+	const char *path = session->command.arg;
+	const char *basename;
+	char tmp[FTP_MAX_PATH];
+	struct stat st;
+	int basis, out, ret;
+	bool replicated = true;
+
+	basename = find_basename( path );
+
+	if( strlcpy( session->filename, basename, FTP_MAX_NAME - 1 )
+			>= FTP_MAX_NAME )
+	{
+		reply(conn, "550 Filename too long\r\n");
+		return FTP_SUCCESS;
+	}
+
+	if( vfs_stat( session->virt_path, path, &st ) == -1 )
+		return failed_vfs_reply( conn );
+
+	if( !S_ISREG( st.st_mode ) )
+	{
+		reply( conn, "550 Can only patch regular files\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	if( vfs_virtual( session->virt_path, path, session->virt_filepath,
+			FTP_MAX_PATH ) == -1 )
+		return failed_vfs_reply( conn );
+
+	if( snprintf( tmp, sizeof tmp, "%.*s.%s.XXXXXX",
+			(int) ( basename - path ), path, basename )
+			>= (int) sizeof tmp )
+	{
+		reply( conn, "550 Filename too long\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	basis = vfs_open( session->virt_path, path, O_RDONLY );
+	if( basis == -1 )
+		return failed_vfs_reply( conn );
+
+	out = vfs_mkstemp( session->virt_path, tmp );
+	if( out == -1 )
+	{
+		vfs_close( basis );
+		return failed_vfs_reply( conn );
+	}
+
+	vfs_resolve( session->virt_path, path, session->filepath,
+			FTP_MAX_REAL_PATH );
+
+	conn->data_sock = accept_data_conn( conn );
+	if( conn->data_sock < 0 )
+	{
+		vfs_close( out );
+		vfs_unlink( session->virt_path, tmp );
+		vfs_close( basis );
+		return conn->data_sock == -2 ? FTP_QUIT : FTP_SUCCESS;
+	}
+
+	reply( conn, "125 Data connection OK, receiving delta\r\n" );
+	session->info.xfer_status = 0;
+	session->info.upload = true;
+
+	send_state( session, T_XFER_START );
+
+	ret = apply_delta( session, basis, st.st_size, out, conn->data_sock );
+
+	/* Both copies are patched before the new version replaces the old */
+	if( ret == FTP_SUCCESS )
+	{
+		ret = replicate_patch( session, out );
+		replicated = ret == FTP_SUCCESS;
+	}
+
+	if( ret == FTP_SUCCESS )
+	{
+		fchmod( out, st.st_mode & 07777 );
+
+		if( vfs_rename( session->virt_path, tmp, path ) == -1 )
+		{
+			log_warn("Unable to replace patched file: %m\n");
+			ret = FTP_ERROR;
+		}
+	}
+
+	if( ret != FTP_SUCCESS )
+		vfs_unlink( session->virt_path, tmp );
+
+	switch( ret )
+	{
+	case FTP_SUCCESS:
+		reply( conn, "226 Delta applied\r\n" );
+		break;
+	case FTP_ABOR:
+		reply( conn, "426 Transfer aborted\r\n" );
+		break;
+	case FTP_FAIL:
+		reply( conn, replicated ? "451 Invalid delta\r\n" :
+				"451 Unable to write secondary copy\r\n" );
+		break;
+	case FTP_QUIT:
+		break;
+	case FTP_ERROR:
+	default:
+		reply( conn, "451 Unable to apply delta\r\n" );
+		break;
+	}
+
+	session->info.total_up += session->info.xfer_len;
+	session->info.xfer_status = ret;
+
+	send_state( session, T_XFER_STOP );
+
+	vfs_close( out );
+	vfs_close( basis );
+	close_data_conn( session, ret );
+
+	return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+}
@@ -0,0 +1,24 @@
+#ifndef __DELTA_H__
+#define __DELTA_H__ 1
+
+extern int dosite_rsig (ftp_session_t *session);
+extern int dosite_rdelta (ftp_session_t *session);
+
+/* Signature stream:
+ *   "FSIG" blocksize:32 filesize:64 strong_len:32
+ *   then per block: weak:32 strong:strong_len
+ * Delta stream:
+ *   "FDLT" blocksize:32
+ *   'C' block:64 count:32		copy blocks of the old file
+ *   'D' len:32 data[len]		literal data
+ *   'E' filesize:64			end, with the size of the result
+ * All numbers are big endian */
+#define DELTA_SIG_MAGIC		"FSIG"
+#define DELTA_MAGIC		"FDLT"
+#define DELTA_STRONG_LEN	16
+#define DELTA_MIN_BLOCK		512
+#define DELTA_DEFAULT_BLOCK	2048
+#define DELTA_MAX_BLOCK		( 1024 * 1024 )
+#define DELTA_CHUNK_SIZE	( 8 * 1024 * 1024 )	/* Copying to the secondary */
+
+#endif
@@ -37,5 +37,23 @@
 #include "reply.h"
 #include "core.h"
 #include "auth.h"
+#include "popular.h"
+#include "hotcache.h"
+#include "prefetch.h"
+#include "writeback.h"
+#include "hash.h"
+#include "site.h"
+#include "delta.h"
+#include "tar.h"
+#include "replica.h"
+#include "staging.h"
+#include "tier.h"
+#include "dedup.h"
+#include "memfs.h"
+#include "tarfs.h"
+#include "indexfs.h"
+#include "statcache.h"
+#include "statahead.h"
+#include "listcache.h"
 
 #endif
@@ -0,0 +1,31 @@
+#ifndef __HASH_H__
+#define __HASH_H__ 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE	32
+
+typedef struct sha256
+{
+	uint32_t state[8];
+	uint64_t len;			/* Bytes hashed so far */
+	unsigned char buf[64];
+} sha256_t;
+
+extern void sha256_init( sha256_t * );
+extern void sha256_update( sha256_t *, const void *, size_t );
+extern void sha256_final( sha256_t *, unsigned char[SHA256_DIGEST_SIZE] );
+
+/* The weak checksum of rsync, which can be rolled one byte at a time */
+typedef struct rollsum
+{
+	uint32_t a, b;
+	size_t len;
+} rollsum_t;
+
+extern void rollsum_init( rollsum_t *, const unsigned char *, size_t );
+extern void rollsum_roll( rollsum_t *, unsigned char out, unsigned char in );
+extern __pure uint32_t rollsum_digest( const rollsum_t * );
+
+#endif
@@ -0,0 +1,294 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static int find_hot_file( const char *path );
+static int load_hot_file( const char *path, unsigned long hits );
+static int make_room( off_t size, unsigned long hits );
+static void drop_hot_file( int i );
+static bool same_file( const struct stat *st1, const struct stat *st2 );
+
+static hot_file_t hot_files[HOT_CACHE_MAX_FILES];
+static int num_hot_files = 0;
+static off_t hot_cache_used = 0;
+static int inotify_fd = -1;
+
+#define HOT_WATCH_MASK	( IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+			  IN_MOVE_SELF | IN_DELETE_SELF )
+
+int init_hot_cache(void)
+{
+	if( config.hot_cache_size <= 0 )
+		return FTP_SUCCESS;
+
+	log_dbg("Initializing hot file cache (%d kB)\n",
+			config.hot_cache_size );
+
+	/* Without inotify we still check mtime and size on every hit */
+	inotify_fd = inotify_init1( IN_NONBLOCK );
+	if( inotify_fd == -1 )
+		log_warn("Unable to watch cached files: %m\n");
+
+	return FTP_SUCCESS;
+}
+
+int destroy_hot_cache(void)
+{
+	while( num_hot_files > 0 )
+		drop_hot_file( num_hot_files - 1 );
+
+	if( inotify_fd != -1 )
+		close( inotify_fd );
+	inotify_fd = -1;
+
+	return FTP_SUCCESS;
+}
+
+/* The descriptor the masterserver should poll for invalidations */
+int hot_cache_fd(void)
+{
+	return inotify_fd;
+}
+
+/* Drop every cached file that was changed behind our back */
+int hot_cache_handle_events(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+	int i;
+
+	while( (len = read( inotify_fd, buf, sizeof buf )) > 0 )
+	{
+		for( ptr = buf; ptr < buf + len;
+				ptr += sizeof(*event) + event->len )
+		{
+			event = (const struct inotify_event *) ptr;
+
+			for( i = 0; i < num_hot_files; i++ )
+				if( hot_files[i].wd == event->wd )
+					break;
+
+			/* IN_IGNORED after we removed the watch ourselves */
+			if( i == num_hot_files )
+				continue;
+
+			log_dbg("Hot file %s changed, dropping it\n",
+					hot_files[i].path );
+			drop_hot_file( i );
+		}
+	}
+
+	if( len == -1 && errno != EAGAIN && errno != EINTR )
+	{
+		log_warn("Unable to read inotify events: %m\n");
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Called by the masterserver each time a download of PATH starts.
+ * Files that are popular enough get copied into memory */
+int hot_cache_consider( const char *path, unsigned long hits )
+{
+	int i;
+
+	if( config.hot_cache_size <= 0 || path[0] == '\0' )
+		return FTP_SUCCESS;
+
+	if( hits < (unsigned long) config.hot_cache_threshold )
+		return FTP_SUCCESS;
+
+	i = find_hot_file( path );
+	if( i != -1 )
+	{
+		struct stat st;
+
+		hot_files[i].hits = hits;
+
+		if( inotify_fd != -1 )
+			return FTP_SUCCESS;
+
+		/* No inotify, so check whether the copy is still good */
+		if( stat( path, &st ) == 0 && same_file( &st, &hot_files[i].st ))
+			return FTP_SUCCESS;
+
+		drop_hot_file( i );
+	}
+
+	return load_hot_file( path, hits );
+}
+
+/* Find the memfd holding the file described by ST. This needs no system
+ * calls at all, the caller already did the stat.
+ * Returns -1 if the file isn't cached */
+int hot_cache_lookup( const struct stat *st )
+{
+	int i;
+
+	/* The memfd skips the permission check open() would do */
+	if( !( st->st_mode & S_IROTH ) )
+		return -1;
+
+	for( i = 0; i < num_hot_files; i++ )
+		if( same_file( st, &hot_files[i].st ) )
+			return hot_files[i].fd;
+
+	return -1;
+}
+
+static bool same_file( const struct stat *st1, const struct stat *st2 )
+{
+	return	st1->st_ino  == st2->st_ino  &&
+		st1->st_dev  == st2->st_dev  &&
+		st1->st_size == st2->st_size &&
+		st1->st_mtim.tv_sec  == st2->st_mtim.tv_sec  &&
+		st1->st_mtim.tv_nsec == st2->st_mtim.tv_nsec &&
+		st1->st_ctim.tv_sec  == st2->st_ctim.tv_sec  &&
+		st1->st_ctim.tv_nsec == st2->st_ctim.tv_nsec;
+}
+
+static int find_hot_file( const char *path )
+{
+	int i;
+
+	for( i = 0; i < num_hot_files; i++ )
+		if( strcmp( hot_files[i].path, path ) == 0 )
+			return i;
+
+	return -1;
+}
+
+static int load_hot_file( const char *path, unsigned long hits )
+{
+	int fd, memfd;
+	struct stat st, after;
+	off_t offset = 0;
+	hot_file_t *hot;
+
+	fd = open( path, O_RDONLY );
+	if( fd == -1 )
+	{
+		log_dbg("Unable to open hot file %s: %m\n", path );
+		return FTP_FAIL;
+	}
+
+	if( fstat( fd, &st ) == -1 || !S_ISREG( st.st_mode ) ||
+	    st.st_size > (off_t) config.hot_cache_max_file * 1024 ||
+	    make_room( st.st_size, hits ) != FTP_SUCCESS )
+	{
+		close( fd );
+		return FTP_FAIL;
+	}
+
+	memfd = memfd_create( "ftpd-hot", MFD_ALLOW_SEALING );
+	if( memfd == -1 )
+	{
+		log_warn("Unable to create memfd: %m\n");
+		close( fd );
+		return FTP_ERROR;
+	}
+
+	while( offset < st.st_size )
+	{
+		if( sendfile( memfd, fd, &offset, st.st_size - offset ) <= 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			break;
+		}
+	}
+
+	/* Don't cache a file that changed while we were copying it */
+	if( offset != st.st_size || fstat( fd, &after ) == -1 ||
+	    !same_file( &st, &after ) )
+	{
+		log_dbg("Hot file %s changed while loading\n", path );
+		close( memfd );
+		close( fd );
+		return FTP_FAIL;
+	}
+
+	close( fd );
+
+	if( fcntl( memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+			F_SEAL_WRITE | F_SEAL_SEAL ) == -1 )
+		log_warn("Unable to seal memfd: %m\n");
+
+	hot = &hot_files[num_hot_files];
+	hot->path = strdup( path );
+	if( hot->path == NULL )
+	{
+		FATAL_MEM( strlen( path ) + 1 );
+		close( memfd );
+		return FTP_ERROR;
+	}
+
+	hot->fd = memfd;
+	hot->hits = hits;
+	hot->st = st;
+	hot->wd = -1;
+	if( inotify_fd != -1 )
+		hot->wd = inotify_add_watch( inotify_fd, path, HOT_WATCH_MASK );
+
+	num_hot_files++;
+	hot_cache_used += st.st_size;
+
+	log_info("Caching hot file %s (%lld bytes)\n", path,
+			(long long) st.st_size );
+
+	return FTP_SUCCESS;
+}
+
+/* Evict less popular files until SIZE more bytes fit in the cache */
+static int make_room( off_t size, unsigned long hits )
+{
+	off_t budget = (off_t) config.hot_cache_size * 1024;
+
+	if( size > budget )
+		return FTP_FAIL;
+
+	while( num_hot_files == HOT_CACHE_MAX_FILES ||
+	       hot_cache_used + size > budget )
+	{
+		int i, victim = 0;
+
+		for( i = 1; i < num_hot_files; i++ )
+			if( hot_files[i].hits < hot_files[victim].hits )
+				victim = i;
+
+		if( num_hot_files == 0 || hot_files[victim].hits >= hits )
+			return FTP_FAIL;
+
+		log_dbg("Evicting hot file %s\n", hot_files[victim].path );
+		drop_hot_file( victim );
+	}
+
+	return FTP_SUCCESS;
+}
+
+static void drop_hot_file( int i )
+{
+	hot_file_t *hot = &hot_files[i];
+
+	if( hot->wd != -1 )
+		inotify_rm_watch( inotify_fd, hot->wd );
+
+	close( hot->fd );
+	free( hot->path );
+	hot_cache_used -= hot->st.st_size;
+
+	/* Fill the hole with the last entry */
+	*hot = hot_files[--num_hot_files];
+}
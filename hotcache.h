@@ -0,0 +1,26 @@
+#ifndef __HOTCACHE_H__
+#define __HOTCACHE_H__ 1
+
+#include <sys/stat.h>
+
+/* A small file kept in memory. The masterserver fills these, the
+ * children inherit the memfds when they are forked. */
+typedef struct hot_file
+{
+	int fd;				/* Sealed memfd with the contents */
+	int wd;				/* inotify watch on the original */
+	unsigned long hits;
+	struct stat st;			/* Stat of the original file */
+	char *path;
+} hot_file_t;
+
+extern int init_hot_cache(void);
+extern int destroy_hot_cache(void);
+extern int hot_cache_fd(void);
+extern int hot_cache_handle_events(void);
+extern int hot_cache_consider( const char *path, unsigned long hits );
+extern int hot_cache_lookup( const struct stat *st );
+
+#define HOT_CACHE_MAX_FILES	256
+
+#endif
@@ -0,0 +1,708 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+/* Serves a read-only tree from an index built by "ftpd -i" beforehand.
+ * The index is mapped at login, after that stat, SIZE, MDTM and the
+ * listings are answered from it without touching the tree. Only the
+ * contents come from the tree itself. When the tree doesn't look like
+ * the index anymore, the POSIX backend takes over */
+
+static int indexfs_init( const char *index );
+static void indexfs_destroy(void);
+static int indexfs_resolve( const char *vpath, char *dst, size_t len );
+static int indexfs_stat( const char *vpath, struct stat *st );
+static int indexfs_open( const char *vpath, int flags );
+static vfs_dir_t *indexfs_openlist( const char *vpath );
+static struct dirent *indexfs_readlist( vfs_dir_t *list );
+static int indexfs_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st );
+static const char *indexfs_listline( vfs_dir_t *list, size_t *len );
+static int indexfs_closelist( vfs_dir_t *list );
+static int indexfs_fallback( char *dir, size_t len );
+
+static const char *index_string( uint64_t offset );
+static const index_entry_t *find_entry( const char *path );
+static void entry_stat( const index_entry_t *entry, struct stat *st );
+static bool same_file( const index_entry_t *entry, const struct stat *st );
+
+const vfs_ops_t indexfs_ops = {
+	.name		= "index",
+	.init		= indexfs_init,
+	.destroy	= indexfs_destroy,
+	.resolve	= indexfs_resolve,
+	.stat		= indexfs_stat,
+	.open		= indexfs_open,
+	.openlist	= indexfs_openlist,
+	.readlist	= indexfs_readlist,
+	.statlist	= indexfs_statlist,
+	.listline	= indexfs_listline,
+	.closelist	= indexfs_closelist,
+	.fallback	= indexfs_fallback,
+};
+
+static void *map = NULL;
+static size_t map_size = 0;
+static const index_header_t *header = NULL;
+static const index_entry_t *entries = NULL;
+static const char *strings = NULL;
+static int tree_fd = -1;
+
+/* Where the tree is, also after the index is gone */
+static char tree_path[FTP_MAX_REAL_PATH];
+
+static int indexfs_init( const char *index )
+{
+	struct stat st;
+	uint64_t max;
+	int fd;
+
+	tree_path[0] = '\0';
+
+	fd = open( index, O_RDONLY );
+	if( fd == -1 || fstat( fd, &st ) == -1 )
+	{
+		log_warn("Unable to open index '%s': %m\n", index );
+		if( fd != -1 )
+			close( fd );
+		return FTP_ERROR;
+	}
+
+	map_size = st.st_size;
+	map = map_size < sizeof *header ? MAP_FAILED :
+		mmap( NULL, map_size, PROT_READ, MAP_SHARED, fd, 0 );
+	close( fd );
+	if( map == MAP_FAILED )
+	{
+		log_warn("Unable to map index '%s'\n", index );
+		map = NULL;
+		return FTP_ERROR;
+	}
+
+	header = map;
+	entries = (const index_entry_t *) ( header + 1 );
+
+	/* Everything in it has to be inside of the mapping, and the strings
+	 * have to end */
+	max = ( map_size - sizeof *header ) / sizeof *entries;
+	if( memcmp( header->magic, INDEX_MAGIC, sizeof header->magic ) != 0 ||
+	    header->num_entries == 0 || header->num_entries > max ||
+	    header->strings_size == 0 || header->strings_size !=
+	    map_size - sizeof *header - header->num_entries * sizeof *entries )
+	{
+		log_warn("'%s' is not an index\n", index );
+		indexfs_destroy();
+		return FTP_ERROR;
+	}
+
+	strings = (const char *) ( entries + header->num_entries );
+	if( strings[header->strings_size - 1] != '\0' )
+	{
+		log_warn("Index '%s' is truncated\n", index );
+		indexfs_destroy();
+		return FTP_ERROR;
+	}
+
+	strlcpy( tree_path, index_string( header->tree ), sizeof tree_path );
+
+	/* The top of the tree changes whenever something is added to or
+	 * removed from it, a release usually does that */
+	tree_fd = open( tree_path, O_PATH | O_DIRECTORY );
+	if( tree_fd == -1 || fstat( tree_fd, &st ) == -1 ||
+	    st.st_dev != header->dev || st.st_ino != header->ino ||
+	    st.st_mtim.tv_sec != header->mtime ||
+	    st.st_mtim.tv_nsec != header->mtime_nsec ||
+	    st.st_ctim.tv_sec != header->ctime ||
+	    st.st_ctim.tv_nsec != header->ctime_nsec )
+	{
+		indexfs_destroy();
+		errno = ESTALE;
+		return FTP_ERROR;
+	}
+
+	log_dbg("Serving %llu entries of '%s' from index '%s'\n",
+			(unsigned long long) header->num_entries, tree_path,
+			index );
+
+	return FTP_SUCCESS;
+}
+
+static void indexfs_destroy(void)
+{
+	if( tree_fd != -1 )
+		close( tree_fd );
+	tree_fd = -1;
+
+	if( map != NULL )
+		munmap( map, map_size );
+	map = NULL;
+	map_size = 0;
+	header = NULL;
+	entries = NULL;
+	strings = NULL;
+}
+
+/* An offset that points outside of the strings gets an empty one */
+static const char *index_string( uint64_t offset )
+{
+	if( offset >= header->strings_size )
+		return "";
+
+	return strings + offset;
+}
+
+/* Walk down from the top, one binary search among the children of each
+ * directory on the way */
+static const index_entry_t *find_entry( const char *path )
+{
+	const index_entry_t *entry = &entries[0];
+
+	while( *path )
+	{
+		const char *name, *end;
+		uint64_t lo, hi;
+		size_t len;
+
+		while( *path == '/' )
+			path++;
+		if( *path == '\0' )
+			break;
+
+		end = strchrnul( path, '/' );
+		len = end - path;
+
+		if( !S_ISDIR( entry->mode ) ||
+		    entry->first > header->num_entries ||
+		    entry->count > header->num_entries - entry->first )
+		{
+			errno = ENOTDIR;
+			return NULL;
+		}
+
+		lo = entry->first;
+		hi = entry->first + entry->count;
+		entry = NULL;
+
+		while( lo < hi )
+		{
+			uint64_t mid = lo + ( hi - lo ) / 2;
+			int cmp;
+
+			name = index_string( entries[mid].name );
+			cmp = strncmp( name, path, len );
+			if( cmp == 0 && name[len] != '\0' )
+				cmp = 1;
+
+			if( cmp == 0 )
+			{
+				entry = &entries[mid];
+				break;
+			}
+			else if( cmp < 0 )
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if( entry == NULL )
+		{
+			errno = ENOENT;
+			return NULL;
+		}
+
+		path = end;
+	}
+
+	return entry;
+}
+
+static void entry_stat( const index_entry_t *entry, struct stat *st )
+{
+	memset( st, 0, sizeof *st );
+	st->st_dev = entry->dev;
+	st->st_ino = entry->ino;
+	st->st_mode = entry->mode;
+	st->st_nlink = entry->nlink;
+	st->st_uid = entry->uid;
+	st->st_gid = entry->gid;
+	st->st_size = entry->size;
+	st->st_blksize = 4096;
+	st->st_blocks = entry->blocks;
+	st->st_mtim.tv_sec = entry->mtime;
+	st->st_mtim.tv_nsec = entry->mtime_nsec;
+	st->st_ctim.tv_sec = entry->ctime;
+	st->st_ctim.tv_nsec = entry->ctime_nsec;
+	st->st_atim = st->st_mtim;
+}
+
+/* Is the file in the tree still the one that was indexed? */
+static bool same_file( const index_entry_t *entry, const struct stat *st )
+{
+	return	st->st_ino == entry->ino && st->st_dev == entry->dev &&
+		st->st_size == (off_t) entry->size &&
+		st->st_mtim.tv_sec == entry->mtime &&
+		st->st_mtim.tv_nsec == entry->mtime_nsec;
+}
+
+static int indexfs_resolve( const char *vpath, char *dst, size_t len )
+{
+	if( snprintf( dst, len, "%s%s", tree_path, vpath ) >= (int) len )
+	{
+		dst[0] = '\0';
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int indexfs_stat( const char *vpath, struct stat *st )
+{
+	const index_entry_t *entry;
+
+	entry = find_entry( vpath );
+	if( entry == NULL )
+		return -1;
+
+	entry_stat( entry, st );
+
+	return 0;
+}
+
+/* The contents come from the tree. If the file there isn't the one in
+ * the index, the index is out of date */
+static int indexfs_open( const char *vpath, int flags )
+{
+	const index_entry_t *entry;
+	struct stat st;
+	int fd;
+
+	if( ( flags & O_ACCMODE ) != O_RDONLY || ( flags & O_TRUNC ) )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	entry = find_entry( vpath );
+	if( entry == NULL )
+		return -1;
+
+	if( S_ISDIR( entry->mode ) )
+	{
+		errno = EISDIR;
+		return -1;
+	}
+
+	fd = openat( tree_fd, vpath + 1, flags | O_NOFOLLOW );
+	if( fd == -1 && errno != ENOENT && errno != ELOOP )
+		return -1;
+
+	if( fd == -1 || fstat( fd, &st ) == -1 || !same_file( entry, &st ) )
+	{
+		if( fd != -1 )
+			close( fd );
+		errno = ESTALE;
+		return -1;
+	}
+
+	return fd;
+}
+
+static vfs_dir_t *indexfs_openlist( const char *vpath )
+{
+	const index_entry_t *entry;
+	vfs_dir_t *list;
+
+	entry = find_entry( vpath );
+	if( entry == NULL )
+		return NULL;
+
+	if( !S_ISDIR( entry->mode ) || entry->first > header->num_entries ||
+	    entry->count > header->num_entries - entry->first )
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	list = malloc( sizeof *list );
+	if( list == NULL )
+	{
+		FATAL_MEM( sizeof *list );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list->num = 0;
+	list->ahead = NULL;
+	list->data = entry;
+	list->pos = entry->first;
+	list->len = entry->first + entry->count;
+
+	return list;
+}
+
+static struct dirent *indexfs_readlist( vfs_dir_t *list )
+{
+	const index_entry_t *entry;
+
+	if( list->pos >= list->len )
+		return NULL;
+
+	entry = &entries[list->pos++];
+
+	memset( &list->entry, 0, sizeof list->entry );
+	list->entry.d_ino = entry->ino;
+	list->entry.d_type = S_ISDIR( entry->mode ) ? DT_DIR : DT_REG;
+	strlcpy( list->entry.d_name, index_string( entry->name ),
+			sizeof list->entry.d_name );
+
+	return &list->entry;
+}
+
+/* readlist() leaves POS right after the entry it returned */
+static int indexfs_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st )
+{
+	(void) mask;
+
+	entry_stat( &entries[list->pos - 1], st );
+
+	return 0;
+}
+
+static const char *indexfs_listline( vfs_dir_t *list, size_t *len )
+{
+	const index_entry_t *entry = &entries[list->pos - 1];
+
+	if( entry->line_len >= header->strings_size ||
+	    entry->line > header->strings_size - entry->line_len )
+		return NULL;
+
+	*len = entry->line_len;
+
+	return strings + entry->line;
+}
+
+static int indexfs_closelist( vfs_dir_t *list )
+{
+	free( list );
+
+	return 0;
+}
+
+static int indexfs_fallback( char *dir, size_t len )
+{
+	if( tree_path[0] == '\0' || strlcpy( dir, tree_path, len ) >= len )
+		return -1;
+
+	return 0;
+}
+
+/* The index being built by build_index() */
+static struct
+{
+	index_entry_t *entries;
+	size_t *parents;		/* To find the path of a directory */
+	size_t num, max;
+	char *strings;
+	size_t len, size;
+	list_dates_t dates;
+} build;
+
+static int compare_names( const void *p1, const void *p2 )
+{
+	return strcmp( *(char * const *) p1, *(char * const *) p2 );
+}
+
+/* Returns the offset of the copy, or -1 */
+static int64_t add_string( const char *str, size_t len )
+{
+	size_t offset = build.len;
+
+	if( build.len + len + 1 > build.size )
+	{
+		size_t size = build.size ? build.size : 1024 * 1024;
+		char *tmp;
+
+		while( size < build.len + len + 1 )
+			size *= 2;
+
+		tmp = realloc( build.strings, size );
+		if( tmp == NULL )
+		{
+			FATAL_MEM( size );
+			return -1;
+		}
+		build.strings = tmp;
+		build.size = size;
+	}
+
+	memcpy( build.strings + build.len, str, len );
+	build.strings[build.len + len] = '\0';
+	build.len += len + 1;
+
+	return offset;
+}
+
+static int add_index_entry( const char *name, const struct stat *st,
+		size_t parent )
+{
+	index_entry_t *entry;
+	char line[STAT_BUFFER_SIZE];
+	int64_t name_offset, line_offset;
+	int len;
+
+	if( build.num == build.max )
+	{
+		size_t max = build.max ? build.max * 2 : 4096;
+		index_entry_t *tmp;
+		size_t *parents;
+
+		tmp = realloc( build.entries, max * sizeof *tmp );
+		if( tmp == NULL )
+		{
+			FATAL_MEM( max * sizeof *tmp );
+			return FTP_ERROR;
+		}
+		build.entries = tmp;
+
+		parents = realloc( build.parents, max * sizeof *parents );
+		if( parents == NULL )
+		{
+			FATAL_MEM( max * sizeof *parents );
+			return FTP_ERROR;
+		}
+		build.parents = parents;
+		build.max = max;
+	}
+
+	len = format_list_line( st, name, &build.dates, line );
+
+	name_offset = add_string( name, strlen( name ) );
+	line_offset = add_string( line, len );
+	if( name_offset == -1 || line_offset == -1 )
+		return FTP_ERROR;
+
+	entry = &build.entries[build.num];
+	memset( entry, 0, sizeof *entry );
+	entry->name = name_offset;
+	entry->line = line_offset;
+	entry->line_len = len;
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->size = S_ISDIR( st->st_mode ) ? 0 : st->st_size;
+	entry->blocks = st->st_blocks;
+	entry->mtime = st->st_mtim.tv_sec;
+	entry->mtime_nsec = st->st_mtim.tv_nsec;
+	entry->ctime = st->st_ctim.tv_sec;
+	entry->ctime_nsec = st->st_ctim.tv_nsec;
+	entry->mode = st->st_mode;
+	entry->nlink = st->st_nlink;
+	entry->uid = st->st_uid;
+	entry->gid = st->st_gid;
+
+	build.parents[build.num] = parent;
+	build.num++;
+
+	return FTP_SUCCESS;
+}
+
+/* The real path of entry I, below TREE */
+static int entry_path( const char *tree, size_t i, char *dst, size_t len )
+{
+	size_t chain[FTP_MAX_PATH / 2];
+	size_t depth = 0, pos;
+
+	for( ; i != 0; i = build.parents[i] )
+	{
+		if( depth == sizeof chain / sizeof *chain )
+			return -1;
+		chain[depth++] = i;
+	}
+
+	pos = strlcpy( dst, tree, len );
+	while( depth > 0 && pos < len )
+		pos += snprintf( dst + pos, len - pos, "/%s", build.strings +
+				build.entries[chain[--depth]].name );
+
+	return pos < len ? 0 : -1;
+}
+
+/* Add the children of directory I, sorted by name. Links and special
+ * files are left out, like tarfs does */
+static int index_directory( const char *tree, size_t i )
+{
+	char path[FTP_MAX_REAL_PATH];
+	char **names = NULL;
+	size_t num = 0, max = 0, j;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int ret = FTP_SUCCESS;
+
+	if( entry_path( tree, i, path, sizeof path ) == -1 )
+	{
+		log_warn("Path too long below '%s', skipping it\n", tree );
+		return FTP_SUCCESS;
+	}
+
+	dir = opendir( path );
+	if( dir == NULL )
+	{
+		log_warn("Unable to index '%s': %m\n", path );
+		return FTP_SUCCESS;
+	}
+
+	while( (ent = readdir( dir )) != NULL && ret == FTP_SUCCESS )
+	{
+		if( strcmp( ent->d_name, "." ) == 0 ||
+		    strcmp( ent->d_name, ".." ) == 0 )
+			continue;
+
+		if( num == max )
+		{
+			char **tmp;
+
+			max = max ? max * 2 : 64;
+			tmp = realloc( names, max * sizeof *names );
+			if( tmp == NULL )
+			{
+				FATAL_MEM( max * sizeof *names );
+				ret = FTP_ERROR;
+				break;
+			}
+			names = tmp;
+		}
+
+		names[num] = strdup( ent->d_name );
+		if( names[num] == NULL )
+		{
+			FATAL_MEM( strlen( ent->d_name ) + 1 );
+			ret = FTP_ERROR;
+			break;
+		}
+		num++;
+	}
+
+	qsort( names, num, sizeof *names, compare_names );
+
+	build.entries[i].first = build.num;
+
+	for( j = 0; j < num; j++ )
+	{
+		if( ret == FTP_SUCCESS &&
+		    fstatat( dirfd( dir ), names[j], &st,
+				AT_SYMLINK_NOFOLLOW ) == 0 &&
+		    ( S_ISREG( st.st_mode ) || S_ISDIR( st.st_mode ) ) )
+			ret = add_index_entry( names[j], &st, i );
+		free( names[j] );
+	}
+
+	build.entries[i].count = build.num - build.entries[i].first;
+
+	free( names );
+	closedir( dir );
+
+	return ret;
+}
+
+/* Index the tree below TREE into the file INDEX. The directories are
+ * read breadth first, so the children of each one end up together. The
+ * new index replaces the old one in one rename */
+int build_index( const char *tree, const char *index )
+{
+	index_header_t hdr;
+	char tmp[FTP_MAX_REAL_PATH];
+	struct stat st;
+	size_t i;
+	int64_t tree_offset;
+	size_t tree_len;
+	off_t pos;
+	int fd, ret = FTP_SUCCESS;
+
+	if( tree[0] != '/' )
+	{
+		log_fatal("The tree to index needs an absolute path\n");
+		return FTP_ERROR;
+	}
+
+	if( stat( tree, &st ) == -1 || !S_ISDIR( st.st_mode ) )
+	{
+		log_fatal("Unable to index '%s': %m\n", tree );
+		return FTP_ERROR;
+	}
+
+	memset( &build, 0, sizeof build );
+	init_list_dates( &build.dates );
+	memset( &hdr, 0, sizeof hdr );
+	memcpy( hdr.magic, INDEX_MAGIC, sizeof hdr.magic );
+	hdr.dev = st.st_dev;
+	hdr.ino = st.st_ino;
+	hdr.mtime = st.st_mtim.tv_sec;
+	hdr.mtime_nsec = st.st_mtim.tv_nsec;
+	hdr.ctime = st.st_ctim.tv_sec;
+	hdr.ctime_nsec = st.st_ctim.tv_nsec;
+
+	/* The virtual paths get appended to it */
+	for( tree_len = strlen( tree ); tree_len > 1 &&
+			tree[tree_len - 1] == '/'; tree_len-- )
+		; /* Do nothing */
+
+	tree_offset = add_string( tree, tree_len );
+	if( tree_offset == -1 || add_index_entry( "", &st, 0 ) != FTP_SUCCESS )
+		ret = FTP_ERROR;
+	hdr.tree = tree_offset;
+
+	for( i = 0; i < build.num && ret == FTP_SUCCESS; i++ )
+		if( S_ISDIR( build.entries[i].mode ) )
+			ret = index_directory( build.strings + tree_offset, i );
+
+	hdr.num_entries = build.num;
+	hdr.strings_size = build.len;
+
+	snprintf( tmp, sizeof tmp, "%s.tmp", index );
+	fd = ret == FTP_SUCCESS ?
+		open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) : -1;
+	if( ret == FTP_SUCCESS && fd == -1 )
+	{
+		log_fatal("Unable to create '%s': %m\n", tmp );
+		ret = FTP_ERROR;
+	}
+
+	if( fd != -1 )
+	{
+		pos = 0;
+		if( pwriteall( fd, &hdr, sizeof hdr, pos ) == -1 ||
+		    pwriteall( fd, build.entries, build.num *
+			sizeof *build.entries, pos += sizeof hdr ) == -1 ||
+		    pwriteall( fd, build.strings, build.len,
+			pos += build.num * sizeof *build.entries ) == -1 ||
+		    fsync( fd ) == -1 || close( fd ) == -1 ||
+		    rename( tmp, index ) == -1 )
+		{
+			log_fatal("Unable to write index '%s': %m\n", index );
+			unlink( tmp );
+			ret = FTP_ERROR;
+		}
+		else
+			log_info("Indexed %zu entries of '%s' into '%s'\n",
+					build.num, tree, index );
+	}
+
+	free( build.entries );
+	free( build.parents );
+	free( build.strings );
+	memset( &build, 0, sizeof build );
+
+	return ret;
+}
@@ -0,0 +1,42 @@
+#ifndef __INDEXFS_H__
+#define __INDEXFS_H__ 1
+
+#include <stdint.h>
+
+/* An index file is the header, the entries and then the strings. The
+ * children of a directory are next to each other, sorted by name, so a
+ * path is found with a binary search per component */
+typedef struct index_header
+{
+	char magic[8];			/* INDEX_MAGIC */
+	uint64_t num_entries;
+	uint64_t strings_size;
+	uint64_t tree;			/* Path of the tree, in the strings */
+	uint64_t dev, ino;		/* Of its top directory when indexed */
+	int64_t mtime, ctime;
+	uint32_t mtime_nsec, ctime_nsec;
+} index_header_t;
+
+/* One file or directory. Entry 0 is the top of the tree */
+typedef struct index_entry
+{
+	uint64_t name;			/* Offsets in the strings */
+	uint64_t line;			/* Its line of LIST */
+	uint64_t first;			/* Children of a directory */
+	uint64_t count;
+	uint64_t dev, ino;
+	uint64_t size, blocks;
+	int64_t mtime, ctime;
+	uint32_t mtime_nsec, ctime_nsec;
+	uint32_t mode, nlink;
+	uint32_t uid, gid;
+	uint32_t line_len;
+	uint32_t unused;
+} index_entry_t;
+
+extern const vfs_ops_t indexfs_ops;
+extern int build_index( const char *tree, const char *index );
+
+#define INDEX_MAGIC		"FTPIDX01"
+
+#endif
@@ -0,0 +1,558 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+/* Lives in shared memory, every session serves what another one listed.
+ * The listings themselves are in the blob, a memfd every child inherits,
+ * so a hit goes out with sendfile() */
+typedef struct list_cache
+{
+	pthread_mutex_t lock;
+	list_cache_stats_t stats;
+	off_t next;			/* Where the next listing goes */
+	unsigned long changes[LIST_CACHE_ENTRIES];	/* Events, by watch */
+	list_entry_t entries[LIST_CACHE_ENTRIES];
+} list_cache_t;
+
+static int cache_lock(void);
+static bool same_listing( const list_entry_t *entry,
+		const list_ticket_t *ticket );
+static void apply_event( const struct inotify_event *event );
+static void release_watch( int wd );
+static void drop_entry( list_entry_t *entry, int keep_wd );
+static bool is_busy( list_entry_t *entry, time_t now );
+static int reserve_entry( size_t len, int wd, time_t now );
+
+static list_cache_t *list_cache = NULL;
+static int blob_fd = -1;
+static off_t blob_size = 0;
+static int inotify_fd = -1;
+
+/* A file in the directory changing changes its listing too. What
+ * happens below a subdirectory doesn't show up here, the age limit takes
+ * care of that */
+#define LIST_WATCH_MASK	( IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | \
+			  IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | \
+			  IN_DELETE_SELF | IN_ONLYDIR )
+
+int init_list_cache(void)
+{
+	pthread_mutexattr_t mattr;
+	int i;
+
+	if( config.list_cache_size <= 0 )
+		return FTP_SUCCESS;
+
+	log_dbg("Initializing listing cache (%d kB)\n",
+			config.list_cache_size );
+
+	blob_size = (off_t) config.list_cache_size * 1024;
+	blob_fd = memfd_create( "ftpd-listings", 0 );
+	if( blob_fd == -1 || ftruncate( blob_fd, blob_size ) == -1 )
+	{
+		log_fatal("Unable to create listing cache: %m\n");
+		if( blob_fd != -1 )
+			close( blob_fd );
+		blob_fd = -1;
+		return FTP_ERROR;
+	}
+
+	list_cache = mmap( NULL, sizeof *list_cache, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( list_cache == MAP_FAILED )
+	{
+		log_fatal("Unable to map listing cache: %m\n");
+		list_cache = NULL;
+		close( blob_fd );
+		blob_fd = -1;
+		return FTP_ERROR;
+	}
+
+	memset( list_cache, '\0', sizeof *list_cache );
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+		list_cache->entries[i].wd = -1;
+
+	/* A child can get killed while holding the lock */
+	pthread_mutexattr_init( &mattr );
+	pthread_mutexattr_setpshared( &mattr, PTHREAD_PROCESS_SHARED );
+	pthread_mutexattr_setrobust( &mattr, PTHREAD_MUTEX_ROBUST );
+	pthread_mutex_init( &list_cache->lock, &mattr );
+	pthread_mutexattr_destroy( &mattr );
+
+	/* The children share it with the masterserver, whoever reads an
+	 * event applies it. Without inotify we still check the mtime of
+	 * the directory on every hit */
+	inotify_fd = inotify_init1( IN_NONBLOCK );
+	if( inotify_fd == -1 )
+		log_warn("Unable to watch listed directories: %m\n");
+
+	return FTP_SUCCESS;
+}
+
+int destroy_list_cache(void)
+{
+	if( inotify_fd != -1 )
+		close( inotify_fd );
+	inotify_fd = -1;
+
+	if( list_cache != NULL )
+		munmap( list_cache, sizeof *list_cache );
+	list_cache = NULL;
+
+	if( blob_fd != -1 )
+		close( blob_fd );
+	blob_fd = -1;
+
+	return FTP_SUCCESS;
+}
+
+/* The descriptor the masterserver should poll for invalidations */
+int list_cache_fd(void)
+{
+	return inotify_fd;
+}
+
+static int cache_lock(void)
+{
+	int ret;
+
+	ret = pthread_mutex_lock( &list_cache->lock );
+	if( ret == EOWNERDEAD )
+		ret = pthread_mutex_consistent( &list_cache->lock );
+
+	return ret;
+}
+
+static bool same_listing( const list_entry_t *entry,
+		const list_ticket_t *ticket )
+{
+	return	entry->ino == ticket->st.st_ino &&
+		entry->dev == ticket->st.st_dev &&
+		entry->key == ticket->key &&
+		entry->hash == ticket->hash &&
+		entry->uid == getuid() &&
+		entry->mtime.tv_sec == ticket->st.st_mtim.tv_sec &&
+		entry->mtime.tv_nsec == ticket->st.st_mtim.tv_nsec &&
+		entry->ctime.tv_sec == ticket->st.st_ctim.tv_sec &&
+		entry->ctime.tv_nsec == ticket->st.st_ctim.tv_nsec;
+}
+
+/* Call with the lock held */
+static void apply_event( const struct inotify_event *event )
+{
+	int i;
+
+	if( event->mask & IN_Q_OVERFLOW )
+	{
+		for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+		{
+			list_cache->changes[i]++;
+			if( list_cache->entries[i].valid )
+				list_cache->stats.invalidations++;
+			list_cache->entries[i].valid = false;
+		}
+		return;
+	}
+
+	list_cache->changes[event->wd % LIST_CACHE_ENTRIES]++;
+
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+	{
+		list_entry_t *entry = &list_cache->entries[i];
+
+		if( entry->wd != event->wd )
+			continue;
+
+		if( entry->valid )
+			list_cache->stats.invalidations++;
+		entry->valid = false;
+
+		/* The watch is gone */
+		if( event->mask & IN_IGNORED )
+			entry->wd = -1;
+	}
+}
+
+/* Drop the listings of directories that changed. The masterserver calls
+ * this when the descriptor is readable, the children before they look
+ * anything up, so they see their own changes at once */
+int list_cache_handle_events(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+
+	if( inotify_fd == -1 )
+		return FTP_SUCCESS;
+
+	while( (len = read( inotify_fd, buf, sizeof buf )) > 0 )
+	{
+		if( cache_lock() != 0 )
+			return FTP_ERROR;
+
+		for( ptr = buf; ptr < buf + len;
+				ptr += sizeof(*event) + event->len )
+		{
+			event = (const struct inotify_event *) ptr;
+			apply_event( event );
+		}
+
+		pthread_mutex_unlock( &list_cache->lock );
+	}
+
+	if( len == -1 && errno != EAGAIN && errno != EINTR )
+	{
+		log_warn("Unable to read inotify events: %m\n");
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Remove the watch WD if no listing needs it anymore. Call with the lock
+ * held. Somebody listing the directory right now sees IN_IGNORED and
+ * doesn't store what it got */
+static void release_watch( int wd )
+{
+	int i;
+
+	if( wd == -1 )
+		return;
+
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+		if( list_cache->entries[i].wd == wd &&
+		    ( list_cache->entries[i].valid ||
+		      list_cache->entries[i].readers > 0 ) )
+			return;
+
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+		if( list_cache->entries[i].wd == wd )
+			list_cache->entries[i].wd = -1;
+
+	inotify_rm_watch( inotify_fd, wd );
+}
+
+/* Call with the lock held. The watch KEEP_WD is about to be used again */
+static void drop_entry( list_entry_t *entry, int keep_wd )
+{
+	int wd = entry->wd;
+
+	entry->valid = false;
+	entry->len = 0;
+	entry->wd = -1;
+
+	if( wd != keep_wd )
+		release_watch( wd );
+}
+
+/* Is somebody still sending ENTRY? A child killed halfway through never
+ * gives its entry back, so readers are forgotten after a while */
+static bool is_busy( list_entry_t *entry, time_t now )
+{
+	if( entry->readers == 0 )
+		return false;
+
+	if( now - entry->used < LIST_CACHE_STALE_READER )
+		return true;
+
+	entry->readers = 0;
+	return false;
+}
+
+/* Find an entry and LEN bytes of the blob for a new listing watched by
+ * WD. The blob is filled like a ring, whatever is in the way gets dropped
+ * unless it is being sent. Call with the lock held. Returns -1 if there
+ * is no room */
+static int reserve_entry( size_t len, int wd, time_t now )
+{
+	list_entry_t *entry;
+	off_t start, end;
+	int i, slot = -1;
+
+	start = list_cache->next;
+	if( start + (off_t) len > blob_size )
+		start = 0;
+	end = start + len;
+
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+	{
+		entry = &list_cache->entries[i];
+
+		if( entry->len > 0 && entry->offset < end &&
+		    start < entry->offset + (off_t) entry->len &&
+		    is_busy( entry, now ) )
+			return -1;
+	}
+
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+	{
+		entry = &list_cache->entries[i];
+
+		if( entry->len > 0 && entry->offset < end &&
+		    start < entry->offset + (off_t) entry->len )
+			drop_entry( entry, wd );
+
+		if( is_busy( entry, now ) )
+			continue;
+
+		/* An unused entry, or else the least recently used one */
+		if( slot == -1 || ( list_cache->entries[slot].valid &&
+		    ( !entry->valid ||
+		      entry->used < list_cache->entries[slot].used ) ) )
+			slot = i;
+	}
+
+	if( slot == -1 )
+		return -1;
+
+	entry = &list_cache->entries[slot];
+	drop_entry( entry, wd );
+
+	entry->offset = start;
+	entry->wd = wd;
+	entry->len = len;
+	entry->readers = 1;		/* Until it is written */
+	entry->used = now;
+	list_cache->next = end;
+
+	return slot;
+}
+
+/* Look for a listing of DIR with KEY. On a hit the ticket holds on to
+ * it until list_cache_send(). On a miss, OUT starts keeping a copy of
+ * the listing for list_cache_store() */
+bool list_cache_lookup( ftp_session_t *session, const char *dir,
+		unsigned int key, outbuf_t *out, list_ticket_t *ticket )
+{
+	char real[FTP_MAX_REAL_PATH];
+	time_t now;
+	int i, wd;
+
+	ticket->entry = -1;
+	ticket->wd = -1;
+
+	/* Only plain directories, merged ones are put together from
+	 * several real ones. Indexes have their lines ready anyway */
+	if( list_cache == NULL || vfs_merged() || vfs_prerendered() )
+		return false;
+
+	if( vfs_resolve( session->virt_path, dir, real, sizeof real ) == -1 ||
+	    stat( real, &ticket->st ) == -1 || !S_ISDIR( ticket->st.st_mode ) )
+		return false;
+
+	ticket->hash = hash_string( real ) * 31 + hash_string( dir );
+	ticket->key = key;
+
+	list_cache_handle_events();
+
+	if( cache_lock() != 0 )
+		return false;
+
+	now = time( NULL );
+
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+	{
+		list_entry_t *entry = &list_cache->entries[i];
+
+		if( !entry->valid || !same_listing( entry, ticket ) )
+			continue;
+
+		if( now - entry->stored >= config.list_cache_time )
+		{
+			entry->valid = false;
+			list_cache->stats.invalidations++;
+			break;
+		}
+
+		entry->readers++;
+		entry->used = now;
+		list_cache->stats.hits++;
+		ticket->entry = i;
+
+		pthread_mutex_unlock( &list_cache->lock );
+		return true;
+	}
+
+	list_cache->stats.misses++;
+
+	pthread_mutex_unlock( &list_cache->lock );
+
+	/* Watch it before listing, so no change goes unnoticed */
+	if( inotify_fd != -1 )
+	{
+		wd = inotify_add_watch( inotify_fd, real, LIST_WATCH_MASK );
+		if( wd == -1 )
+		{
+			log_dbg("Unable to watch '%s': %m\n", real );
+			return false;
+		}
+
+		if( cache_lock() != 0 )
+			return false;
+		ticket->wd = wd;
+		ticket->change = list_cache->changes[wd % LIST_CACHE_ENTRIES];
+		pthread_mutex_unlock( &list_cache->lock );
+	}
+
+	outbuf_copy( out, blob_size / 4 < LIST_CACHE_MAX_LISTING ?
+			blob_size / 4 : LIST_CACHE_MAX_LISTING );
+
+	return false;
+}
+
+/* Send the listing the ticket got from list_cache_lookup() */
+int list_cache_send( ftp_session_t *session, outbuf_t *out,
+		list_ticket_t *ticket )
+{
+	list_entry_t *entry = &list_cache->entries[ticket->entry];
+	stream_t blob = { blob_fd, S_FILE };
+	int ret;
+
+	/* Nobody moves it while we are reading */
+	ret = send_file( session, out, blob, entry->offset, entry->len,
+			false );
+
+	if( cache_lock() == 0 )
+	{
+		if( entry->readers > 0 )
+			entry->readers--;
+		pthread_mutex_unlock( &list_cache->lock );
+	}
+
+	ticket->entry = -1;
+
+	return ret;
+}
+
+/* Put what OUT copied into the cache, if the listing went through and the
+ * directory didn't change while it was being listed */
+void list_cache_store( list_ticket_t *ticket, const outbuf_t *out, int ret )
+{
+	list_entry_t *entry;
+	const char *copy;
+	size_t len;
+	time_t now;
+	bool written;
+	int i, slot;
+
+	if( list_cache == NULL )
+		return;
+
+	copy = outbuf_copied( out, &len );
+
+	list_cache_handle_events();
+
+	if( cache_lock() != 0 )
+		return;
+
+	now = time( NULL );
+
+	if( ret != FTP_SUCCESS || copy == NULL || len == 0 ||
+	    ( ticket->wd != -1 && ticket->change !=
+	      list_cache->changes[ticket->wd % LIST_CACHE_ENTRIES] ) ||
+	    ( slot = reserve_entry( len, ticket->wd, now ) ) == -1 )
+	{
+		release_watch( ticket->wd );
+		pthread_mutex_unlock( &list_cache->lock );
+		return;
+	}
+
+	entry = &list_cache->entries[slot];
+	entry->dev = ticket->st.st_dev;
+	entry->ino = ticket->st.st_ino;
+	entry->mtime = ticket->st.st_mtim;
+	entry->ctime = ticket->st.st_ctim;
+	entry->hash = ticket->hash;
+	entry->uid = getuid();
+	entry->key = ticket->key;
+
+	pthread_mutex_unlock( &list_cache->lock );
+
+	written = pwriteall( blob_fd, copy, len, entry->offset ) ==
+		(ssize_t) len;
+	if( !written )
+		log_warn("Unable to store listing: %m\n");
+
+	list_cache_handle_events();
+
+	if( cache_lock() != 0 )
+		return;
+
+	entry->readers--;
+
+	if( !written || ( ticket->wd != -1 && ticket->change !=
+	    list_cache->changes[ticket->wd % LIST_CACHE_ENTRIES] ) )
+	{
+		drop_entry( entry, -1 );
+		pthread_mutex_unlock( &list_cache->lock );
+		return;
+	}
+
+	/* Somebody else listed it at the same time */
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+		if( list_cache->entries[i].valid &&
+		    same_listing( &list_cache->entries[i], ticket ) )
+			list_cache->entries[i].valid = false;
+
+	entry->valid = true;
+	entry->stored = entry->used = now;
+	list_cache->stats.stores++;
+
+	pthread_mutex_unlock( &list_cache->lock );
+}
+
+int dosite_listcache( ftp_session_t *session )
+{
+	ftp_conn_t *conn = &session->conn;
+	list_cache_stats_t stats;
+	unsigned long listings = 0, lookups;
+	off_t used = 0;
+	int i;
+
+	if( list_cache == NULL )
+	{
+		reply( conn, "502 No listing cache configured\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	if( cache_lock() != 0 )
+	{
+		reply( conn, "451 Local error in processing\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	stats = list_cache->stats;
+	for( i = 0; i < LIST_CACHE_ENTRIES; i++ )
+		if( list_cache->entries[i].valid )
+		{
+			listings++;
+			used += list_cache->entries[i].len;
+		}
+
+	pthread_mutex_unlock( &list_cache->lock );
+
+	lookups = stats.hits + stats.misses;
+
+	reply( conn, "211-Listing cache status:\r\n" );
+	reply_format( conn, " Listings: %lu (%lld of %d kB)\r\n",
+			listings, (long long) used / 1024,
+			config.list_cache_size );
+	reply_format( conn, " Hits: %lu Misses: %lu Ratio: %lu%%\r\n",
+			stats.hits, stats.misses,
+			lookups ? stats.hits * 100 / lookups : 0 );
+	reply_format( conn, " Stores: %lu Invalidations: %lu\r\n",
+			stats.stores, stats.invalidations );
+	reply( conn, "211 End.\r\n" );
+
+	return FTP_SUCCESS;
+}
@@ -0,0 +1,71 @@
+#ifndef __LISTCACHE_H__
+#define __LISTCACHE_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* A rendered listing of one directory, in the blob every process shares */
+typedef struct list_entry
+{
+	dev_t dev;			/* Of the directory */
+	ino_t ino;
+	struct timespec mtime, ctime;
+	uint32_t hash;			/* Of its real and virtual path,
+					 * which tell the root it is in */
+	uid_t uid;			/* Whose permissions listed it */
+	unsigned int key;		/* Command and options, LIST_KEY_* */
+	int wd;				/* inotify watch on the directory */
+	off_t offset;			/* In the blob */
+	size_t len;
+	unsigned int readers;		/* Sending it, or writing it */
+	time_t stored, used;
+	bool valid;
+} list_entry_t;
+
+/* Counters for SITE LISTCACHE */
+typedef struct list_cache_stats
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long stores;
+	unsigned long invalidations;
+} list_cache_stats_t;
+
+/* What a session needs to serve or store one listing */
+typedef struct list_ticket
+{
+	struct stat st;			/* Of the directory */
+	uint32_t hash;
+	unsigned int key;
+	int wd;
+	int entry;			/* Being sent, -1 on a miss */
+	unsigned long change;		/* Of the watch, when listing began */
+} list_ticket_t;
+
+extern int init_list_cache(void);
+extern int destroy_list_cache(void);
+extern int list_cache_fd(void);
+extern int list_cache_handle_events(void);
+
+extern bool list_cache_lookup( ftp_session_t *session, const char *dir,
+		unsigned int key, outbuf_t *out, list_ticket_t *ticket );
+extern int list_cache_send( ftp_session_t *session, outbuf_t *out,
+		list_ticket_t *ticket );
+extern void list_cache_store( list_ticket_t *ticket, const outbuf_t *out,
+		int ret );
+extern int dosite_listcache( ftp_session_t *session );
+
+/* The keys of the listings */
+#define LIST_KEY_LIST		0x01000000
+#define LIST_KEY_MLSD		0x02000000
+#define LIST_KEY_ALL		0x00800000	/* LIST -a */
+
+#define LIST_CACHE_ENTRIES	1024
+#define LIST_CACHE_MAX_LISTING	( 16 * 1024 * 1024 )
+#define LIST_CACHE_STALE_READER	3600	/* Seconds until a reader that
+					 * never came back is forgotten */
+
+#endif
@@ -1,6 +1,9 @@
 #include <ctype.h>
 #include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <time.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,17 +14,87 @@ typedef struct list_options
 {
 	bool opt_a;
 /*	bool opt_l; */
+	bool opt_r;			/* Reverse the order */
+	bool opt_R;			/* Into every subdirectory */
+	bool opt_S;			/* Biggest first */
+	bool opt_t;			/* Newest first */
+	bool control;			/* For STAT, on the control connection */
+	const char *pattern;		/* Only the names matching it */
 } list_options_t;
 
+/* One entry of a listing that gets sorted, or a subdirectory still to be
+ * listed by -R. The names and lines are in a buffer of their own, so the
+ * sort only moves these few bytes around */
+typedef struct list_record
+{
+	int64_t key;			/* Time or size */
+	uint32_t name;			/* Offsets in the text */
+	uint32_t line;
+	uint32_t line_len;		/* 0 if it isn't shown */
+	bool dir;
+	bool descend;			/* A directory -R goes into */
+} list_record_t;
+
+typedef struct list_records
+{
+	list_record_t *records;
+	size_t count, max;
+	char *text;
+	size_t text_len, text_size;
+	bool reverse;
+} list_records_t;
+
+/* The facts of RFC 3659 we know about, and what statx() needs for them */
+static const struct
+{
+	const char *name;
+	unsigned int fact;
+	unsigned int mask;
+} mlst_facts[] = {
+	{ "type",	MLST_TYPE,	STATX_TYPE },
+	{ "size",	MLST_SIZE,	STATX_SIZE },
+	{ "modify",	MLST_MODIFY,	STATX_MTIME },
+	{ "perm",	MLST_PERM,	STATX_MODE },
+	{ "unique",	MLST_UNIQUE,	STATX_INO },
+	{ "UNIX.mode",	MLST_UNIX_MODE,	STATX_MODE },
+	{ "UNIX.uid",	MLST_UNIX_UID,	STATX_UID },
+	{ "UNIX.gid",	MLST_UNIX_GID,	STATX_GID },
+};
+
+#define NUM_MLST_FACTS ( sizeof mlst_facts / sizeof *mlst_facts )
+
 static char *parse_list_options( char *, list_options_t * );
-static int list_file( ftp_session_t *, char *);
-static int list_directory( ftp_session_t *, char *, list_options_t *);
+static char *split_pattern( ftp_session_t *, char *, list_options_t * );
+static int list_file( ftp_session_t *, const char *, list_options_t *,
+		outbuf_t * );
+static int list_directory( ftp_session_t *, const char *, list_options_t *,
+		outbuf_t * );
+static int list_tree( ftp_session_t *, const char *dir, const char *shown,
+		list_options_t *, list_dates_t *, outbuf_t *, int depth );
+static int keep_subdirs( list_records_t * );
+static bool sorted_listing( const list_options_t * );
+static int add_record( list_records_t *, const char *name,
+		const char *line, size_t line_len, int64_t key, bool dir,
+		bool descend );
+static int compare_records( const void *, const void *, void * );
+static int open_listing( ftp_session_t *, outbuf_t * );
+static void end_listing( ftp_session_t *, outbuf_t *, int ret );
+static char *put_str( char *p, const char *str );
+static char *put_num( char *p, unsigned long long num, unsigned int base,
+		int width );
+static char *format_facts( const ftp_session_t *, const struct stat *,
+		const char *type, char *buf );
+static int mlsd_directory( ftp_session_t *, const char *, outbuf_t * );
+static int nlst_directory( ftp_session_t *, const char *, list_options_t *,
+		outbuf_t * );
+static int send_name( const char *name, outbuf_t *out );
 
 int dolist (ftp_session_t *session)
 {
 	char *argument;
 	struct stat statarg;
 	list_options_t ls_opts = {0};
+	outbuf_t out;
 	int ret;
 	ftp_conn_t *conn = &session->conn;
 
@@ -30,6 +103,7 @@ int dolist (ftp_session_t *session)
 	/* Parse arguments, eg:
 	 * LIST -a -rd public */
 	argument = parse_list_options( argument, &ls_opts );
+	argument = split_pattern( session, argument, &ls_opts );
 
 	/* An empty argument means the current directory */
 	if( *argument == '\0' )
@@ -41,18 +115,126 @@ int dolist (ftp_session_t *session)
 		failed_vfs_reply( conn );
 		return FTP_SUCCESS;
 	}
-	
-	if( (conn->data_sock = accept_data_conn(conn)) == -1 )
+
+	ret = open_listing( session, &out );
+	if( ret != FTP_SUCCESS )
+		return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+
+	if( S_ISDIR(statarg.st_mode) ) 
+		ret = list_directory( session, argument, &ls_opts, &out );
+	else
+		ret = list_file( session, argument, &ls_opts, &out );
+
+	end_listing( session, &out, ret );
+
+	return FTP_SUCCESS;
+}
+
+/* STAT with a path is LIST over the control connection, as a 213 reply.
+ * For a small directory that beats setting up a data connection. The
+ * lines are held until they are all there, so a directory bigger than
+ * StatListSize gets a 450 and not half a reply */
+int stat_listing( ftp_session_t *session, char *arg )
+{
+	const char *argument;
+	list_options_t ls_opts = { .control = true };
+	struct stat st;
+	outbuf_t out;
+	ftp_conn_t *conn = &session->conn;
+	int ret;
+
+	if( config.stat_list_size == 0 )
+	{
+		reply( conn, "502 Use LIST\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	argument = split_pattern( session,
+			parse_list_options( arg, &ls_opts ), &ls_opts );
+
+	/* Its headers could pass for the end of the reply */
+	ls_opts.opt_R = false;
+
+	if( *argument == '\0' )
+		argument = ".";
+
+	if( vfs_stat( session->virt_path, argument, &st ) == -1 )
+	{
+		failed_vfs_reply( conn );
 		return FTP_SUCCESS;
+	}
+
+	if( outbuf_init( &out, conn->sock ) != FTP_SUCCESS )
+	{
+		reply( conn, "451 Local error in processing\r\n" );
+		return FTP_SUCCESS;
+	}
+	outbuf_limit( &out, config.stat_list_size * 1024 );
+
+	if( S_ISDIR( st.st_mode ) )
+		ret = list_directory( session, argument, &ls_opts, &out );
+	else
+		ret = list_file( session, argument, &ls_opts, &out );
+
+	if( ret == FTP_SUCCESS )
+	{
+		reply_format( conn, "213-Status of %s:\r\n", argument );
+		if( outbuf_finish( &out ) == -1 )
+			ret = FTP_QUIT;
+		else
+			reply( conn, "213 End of status\r\n" );
+	}
+	/* Failed with lines waiting, so the last one didn't fit */
+	else if( ret == FTP_FAIL && out.len > 0 )
+		reply( conn, "450 Too long for STAT, use LIST\r\n" );
+	else
+		reply( conn, "550 Listing failed\r\n" );
+
+	outbuf_free( &out );
+
+	return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+}
+
+/* Set up the data connection and its buffer. Returns FTP_FAIL if that
+ * didn't work out and the client got its reply already */
+static int open_listing( ftp_session_t *session, outbuf_t *out )
+{
+	ftp_conn_t *conn = &session->conn;
+
+	if( (conn->data_sock = accept_data_conn(conn)) == -1 )
+		return FTP_FAIL;
 	else if( conn->data_sock == -2 )
 		return FTP_QUIT;
 
+	if( data_outbuf( session, out, conn->data_sock ) != FTP_SUCCESS )
+	{
+		close_data_conn( session, FTP_ERROR );
+		reply( conn, "451 Local error in processing\r\n");
+		return FTP_FAIL;
+	}
+
 	reply( conn, "125 Data connection ok, transferring listing\r\n");
 
-	if( S_ISDIR(statarg.st_mode) ) 
-		ret = list_directory( session, argument, &ls_opts );
-	else
-		ret = list_file( session, argument );
+	return FTP_SUCCESS;
+}
+
+/* Send what is left of the listing and tell the client how it went */
+static void end_listing( ftp_session_t *session, outbuf_t *out, int ret )
+{
+	ftp_conn_t *conn = &session->conn;
+
+	if( ret == FTP_SUCCESS && outbuf_finish( out ) == -1 )
+	{
+		if( errno == EPIPE || errno == ECONNRESET )
+			ret = FTP_ABOR;
+		else
+		{
+			log_warn("Error sending listing: %m\n");
+			ret = FTP_ERROR;
+		}
+	}
+
+	outbuf_free( out );
 
 	switch(ret)
 	{
@@ -71,52 +253,98 @@ int dolist (ftp_session_t *session)
 		break;
 	}
 
-	close(conn->data_sock);
-	
-	return FTP_SUCCESS;
+	close_data_conn( session, ret );
 }
 
-static int send_filestat( const char *cwd, const char *vpath, int data_sock)
+void init_list_dates( list_dates_t *dates )
+{
+	dates->now = time( NULL );
+	dates->day = LLONG_MIN;
+	dates->minute = LLONG_MIN;
+	dates->recent = false;
+}
+
+/* The date of a line of LIST, which only goes through convert_time() for
+ * a day it hasn't seen just before */
+static const char *format_date( time_t mtime, list_dates_t *dates )
 {
 	static const char *months[] = 
 		{ "Jan", "Feb", "Mar", "Apr", "May", "Jun",
 		  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-	struct stat st;
 	struct tm tm;
-	const char *basename;
-	char date[13];
-	char statbuf[STAT_BUFFER_SIZE];
-	int len;
-	
-	if( vfs_stat( cwd, vpath, &st ) == -1 )
-		return FTP_FAIL;
+	long long minute, day;
+	bool recent;
 
-	convert_time( &st.st_mtime, &tm );
+	/* Rounded down, also before 1970 */
+	minute = mtime / 60 - ( mtime % 60 < 0 );
+	recent = mtime > dates->now - LIST_RECENT &&
+		mtime <= dates->now + LIST_FUTURE;
 
-	snprintf( date, sizeof(date), "%s %d %02d:%02d", months[tm.tm_mon],
-			tm.tm_mday, tm.tm_hour, tm.tm_min );
-			
-	basename = strrchr( vpath, '/' );
-	if( basename )
-		basename++;
+	if( minute == dates->minute && recent == dates->recent )
+		return dates->date;
+
+	day = minute / 1440 - ( minute % 1440 < 0 );
+	if( day != dates->day )
+	{
+		convert_time( &mtime, &tm );
+		snprintf( dates->mon_day, sizeof dates->mon_day, "%s %d",
+				months[tm.tm_mon], tm.tm_mday );
+		dates->year = tm.tm_year + 1900;
+		dates->day = day;
+	}
+
+	if( recent )
+		snprintf( dates->date, sizeof dates->date, "%s %02d:%02d",
+				dates->mon_day, (int) ( minute - day * 1440 ) / 60,
+				(int) ( minute - day * 1440 ) % 60 );
 	else
-		basename = vpath;
-			
+		snprintf( dates->date, sizeof dates->date, "%s %d",
+				dates->mon_day, dates->year );
+
+	dates->minute = minute;
+	dates->recent = recent;
+
+	return dates->date;
+}
+
+/* The line of LIST for the file NAME, written to BUF which has room for
+ * STAT_BUFFER_SIZE. Returns its length. Indexes are built with it too,
+ * so theirs show the time or the year as it was when they were built */
+int format_list_line( const struct stat *st, const char *name,
+		list_dates_t *dates, char *buf )
+{
+	int len;
+
 	/* Example: -rwxrwxrwx 1 1000 1000 4096 Jan 1 00:00 */
-	len = snprintf( statbuf, STAT_BUFFER_SIZE,
+	len = snprintf( buf, STAT_BUFFER_SIZE,
 		"%crwxrwxrwx %lu %lu %lu %lld %s %s\r\n",
-		get_modechar( st.st_mode ),
-		(unsigned long) st.st_nlink,
-		(unsigned long) st.st_uid,
-		(unsigned long) st.st_gid,
-		(unsigned long long)	st.st_size,
-		date,
-		basename);
-	
-	if( sendall( data_sock, statbuf, len, 0  ) == -1 )
+		get_modechar( st->st_mode ),
+		(unsigned long) st->st_nlink,
+		(unsigned long) st->st_uid,
+		(unsigned long) st->st_gid,
+		(unsigned long long)	st->st_size,
+		format_date( st->st_mtime, dates ),
+		name);
+
+	/* Cut short, but still a line */
+	if( len >= STAT_BUFFER_SIZE )
+	{
+		len = STAT_BUFFER_SIZE - 1;
+		buf[len - 2] = '\r';
+		buf[len - 1] = '\n';
+	}
+
+	return len;
+}
+
+static int send_line( const char *line, size_t len, outbuf_t *out )
+{
+	if( outbuf_write( out, line, len ) == -1 )
 	{
 		if( errno == EPIPE || errno == ECONNRESET )
 			return FTP_ABOR;
+		else if( errno == EFBIG )	/* Too long for STAT */
+			return FTP_FAIL;
 		else
 		{
 			log_warn("Error sending file stats: %m\n");
@@ -127,6 +355,52 @@ static int send_filestat( const char *cwd, const char *vpath, int data_sock)
 	return FTP_SUCCESS;
 }
 
+/* A line of LIST. STAT sends them in its reply, where they start with a
+ * space as RFC 959 asks for. A CR or LF in a name could end that reply
+ * early, so those show as '?' like ls -q shows them */
+static int send_entry( const list_options_t *ls_opts, const char *line,
+		size_t len, outbuf_t *out )
+{
+	char buf[STAT_BUFFER_SIZE + 1];
+	size_t i;
+
+	if( !ls_opts->control )
+		return send_line( line, len, out );
+
+	if( len < 2 )
+		return FTP_SUCCESS;
+	if( len > STAT_BUFFER_SIZE )
+		len = STAT_BUFFER_SIZE;
+
+	buf[0] = ' ';
+	for( i = 0; i + 2 < len; i++ )
+		buf[i + 1] = ( line[i] == '\r' || line[i] == '\n' ) ?
+			'?' : line[i];
+	buf[len - 1] = '\r';
+	buf[len] = '\n';
+
+	return send_line( buf, len + 1, out );
+}
+
+static int send_filestat( const struct stat *st, const char *vpath,
+		const list_options_t *ls_opts, list_dates_t *dates,
+		outbuf_t *out )
+{
+	const char *basename;
+	char statbuf[STAT_BUFFER_SIZE];
+	int len;
+
+	basename = strrchr( vpath, '/' );
+	if( basename )
+		basename++;
+	else
+		basename = vpath;
+
+	len = format_list_line( st, basename, dates, statbuf );
+
+	return send_entry( ls_opts, statbuf, len, out );
+}
+
 
 static char *parse_list_options( char *arg, list_options_t *ls_opts )
 {
@@ -143,6 +417,18 @@ static char *parse_list_options( char *arg, list_options_t *ls_opts )
 			case 'a':
 				ls_opts->opt_a = true;
 				break;
+			case 'r':
+				ls_opts->opt_r = true;
+				break;
+			case 'R':
+				ls_opts->opt_R = true;
+				break;
+			case 'S':
+				ls_opts->opt_S = true;
+				break;
+			case 't':
+				ls_opts->opt_t = true;
+				break;
 			default:
 				break;
 			}
@@ -156,55 +442,804 @@ static char *parse_list_options( char *arg, list_options_t *ls_opts )
 	return trim_whitespace( arg );
 }
 
-static int list_file( ftp_session_t *session, char *filepath)
+/* A last component like "*.iso" is matched against the names in the
+ * directory before it, unless there is a file that is really called that.
+ * Returns the directory */
+static char *split_pattern( ftp_session_t *session, char *arg,
+		list_options_t *ls_opts )
 {
-	int ret;
+	static char root[] = "/";
+	static char cwd[] = "";
+	struct stat st;
+	char *basename;
 
-	ret = send_filestat( session->virt_path, filepath, session->conn.data_sock );
+	basename = strrchr( arg, '/' );
+	basename = basename ? basename + 1 : arg;
 
-	return ret;
+	if( strpbrk( basename, "*?[" ) == NULL ||
+			vfs_stat( session->virt_path, arg, &st ) == 0 )
+		return arg;
+
+	ls_opts->pattern = basename;
+	if( basename == arg )
+		return cwd;
+	if( basename == arg + 1 )
+		return root;
+
+	basename[-1] = '\0';
+	return arg;
 }
 
-int list_directory( ftp_session_t *session, char *dirname, 
-		list_options_t *ls_opts )
+static int list_file( ftp_session_t *session, const char *filepath,
+		list_options_t *ls_opts, outbuf_t *out )
 {
-	DIR *drv;
-	char temp_path_buffer[FTP_MAX_PATH];
+	struct stat st;
+	list_dates_t dates;
+
+	if( vfs_stat( session->virt_path, filepath, &st ) == -1 )
+		return FTP_FAIL;
+
+	init_list_dates( &dates );
+
+	return send_filestat( &st, filepath, ls_opts, &dates, out );
+}
+
+/* The directory is opened once, and its entries are stat'ed relative to
+ * it. The lines collect in the output buffer, which goes out in 64 KB
+ * writes. A listing somebody made a moment ago comes from the cache */
+int list_directory( ftp_session_t *session, const char *dirname,
+		list_options_t *ls_opts, outbuf_t *out )
+{
+	vfs_dir_t *drv;
+	char dir[FTP_MAX_PATH];
 	struct stat st;
 	struct dirent *next;
+	list_ticket_t ticket;
+	list_dates_t dates;
+	const char *line;
+	unsigned int key;
+	size_t len;
+	int ret = FTP_SUCCESS;
+
+	/* The reply comes from the caller, which may be STAT */
+	if( vfs_virtual( session->virt_path, dirname, dir, sizeof dir ) == -1 )
+		return FTP_FAIL;
 
-	/* Save the current directory */
-	strlcpy( temp_path_buffer, session->virt_path, FTP_MAX_PATH);
+	/* Remember the order, for prefetching during RETR */
+	listing_reset( session, dir );
 
-	vfs_chdir( session->virt_path, dirname );
+	init_list_dates( &dates );
 
-	/* It's a directory, so open it and list the contents */
-	if( (drv = vfs_opendir( session->virt_path, "." )) == NULL )
+	/* Sorted, filtered, recursive and STAT listings are made to order */
+	if( ls_opts->opt_R || ls_opts->pattern != NULL ||
+			sorted_listing( ls_opts ) || ls_opts->control )
 	{
-		failed_vfs_reply(&session->conn);
-		return FTP_ERROR;
+		if( ls_opts->opt_R )
+		{
+			ret = send_line( dirname, strlen( dirname ), out );
+			if( ret == FTP_SUCCESS )
+				ret = send_line( ":\r\n", 3, out );
+			if( ret != FTP_SUCCESS )
+				return ret;
+		}
+
+		return list_tree( session, dir, dirname, ls_opts, &dates,
+				out, 0 );
+	}
+
+	key = LIST_KEY_LIST | ( ls_opts->opt_a ? LIST_KEY_ALL : 0 );
+	if( list_cache_lookup( session, dir, key, out, &ticket ) )
+		return list_cache_send( session, out, &ticket );
+
+	/* It's a directory, so open it on every disk and list the contents */
+	if( (drv = vfs_openlist( dir, "." )) == NULL )
+	{
+		list_cache_store( &ticket, out, FTP_FAIL );
+		return FTP_FAIL;
 	}
+
+	vfs_statahead( drv, STATX_BASIC_STATS );
 	
-	while( (next = readdir( drv )) != NULL )
+	while( (next = vfs_readlist( drv )) != NULL )
 	{
-		int ret;
+		if( next->d_name[0] == '.' && !ls_opts->opt_a )
+			continue;
+
+		/* An index has the lines ready */
+		line = vfs_listline( drv, &len );
+		if( line != NULL )
+			ret = send_line( line, len, out );
+		/* We ignore failed stat's. */
+		else if( vfs_statlist( drv, dir, next->d_name,
+				STATX_BASIC_STATS, &st ) == -1 )
+			continue;
+		else
+			ret = send_filestat( &st, next->d_name, ls_opts,
+					&dates, out );
+		if( ret != FTP_SUCCESS )
+			break;
+
+		listing_add( session, next->d_name, next->d_type );
+	}
+
+	vfs_closelist( drv );
+
+	list_cache_store( &ticket, out, ret );
 
+	return ret;
+}
+
+
+
+static bool sorted_listing( const list_options_t *ls_opts )
+{
+	return ls_opts->opt_t || ls_opts->opt_S || ls_opts->opt_r;
+}
+
+/* One directory of LIST with -t, -S, -r, -R or a pattern, SHOWN being its
+ * name as the client sees it. A sorted directory is held until it is
+ * complete, but -R goes out one directory at a time and only keeps the
+ * names of the subdirectories it has yet to go into */
+static int list_tree( ftp_session_t *session, const char *dir,
+		const char *shown, list_options_t *ls_opts,
+		list_dates_t *dates, outbuf_t *out, int depth )
+{
+	list_records_t recs = {0};
+	vfs_dir_t *drv;
+	struct dirent *next;
+	struct stat st;
+	char statbuf[STAT_BUFFER_SIZE];
+	char subdir[FTP_MAX_PATH], subshown[FTP_MAX_PATH];
+	const list_record_t *rec;
+	const char *line, *name;
+	bool sorted = sorted_listing( ls_opts ), matches, descend;
+	int64_t key;
+	size_t len, i;
+	int ret = FTP_SUCCESS;
+
+	if( (drv = vfs_openlist( dir, "." )) == NULL )
+		return depth == 0 ? FTP_FAIL : FTP_SUCCESS;
+
+	vfs_statahead( drv, STATX_BASIC_STATS );
+
+	while( (next = vfs_readlist( drv )) != NULL )
+	{
 		if( next->d_name[0] == '.' && !ls_opts->opt_a )
 			continue;
 
-		ret = send_filestat( session->virt_path, next->d_name, 
-			session->conn.data_sock);
+		/* -R goes through directories whose names don't match */
+		matches = ls_opts->pattern == NULL ||
+			fnmatch( ls_opts->pattern, next->d_name, 0 ) == 0;
+		if( !matches && !ls_opts->opt_R )
+			continue;
 
-		/* We ignore failed stat's. */
-		if( ret != FTP_SUCCESS && ret != FTP_FAIL )
+		if( vfs_statlist( drv, dir, next->d_name, STATX_BASIC_STATS,
+					&st ) == -1 )
+			continue;
+
+		/* Like ls -R, never through a link, which could lead back up
+		 * the tree. The stat follows links when they are allowed, so
+		 * then only the type from the directory can tell */
+		descend = ls_opts->opt_R && S_ISDIR( st.st_mode ) &&
+			( next->d_type == DT_DIR ||
+			  ( next->d_type == DT_UNKNOWN && !config.allow_links ) );
+
+		line = NULL;
+		len = 0;
+		if( matches && (line = vfs_listline( drv, &len )) == NULL )
+		{
+			len = format_list_line( &st, next->d_name, dates,
+					statbuf );
+			line = statbuf;
+		}
+
+		if( sorted )
+		{
+			key = ls_opts->opt_S ? (int64_t) st.st_size :
+				ls_opts->opt_t ? (int64_t) st.st_mtime : 0;
+			ret = add_record( &recs, next->d_name, line, len, key,
+					S_ISDIR( st.st_mode ), descend );
+		}
+		else
+		{
+			if( matches )
+			{
+				ret = send_entry( ls_opts, line, len, out );
+				if( depth == 0 )
+					listing_add( session, next->d_name,
+						S_ISDIR( st.st_mode ) ?
+						DT_DIR : DT_REG );
+			}
+
+			if( ret == FTP_SUCCESS && descend )
+				ret = add_record( &recs, next->d_name, NULL, 0,
+						0, true, true );
+		}
+
+		if( ret != FTP_SUCCESS )
+			break;
+	}
+
+	vfs_closelist( drv );
+
+	if( sorted && ret == FTP_SUCCESS )
+	{
+		recs.reverse = ls_opts->opt_r;
+		qsort_r( recs.records, recs.count, sizeof *recs.records,
+				compare_records, &recs );
+
+		for( i = 0; i < recs.count && ret == FTP_SUCCESS; i++ )
+		{
+			rec = &recs.records[i];
+			if( rec->line_len == 0 )
+				continue;
+
+			ret = send_entry( ls_opts, recs.text + rec->line,
+					rec->line_len, out );
+			if( depth == 0 )
+				listing_add( session, recs.text + rec->name,
+						rec->dir ? DT_DIR : DT_REG );
+		}
+
+		if( ret == FTP_SUCCESS && ls_opts->opt_R )
+			ret = keep_subdirs( &recs );
+	}
+
+	for( i = 0; ls_opts->opt_R && i < recs.count && ret == FTP_SUCCESS;
+			i++ )
+	{
+		rec = &recs.records[i];
+		name = recs.text + rec->name;
+		if( !rec->descend || strcmp( name, "." ) == 0 ||
+				strcmp( name, ".." ) == 0 )
+			continue;
+
+		if( depth + 1 >= LIST_MAX_DEPTH )
+			break;
+
+		/* Too long to be listed, like any other path */
+		if( snprintf( subdir, sizeof subdir, "%s/%s",
+				strcmp( dir, "/" ) ? dir : "", name )
+				>= (int) sizeof subdir ||
+			snprintf( subshown, sizeof subshown, "%s/%s",
+				strcmp( shown, "/" ) ? shown : "", name )
+				>= (int) sizeof subshown )
+			continue;
+
+		ret = send_line( "\r\n", 2, out );
+		if( ret == FTP_SUCCESS )
+			ret = send_line( subshown, strlen( subshown ), out );
+		if( ret == FTP_SUCCESS )
+			ret = send_line( ":\r\n", 3, out );
+		if( ret == FTP_SUCCESS )
+			ret = list_tree( session, subdir, subshown, ls_opts,
+					dates, out, depth + 1 );
+	}
+
+	free( recs.records );
+	free( recs.text );
+
+	return ret;
+}
+
+/* Append an entry to RECS, LINE being NULL if it isn't shown */
+static int add_record( list_records_t *recs, const char *name,
+		const char *line, size_t line_len, int64_t key, bool dir,
+		bool descend )
+{
+	size_t name_len = strlen( name ) + 1;
+	list_record_t *rec;
+
+	if( recs->text_len + name_len + line_len > recs->text_size )
+	{
+		size_t size = recs->text_size ? recs->text_size : 16384;
+		char *text;
+
+		while( size < recs->text_len + name_len + line_len )
+			size *= 2;
+
+		/* The offsets are 32 bits */
+		if( size > UINT32_MAX )
+			return FTP_FAIL;
+
+		text = realloc( recs->text, size );
+		if( text == NULL )
+		{
+			FATAL_MEM( size );
+			return FTP_ERROR;
+		}
+		recs->text = text;
+		recs->text_size = size;
+	}
+
+	if( recs->count == recs->max )
+	{
+		size_t max = recs->max ? recs->max * 2 : 256;
+		list_record_t *records;
+
+		records = realloc( recs->records, max * sizeof *records );
+		if( records == NULL )
+		{
+			FATAL_MEM( max * sizeof *records );
+			return FTP_ERROR;
+		}
+		recs->records = records;
+		recs->max = max;
+	}
+
+	rec = &recs->records[recs->count++];
+	rec->key = key;
+	rec->dir = dir;
+	rec->descend = descend;
+	rec->name = recs->text_len;
+	memcpy( recs->text + recs->text_len, name, name_len );
+	recs->text_len += name_len;
+
+	rec->line = recs->text_len;
+	rec->line_len = line_len;
+	if( line_len > 0 )
+		memcpy( recs->text + recs->text_len, line, line_len );
+	recs->text_len += line_len;
+
+	return FTP_SUCCESS;
+}
+
+/* Biggest or newest first, then by name */
+static int compare_records( const void *a, const void *b, void *arg )
+{
+	const list_record_t *ra = a, *rb = b;
+	const list_records_t *recs = arg;
+	int cmp;
+
+	if( ra->key != rb->key )
+		cmp = ra->key > rb->key ? -1 : 1;
+	else
+		cmp = strcmp( recs->text + ra->name, recs->text + rb->name );
+
+	return recs->reverse ? -cmp : cmp;
+}
+
+/* Once a sorted directory is sent, only its subdirectories matter */
+static int keep_subdirs( list_records_t *recs )
+{
+	list_records_t dirs = {0};
+	size_t i;
+	int ret = FTP_SUCCESS;
+
+	for( i = 0; i < recs->count && ret == FTP_SUCCESS; i++ )
+		if( recs->records[i].descend )
+			ret = add_record( &dirs, recs->text +
+					recs->records[i].name, NULL, 0, 0,
+					true, true );
+
+	free( recs->records );
+	free( recs->text );
+	*recs = dirs;
+
+	return ret;
+}
+
+int donlst( ftp_session_t *session )
+{
+	const char *argument;
+	struct stat st;
+	list_options_t ls_opts = {0};
+	outbuf_t out;
+	int ret;
+	ftp_conn_t *conn = &session->conn;
+
+	argument = split_pattern( session,
+			parse_list_options( session->command.arg, &ls_opts ),
+			&ls_opts );
+
+	if( *argument == '\0' )
+		argument = ".";
+
+	if( vfs_stat( session->virt_path, argument, &st ) == -1 )
+	{
+		failed_vfs_reply( conn );
+		return FTP_SUCCESS;
+	}
+
+	ret = open_listing( session, &out );
+	if( ret != FTP_SUCCESS )
+		return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+
+	if( S_ISDIR( st.st_mode ) )
+		ret = nlst_directory( session, argument, &ls_opts, &out );
+	else
+		ret = send_name( argument, &out );
+
+	end_listing( session, &out, ret );
+
+	return FTP_SUCCESS;
+}
+
+static int send_name( const char *name, outbuf_t *out )
+{
+	char line[FTP_MAX_PATH + 2];
+	size_t len;
+
+	len = strlcpy( line, name, FTP_MAX_PATH );
+	if( len >= FTP_MAX_PATH )
+		return FTP_SUCCESS;
+
+	line[len++] = '\r';
+	line[len++] = '\n';
+
+	if( outbuf_write( out, line, len ) == -1 )
+	{
+		if( errno == EPIPE || errno == ECONNRESET )
+			return FTP_ABOR;
+
+		log_warn("Error sending listing: %m\n");
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Only the names, straight from the directory without a single stat */
+static int nlst_directory( ftp_session_t *session, const char *dirname,
+		list_options_t *ls_opts, outbuf_t *out )
+{
+	vfs_dir_t *drv;
+	char dir[FTP_MAX_PATH];
+	struct dirent *next;
+	int ret = FTP_SUCCESS;
+
+	if( vfs_virtual( session->virt_path, dirname, dir, sizeof dir ) == -1 )
+		return FTP_FAIL;
+
+	listing_reset( session, dir );
+
+	if( (drv = vfs_openlist( dir, "." )) == NULL )
+		return FTP_FAIL;
+
+	while( (next = vfs_readlist( drv )) != NULL )
+	{
+		if( next->d_name[0] == '.' && !ls_opts->opt_a )
+			continue;
+
+		if( ls_opts->pattern != NULL &&
+				fnmatch( ls_opts->pattern, next->d_name, 0 ) )
+			continue;
+
+		ret = send_name( next->d_name, out );
+		if( ret != FTP_SUCCESS )
 			break;
+
+		listing_add( session, next->d_name, next->d_type );
+	}
+
+	vfs_closelist( drv );
+
+	return ret;
+}
+
+static char *put_str( char *p, const char *str )
+{
+	while( *str )
+		*p++ = *str++;
+
+	return p;
+}
+
+static char *put_num( char *p, unsigned long long num, unsigned int base,
+		int width )
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[24];
+	int i = 0;
+
+	do
+	{
+		tmp[i++] = digits[num % base];
+		num /= base;
+	} while( num > 0 || i < width );
+
+	while( i > 0 )
+		*p++ = tmp[--i];
+
+	return p;
+}
+
+/* The facts of ST the session asked for, as "fact=value;" pairs, written
+ * to BUF which has room for MLST_FACTS_SIZE. TYPE is set for the entries
+ * of MLSD that are the directory itself or its parent. Returns the end.
+ * This runs for every entry of MLSD, so it doesn't go through printf */
+static char *format_facts( const ftp_session_t *session,
+		const struct stat *st, const char *type, char *buf )
+{
+	unsigned int facts = session->mlst_facts;
+	struct tm tm;
+	char *p = buf;
+
+	if( type == NULL )
+	{
+		if( S_ISREG( st->st_mode ) )
+			type = "file";
+		else if( S_ISDIR( st->st_mode ) )
+			type = "dir";
+		else if( S_ISLNK( st->st_mode ) )
+			type = "OS.unix=slink";
+		else
+			type = "OS.unix=special";
 	}
 
-	vfs_closedir( drv );
+	if( facts & MLST_TYPE )
+	{
+		p = put_str( p, "type=" );
+		p = put_str( p, type );
+		*p++ = ';';
+	}
 
-	strlcpy( session->virt_path, temp_path_buffer, FTP_MAX_PATH );
+	if( ( facts & MLST_SIZE ) && !S_ISDIR( st->st_mode ) )
+	{
+		p = put_str( p, "size=" );
+		p = put_num( p, st->st_size, 10, 1 );
+		*p++ = ';';
+	}
+
+	if( facts & MLST_MODIFY )
+	{
+		convert_time( &st->st_mtime, &tm );
+		p = put_str( p, "modify=" );
+		p = put_num( p, tm.tm_year + 1900, 10, 4 );
+		p = put_num( p, tm.tm_mon + 1, 10, 2 );
+		p = put_num( p, tm.tm_mday, 10, 2 );
+		p = put_num( p, tm.tm_hour, 10, 2 );
+		p = put_num( p, tm.tm_min, 10, 2 );
+		p = put_num( p, tm.tm_sec, 10, 2 );
+		*p++ = ';';
+	}
+
+	/* What the server can do with it, going by the owner's bits */
+	if( facts & MLST_PERM )
+	{
+		bool writable = vfs_writable() && ( st->st_mode & S_IWUSR );
+
+		p = put_str( p, "perm=" );
+		if( S_ISDIR( st->st_mode ) )
+		{
+			if( st->st_mode & S_IXUSR )
+				*p++ = 'e';
+			if( st->st_mode & S_IRUSR )
+				*p++ = 'l';
+			if( writable )
+				p = put_str( p, "cmp" );
+		}
+		else
+		{
+			if( st->st_mode & S_IRUSR )
+				*p++ = 'r';
+			if( writable )
+				*p++ = 'w';
+		}
+		if( vfs_writable() )
+			*p++ = 'd';
+		*p++ = ';';
+	}
+
+	if( facts & MLST_UNIQUE )
+	{
+		p = put_str( p, "unique=" );
+		p = put_num( p, st->st_dev, 16, 1 );
+		*p++ = 'g';
+		p = put_num( p, st->st_ino, 16, 1 );
+		*p++ = ';';
+	}
+
+	if( facts & MLST_UNIX_MODE )
+	{
+		p = put_str( p, "UNIX.mode=" );
+		p = put_num( p, st->st_mode & 07777, 8, 4 );
+		*p++ = ';';
+	}
+
+	if( facts & MLST_UNIX_UID )
+	{
+		p = put_str( p, "UNIX.uid=" );
+		p = put_num( p, st->st_uid, 10, 1 );
+		*p++ = ';';
+	}
+
+	if( facts & MLST_UNIX_GID )
+	{
+		p = put_str( p, "UNIX.gid=" );
+		p = put_num( p, st->st_gid, 10, 1 );
+		*p++ = ';';
+	}
+
+	*p = '\0';
+
+	return p;
+}
+
+/* Like list_directory(), with one line of facts per entry. Only the
+ * fields for the facts the client wants are asked for */
+static int mlsd_directory( ftp_session_t *session, const char *dirname,
+		outbuf_t *out )
+{
+	vfs_dir_t *drv;
+	char dir[FTP_MAX_PATH];
+	char line[MLST_FACTS_SIZE + FTP_MAX_NAME + 3];
+	struct stat st;
+	struct dirent *next;
+	list_ticket_t ticket;
+	unsigned int mask = 0, i;
+	int ret = FTP_SUCCESS;
+	char *end;
+
+	for( i = 0; i < NUM_MLST_FACTS; i++ )
+		if( session->mlst_facts & mlst_facts[i].fact )
+			mask |= mlst_facts[i].mask;
+
+	if( vfs_virtual( session->virt_path, dirname, dir, sizeof dir ) == -1 )
+		return FTP_FAIL;
+
+	listing_reset( session, dir );
+
+	if( list_cache_lookup( session, dir, LIST_KEY_MLSD | session->mlst_facts,
+			out, &ticket ) )
+		return list_cache_send( session, out, &ticket );
+
+	if( (drv = vfs_openlist( dir, "." )) == NULL )
+	{
+		list_cache_store( &ticket, out, FTP_FAIL );
+		return FTP_FAIL;
+	}
+
+	vfs_statahead( drv, mask );
+
+	while( (next = vfs_readlist( drv )) != NULL )
+	{
+		const char *type = NULL;
+
+		if( strcmp( next->d_name, "." ) == 0 )
+			type = "cdir";
+		else if( strcmp( next->d_name, ".." ) == 0 )
+			type = "pdir";
+
+		if( vfs_statlist( drv, dir, next->d_name, mask, &st ) == -1 )
+			continue;
+
+		end = format_facts( session, &st, type, line );
+		*end++ = ' ';
+		end += strlcpy( end, next->d_name, FTP_MAX_NAME );
+		*end++ = '\r';
+		*end++ = '\n';
+
+		if( outbuf_write( out, line, end - line ) == -1 )
+		{
+			if( errno == EPIPE || errno == ECONNRESET )
+				ret = FTP_ABOR;
+			else
+			{
+				log_warn("Error sending listing: %m\n");
+				ret = FTP_ERROR;
+			}
+			break;
+		}
+
+		if( type == NULL )
+			listing_add( session, next->d_name, next->d_type );
+	}
+
+	vfs_closelist( drv );
+
+	list_cache_store( &ticket, out, ret );
+
+	return ret;
+}
+
+int domlsd( ftp_session_t *session )
+{
+	const char *argument = trim_whitespace( session->command.arg );
+	struct stat st;
+	outbuf_t out;
+	int ret;
+	ftp_conn_t *conn = &session->conn;
+
+	if( *argument == '\0' )
+		argument = ".";
+
+	if( vfs_stat( session->virt_path, argument, &st ) == -1 )
+	{
+		failed_vfs_reply( conn );
+		return FTP_SUCCESS;
+	}
+
+	if( !S_ISDIR( st.st_mode ) )
+	{
+		reply( conn, "501 Not a directory\r\n");
+		return FTP_SUCCESS;
+	}
+
+	ret = open_listing( session, &out );
+	if( ret != FTP_SUCCESS )
+		return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+
+	ret = mlsd_directory( session, argument, &out );
+
+	end_listing( session, &out, ret );
 
 	return FTP_SUCCESS;
 }
 
+/* The facts of a single file, on the control connection */
+int domlst( ftp_session_t *session )
+{
+	const char *argument = trim_whitespace( session->command.arg );
+	char path[FTP_MAX_PATH];
+	char facts[MLST_FACTS_SIZE];
+	struct stat st;
+	ftp_conn_t *conn = &session->conn;
+
+	if( *argument == '\0' )
+		argument = ".";
 
+	if( vfs_stat( session->virt_path, argument, &st ) == -1 ||
+	    vfs_virtual( session->virt_path, argument, path,
+			sizeof path ) == -1 )
+	{
+		failed_vfs_reply( conn );
+		return FTP_SUCCESS;
+	}
+
+	format_facts( session, &st, NULL, facts );
+
+	reply_format( conn, "250-Listing %s\r\n", path );
+	reply_format( conn, " %s %s\r\n", facts, path );
+	reply( conn, "250 End\r\n");
+
+	return FTP_SUCCESS;
+}
+
+/* OPTS MLST type;size; picks the facts, an empty list turns them all off.
+ * Unknown facts are left out of the answer */
+int mlst_options( ftp_session_t *session, char *arg )
+{
+	char answer[128] = "200 MLST OPTS";
+	char *fact, *save = NULL;
+	unsigned int facts = 0, i;
+	size_t pos = strlen( answer );
+
+	arg = trim_whitespace( arg );
+
+	for( fact = strtok_r( arg, ";", &save ); fact != NULL;
+	     fact = strtok_r( NULL, ";", &save ) )
+	{
+		for( i = 0; i < NUM_MLST_FACTS; i++ )
+			if( strcasecmp( fact, mlst_facts[i].name ) == 0 )
+				break;
+
+		if( i == NUM_MLST_FACTS || ( facts & mlst_facts[i].fact ) )
+			continue;
+
+		pos += snprintf( answer + pos, sizeof answer - pos, "%s%s;",
+				facts == 0 ? " " : "", mlst_facts[i].name );
+		facts |= mlst_facts[i].fact;
+	}
+
+	session->mlst_facts = facts;
+	reply_format( &session->conn, "%s\r\n", answer );
+
+	return FTP_SUCCESS;
+}
+
+/* The FEAT line, with the facts in use marked */
+void mlst_feature( ftp_session_t *session )
+{
+	char line[128] = " MLST ";
+	size_t pos = strlen( line );
+	unsigned int i;
+
+	for( i = 0; i < NUM_MLST_FACTS; i++ )
+		pos += snprintf( line + pos, sizeof line - pos, "%s%s;",
+				mlst_facts[i].name,
+				( session->mlst_facts & mlst_facts[i].fact ) ?
+					"*" : "" );
+
+	reply_format( &session->conn, "%s\r\n", line );
+}
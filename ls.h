@@ -1,6 +1,55 @@
 #ifndef __LIST_H__
 #define __LIST_H__ 1
 
+/* Facts for MLSD and MLST, from RFC 3659 */
+enum mlst_fact
+{
+	MLST_TYPE	= 1 << 0,
+	MLST_SIZE	= 1 << 1,
+	MLST_MODIFY	= 1 << 2,
+	MLST_PERM	= 1 << 3,
+	MLST_UNIQUE	= 1 << 4,
+	MLST_UNIX_MODE	= 1 << 5,
+	MLST_UNIX_UID	= 1 << 6,
+	MLST_UNIX_GID	= 1 << 7,
+};
+
+/* What clients get until they say otherwise with OPTS MLST */
+#define MLST_DEFAULT_FACTS	( MLST_TYPE | MLST_SIZE | MLST_MODIFY | \
+				  MLST_PERM | MLST_UNIQUE )
+
+/* Enough for all facts at once */
+#define MLST_FACTS_SIZE		256
+
+/* How deep LIST -R goes */
+#define LIST_MAX_DEPTH		32
+
+/* Older files show their year instead of the time, like ls does */
+#define LIST_RECENT		( 182 * 86400 )
+#define LIST_FUTURE		3600	/* Clocks that are a little ahead */
+
+/* The dates of one listing. Most files of a directory have a few days in
+ * common, and often the same minute, so those get formatted once */
+typedef struct list_dates
+{
+	time_t now;			/* When the listing began */
+	long long day;			/* Since 1970, formatted in mon_day */
+	char mon_day[8];		/* "Jan 1" */
+	int year;
+	long long minute;		/* Since 1970, formatted in date */
+	bool recent;
+	char date[24];			/* "Jan 1 00:00" or "Jan 1 1970" */
+} list_dates_t;
+
 extern int dolist (ftp_session_t *session);
+extern void init_list_dates( list_dates_t *dates );
+extern int format_list_line( const struct stat *st, const char *name,
+		list_dates_t *dates, char *buf );
+extern int donlst( ftp_session_t *session );
+extern int domlsd( ftp_session_t *session );
+extern int domlst( ftp_session_t *session );
+extern int stat_listing( ftp_session_t *session, char *arg );
+extern int mlst_options( ftp_session_t *session, char *arg );
+extern void mlst_feature( ftp_session_t *session );
 
 #endif
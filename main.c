@@ -7,6 +7,9 @@
 static int parse_args( int , char **);
 static int usage(void);
 
+/* Build this index with -i instead of running the server */
+static const char *index_path = NULL;
+
 int main( int argc, char **argv )
 {
 	int server_socket, ret, pipefds[2];
@@ -16,6 +19,16 @@ int main( int argc, char **argv )
 
 	if( parse_args( argc, argv ) )
 		return 1;
+
+	if( index_path != NULL )
+	{
+		if( optind != argc - 1 )
+		{
+			usage();
+			return 1;
+		}
+		return build_index( argv[optind], index_path ) != FTP_SUCCESS;
+	}
 	
 	if( load_config() )
 		return 1;
@@ -32,6 +45,27 @@ int main( int argc, char **argv )
 	if( init_core_commands() )
 		return 1;
 
+	if( init_popular_table() )
+		return 1;
+
+	if( load_popular_table() == FTP_SUCCESS )
+		start_page_warmup();
+
+	if( init_hot_cache() )
+		return 1;
+
+	if( init_writeback() )
+		return 1;
+
+	if( load_replica_rules() )
+		return 1;
+
+	if( init_tiers() )
+		return 1;
+
+	if( init_list_cache() )
+		return 1;
+
 	if( init_masterserver(&server_socket, pipefds) )
 		return 1;
 	
@@ -40,6 +74,12 @@ int main( int argc, char **argv )
 
 	close( server_socket );
 	
+	destroy_list_cache();
+	destroy_tiers();
+	destroy_replica_rules();
+	destroy_writeback();
+	destroy_hot_cache();
+	destroy_popular_table();
 	destroy_command_pool();
 	unload_config();
 
@@ -52,7 +92,7 @@ static int parse_args( int argc, char **argv )
 {
 	int c;
 	
-	while( (c = getopt( argc, argv, ":c:dn")) != -1)
+	while( (c = getopt( argc, argv, ":c:di:n")) != -1)
 	{
 		switch(c)
 		{
@@ -63,6 +103,9 @@ static int parse_args( int argc, char **argv )
 			config.debug = true;
 			log_dbg("Logging debug information\n");
 			break;
+		case 'i':
+			index_path = optarg;
+			break;
 		case 'n':
 			/*config.nodaemon = true; */
 			break;
@@ -87,8 +130,10 @@ static int parse_args( int argc, char **argv )
 static int usage()
 {
 	printf("Usage: %s [-dn] [-c path]\n", PROGNAME);
+	printf("       %s -i INDEX TREE\n", PROGNAME);
 	printf("   -d\t\tShow debug info\n");
 	printf("   -c CONFIG\tUse the configuration file CONFIG\n");
+	printf("   -i INDEX\tIndex the directory TREE into the file INDEX\n");
 	printf("   -n\t\tDon't become a daemon\n");
 	
 	return 0;
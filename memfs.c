@@ -0,0 +1,567 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+/* Files are memfds, private to the session. Nothing touches a disk, so
+ * benchmarks measure the server and the network, not the storage */
+
+static int memfs_init( const char *root );
+static void memfs_destroy(void);
+static int memfs_stat( const char *vpath, struct stat *st );
+static int memfs_creat( const char *vpath, mode_t mode );
+static int memfs_open( const char *vpath, int flags );
+static int memfs_mkdir( const char *vpath, mode_t mode );
+static int memfs_rmdir( const char *vpath );
+static vfs_dir_t *memfs_openlist( const char *vpath );
+static struct dirent *memfs_readlist( vfs_dir_t *list );
+static int memfs_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st );
+static int memfs_closelist( vfs_dir_t *list );
+static int memfs_unlink( const char *vpath );
+static int memfs_mkstemp( char *vpath );
+static int memfs_rename( const char *from, const char *to );
+
+static memfs_node_t *find_node( const char *path );
+static memfs_node_t *find_parent( const char *path );
+static memfs_node_t *new_node( memfs_node_t *parent, const char *path,
+		mode_t mode, int fd );
+static void unlink_node( memfs_node_t *node );
+static void link_node( memfs_node_t *parent, memfs_node_t *node );
+static void drop_node( memfs_node_t *node );
+static int create_file( const char *path, mode_t mode );
+static int reopen_file( memfs_node_t *node );
+static int node_stat( const memfs_node_t *node, struct stat *st );
+
+const vfs_ops_t memfs_ops = {
+	.name		= "memory",
+	.init		= memfs_init,
+	.destroy	= memfs_destroy,
+	.stat		= memfs_stat,
+	.creat		= memfs_creat,
+	.open		= memfs_open,
+	.mkdir		= memfs_mkdir,
+	.rmdir		= memfs_rmdir,
+	.openlist	= memfs_openlist,
+	.readlist	= memfs_readlist,
+	.statlist	= memfs_statlist,
+	.closelist	= memfs_closelist,
+	.unlink		= memfs_unlink,
+	.mkstemp	= memfs_mkstemp,
+	.rename		= memfs_rename,
+};
+
+static memfs_node_t **memfs_table = NULL;
+
+static memfs_node_t *find_node( const char *path )
+{
+	memfs_node_t *node;
+
+	for( node = memfs_table[hash_string( path ) % MEMFS_BUCKETS]; node;
+			node = node->next )
+		if( strcmp( node->path, path ) == 0 )
+			return node;
+
+	errno = ENOENT;
+
+	return NULL;
+}
+
+/* The directory PATH would be in */
+static memfs_node_t *find_parent( const char *path )
+{
+	char dir[FTP_MAX_PATH];
+	memfs_node_t *node;
+	char *sep;
+
+	strlcpy( dir, path, sizeof dir );
+	sep = strrchr( dir, '/' );
+	if( sep == NULL )
+	{
+		errno = ENOENT;
+		return NULL;
+	}
+	sep[ sep == dir ? 1 : 0 ] = '\0';
+
+	node = find_node( dir );
+	if( node != NULL && !S_ISDIR( node->mode ) )
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	return node;
+}
+
+static void link_node( memfs_node_t *parent, memfs_node_t *node )
+{
+	unsigned int bucket = hash_string( node->path ) % MEMFS_BUCKETS;
+
+	node->next = memfs_table[bucket];
+	memfs_table[bucket] = node;
+
+	node->parent = parent;
+	node->sibling = NULL;
+	node->prev = NULL;
+	if( parent == NULL )
+		return;
+
+	node->prev = parent->last;
+	if( parent->last )
+		parent->last->sibling = node;
+	else
+		parent->first = node;
+	parent->last = node;
+
+	clock_gettime( CLOCK_REALTIME, &parent->mtime );
+}
+
+static void unlink_node( memfs_node_t *node )
+{
+	memfs_node_t **p;
+
+	for( p = &memfs_table[hash_string( node->path ) % MEMFS_BUCKETS]; *p;
+			p = &(*p)->next )
+	{
+		if( *p == node )
+		{
+			*p = node->next;
+			break;
+		}
+	}
+
+	if( node->parent == NULL )
+		return;
+
+	if( node->prev )
+		node->prev->sibling = node->sibling;
+	else
+		node->parent->first = node->sibling;
+
+	if( node->sibling )
+		node->sibling->prev = node->prev;
+	else
+		node->parent->last = node->prev;
+
+	clock_gettime( CLOCK_REALTIME, &node->parent->mtime );
+}
+
+static memfs_node_t *new_node( memfs_node_t *parent, const char *path,
+		mode_t mode, int fd )
+{
+	memfs_node_t *node;
+
+	node = calloc( 1, sizeof *node );
+	if( node == NULL )
+	{
+		FATAL_MEM( sizeof *node );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	node->path = strdup( path );
+	if( node->path == NULL )
+	{
+		FATAL_MEM( strlen( path ) + 1 );
+		free( node );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	node->mode = mode;
+	node->fd = fd;
+	clock_gettime( CLOCK_REALTIME, &node->mtime );
+	link_node( parent, node );
+
+	return node;
+}
+
+static void drop_node( memfs_node_t *node )
+{
+	unlink_node( node );
+
+	if( node->fd != -1 )
+		close( node->fd );
+	free( node->path );
+	free( node );
+}
+
+/* A descriptor of its own for every open, the node keeps the memfd */
+static int reopen_file( memfs_node_t *node )
+{
+	int fd;
+
+	fd = dup( node->fd );
+	if( fd != -1 )
+		lseek( fd, 0, SEEK_SET );
+
+	return fd;
+}
+
+static int create_file( const char *path, mode_t mode )
+{
+	memfs_node_t *parent, *node;
+	int fd;
+
+	parent = find_parent( path );
+	if( parent == NULL )
+		return -1;
+
+	fd = memfd_create( strrchr( path, '/' ) + 1, 0 );
+	if( fd == -1 )
+		return -1;
+
+	node = new_node( parent, path, S_IFREG | ( mode & ~S_IFMT ), fd );
+	if( node == NULL )
+	{
+		close( fd );
+		return -1;
+	}
+
+	return reopen_file( node );
+}
+
+/* ROOT is ignored, every session starts out with an empty root */
+static int memfs_init( const char *root )
+{
+	(void) root;
+
+	memfs_table = calloc( MEMFS_BUCKETS, sizeof *memfs_table );
+	if( memfs_table == NULL )
+	{
+		FATAL_MEM( MEMFS_BUCKETS * sizeof *memfs_table );
+		return FTP_ERROR;
+	}
+
+	if( new_node( NULL, "/", S_IFDIR | 0777, -1 ) == NULL )
+	{
+		free( memfs_table );
+		memfs_table = NULL;
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+static void memfs_destroy(void)
+{
+	unsigned int i;
+
+	if( memfs_table == NULL )
+		return;
+
+	for( i = 0; i < MEMFS_BUCKETS; i++ )
+	{
+		while( memfs_table[i] )
+		{
+			memfs_node_t *node = memfs_table[i];
+
+			memfs_table[i] = node->next;
+			if( node->fd != -1 )
+				close( node->fd );
+			free( node->path );
+			free( node );
+		}
+	}
+
+	free( memfs_table );
+	memfs_table = NULL;
+}
+
+static int memfs_stat( const char *vpath, struct stat *st )
+{
+	memfs_node_t *node;
+
+	node = find_node( vpath );
+	if( node == NULL )
+		return -1;
+
+	return node_stat( node, st );
+}
+
+static int node_stat( const memfs_node_t *node, struct stat *st )
+{
+	if( node->fd != -1 )
+	{
+		if( fstat( node->fd, st ) == -1 )
+			return -1;
+		st->st_mode = node->mode;
+		st->st_nlink = 1;
+		return 0;
+	}
+
+	memset( st, 0, sizeof *st );
+	st->st_ino = (ino_t) (uintptr_t) node;
+	st->st_mode = node->mode;
+	st->st_nlink = 2;
+	st->st_uid = getuid();
+	st->st_gid = getgid();
+	st->st_blksize = 4096;
+	st->st_mtim = st->st_ctim = st->st_atim = node->mtime;
+
+	return 0;
+}
+
+static int memfs_creat( const char *vpath, mode_t mode )
+{
+	memfs_node_t *node;
+
+	node = find_node( vpath );
+	if( node == NULL )
+		return create_file( vpath, mode );
+
+	if( S_ISDIR( node->mode ) )
+	{
+		errno = EISDIR;
+		return -1;
+	}
+
+	if( ftruncate( node->fd, 0 ) == -1 )
+		return -1;
+
+	return reopen_file( node );
+}
+
+static int memfs_open( const char *vpath, int flags )
+{
+	memfs_node_t *node;
+
+	node = find_node( vpath );
+	if( node == NULL )
+	{
+		if( !( flags & O_CREAT ) )
+			return -1;
+		return create_file( vpath, 0777 );
+	}
+
+	if( S_ISDIR( node->mode ) )
+	{
+		errno = EISDIR;
+		return -1;
+	}
+
+	if( ( flags & O_TRUNC ) && ftruncate( node->fd, 0 ) == -1 )
+		return -1;
+
+	return reopen_file( node );
+}
+
+static int memfs_mkdir( const char *vpath, mode_t mode )
+{
+	memfs_node_t *parent;
+
+	if( find_node( vpath ) != NULL )
+	{
+		errno = EEXIST;
+		return -1;
+	}
+
+	parent = find_parent( vpath );
+	if( parent == NULL )
+		return -1;
+
+	if( new_node( parent, vpath, S_IFDIR | ( mode & ~S_IFMT ), -1 )
+			== NULL )
+		return -1;
+
+	return 0;
+}
+
+static int memfs_rmdir( const char *vpath )
+{
+	memfs_node_t *node;
+
+	node = find_node( vpath );
+	if( node == NULL )
+		return -1;
+
+	if( !S_ISDIR( node->mode ) )
+	{
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	if( node->parent == NULL )
+	{
+		errno = EBUSY;
+		return -1;
+	}
+
+	if( node->first != NULL )
+	{
+		errno = ENOTEMPTY;
+		return -1;
+	}
+
+	drop_node( node );
+
+	return 0;
+}
+
+static vfs_dir_t *memfs_openlist( const char *vpath )
+{
+	memfs_node_t *node;
+	vfs_dir_t *list;
+
+	node = find_node( vpath );
+	if( node == NULL )
+		return NULL;
+
+	if( !S_ISDIR( node->mode ) )
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	list = malloc( sizeof *list );
+	if( list == NULL )
+	{
+		FATAL_MEM( sizeof *list );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* DATA is the directory until the first entry is read, then the
+	 * entry read last */
+	list->num = list->cur = 0;
+	list->data = node;
+
+	return list;
+}
+
+static struct dirent *memfs_readlist( vfs_dir_t *list )
+{
+	const memfs_node_t *node = list->data;
+
+	if( node == NULL )
+		return NULL;
+
+	node = list->cur ? node->sibling : node->first;
+	list->cur = 1;
+	list->data = node;
+
+	if( node == NULL )
+		return NULL;
+
+	memset( &list->entry, 0, sizeof list->entry );
+	list->entry.d_ino = (ino_t) (uintptr_t) node;
+	list->entry.d_type = S_ISDIR( node->mode ) ? DT_DIR : DT_REG;
+	strlcpy( list->entry.d_name, strrchr( node->path, '/' ) + 1,
+			sizeof list->entry.d_name );
+
+	return &list->entry;
+}
+
+static int memfs_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st )
+{
+	(void) mask;
+
+	return node_stat( list->data, st );
+}
+
+static int memfs_closelist( vfs_dir_t *list )
+{
+	free( list );
+
+	return 0;
+}
+
+static int memfs_unlink( const char *vpath )
+{
+	memfs_node_t *node;
+
+	node = find_node( vpath );
+	if( node == NULL )
+		return -1;
+
+	if( S_ISDIR( node->mode ) )
+	{
+		errno = EISDIR;
+		return -1;
+	}
+
+	drop_node( node );
+
+	return 0;
+}
+
+static int memfs_mkstemp( char *vpath )
+{
+	static const char chars[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	char *x = vpath + strlen( vpath ) - 6;
+	int tries, i;
+
+	for( tries = 0; tries < 100; tries++ )
+	{
+		for( i = 0; i < 6; i++ )
+			x[i] = chars[random() % ( sizeof chars - 1 )];
+
+		if( find_node( vpath ) == NULL )
+			return create_file( vpath, 0600 );
+	}
+
+	errno = EEXIST;
+
+	return -1;
+}
+
+/* Only files can be renamed, the paths below a directory would all have
+ * to change */
+static int memfs_rename( const char *from, const char *to )
+{
+	memfs_node_t *node, *target, *parent;
+	char *path;
+
+	node = find_node( from );
+	if( node == NULL )
+		return -1;
+
+	if( S_ISDIR( node->mode ) )
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	parent = find_parent( to );
+	if( parent == NULL )
+		return -1;
+
+	target = find_node( to );
+	if( target == node )
+		return 0;
+
+	if( target != NULL && S_ISDIR( target->mode ) )
+	{
+		errno = EISDIR;
+		return -1;
+	}
+
+	path = strdup( to );
+	if( path == NULL )
+	{
+		FATAL_MEM( strlen( to ) + 1 );
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if( target != NULL )
+		drop_node( target );
+
+	unlink_node( node );
+	free( node->path );
+	node->path = path;
+	link_node( parent, node );
+
+	return 0;
+}
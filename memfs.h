@@ -0,0 +1,27 @@
+#ifndef __MEMFS_H__
+#define __MEMFS_H__ 1
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* A file or directory of the in-memory backend */
+typedef struct memfs_node
+{
+	struct memfs_node *next;	/* Hash chain */
+	struct memfs_node *parent;
+	struct memfs_node *first;	/* Children, in order of creation */
+	struct memfs_node *last;
+	struct memfs_node *prev;	/* Siblings */
+	struct memfs_node *sibling;
+	char *path;			/* Virtual path */
+	mode_t mode;
+	struct timespec mtime;		/* Of directories, files have their own */
+	int fd;				/* memfd of a file, -1 for directories */
+} memfs_node_t;
+
+extern const vfs_ops_t memfs_ops;
+
+#define MEMFS_BUCKETS		1024
+
+#endif
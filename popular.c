@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/ioprio.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static popular_t *find_popular( const char *path, unsigned int bucket );
+static popular_t *add_popular( const char *path, unsigned int bucket );
+static int compare_popular( const void *, const void * );
+static __noreturn void page_warmup(void);
+
+static popular_t **popular_table = NULL;
+static unsigned int num_popular = 0;
+static time_t last_save = 0;
+static pid_t warmup_pid = -1;
+
+int init_popular_table(void)
+{
+	popular_table = calloc( POPULAR_BUCKETS, sizeof(*popular_table) );
+	if( popular_table == NULL )
+	{
+		FATAL_MEM( POPULAR_BUCKETS * sizeof(*popular_table) );
+		return FTP_ERROR;
+	}
+
+	num_popular = 0;
+	last_save = time( NULL );
+
+	return FTP_SUCCESS;
+}
+
+int destroy_popular_table(void)
+{
+	unsigned int i;
+	popular_t *entry, *next;
+
+	if( popular_table == NULL )
+		return FTP_SUCCESS;
+
+	for( i = 0; i < POPULAR_BUCKETS; i++ )
+	{
+		for( entry = popular_table[i]; entry; entry = next )
+		{
+			next = entry->next;
+			free( entry->path );
+			free( entry );
+		}
+	}
+
+	free( popular_table );
+	popular_table = NULL;
+	num_popular = 0;
+
+	return FTP_SUCCESS;
+}
+
+static popular_t *find_popular( const char *path, unsigned int bucket )
+{
+	popular_t *entry;
+
+	for( entry = popular_table[bucket]; entry; entry = entry->next )
+		if( strcmp( entry->path, path ) == 0 )
+			return entry;
+
+	return NULL;
+}
+
+static popular_t *add_popular( const char *path, unsigned int bucket )
+{
+	popular_t *entry;
+
+	/* Don't let a client walking a huge tree eat all our memory */
+	if( num_popular >= POPULAR_MAX_ENTRIES )
+		return NULL;
+
+	entry = malloc( sizeof *entry );
+	if( entry == NULL )
+	{
+		FATAL_MEM( sizeof *entry );
+		return NULL;
+	}
+
+	entry->path = strdup( path );
+	if( entry->path == NULL )
+	{
+		FATAL_MEM( strlen( path ) + 1 );
+		free( entry );
+		return NULL;
+	}
+
+	entry->hits = 0;
+	entry->bytes = 0;
+	entry->next = popular_table[bucket];
+	popular_table[bucket] = entry;
+	num_popular++;
+
+	return entry;
+}
+
+/* Count one more download of PATH.
+ * Returns the updated entry, or NULL if it couldn't be accounted for */
+popular_t *popular_account( const char *path )
+{
+	popular_t *entry;
+	unsigned int bucket;
+
+	if( popular_table == NULL )
+		return NULL;
+
+	bucket = hash_string( path ) % POPULAR_BUCKETS;
+
+	entry = find_popular( path, bucket );
+	if( entry == NULL )
+		entry = add_popular( path, bucket );
+	if( entry == NULL )
+		return NULL;
+
+	entry->hits++;
+
+	return entry;
+}
+
+/* A download of PATH finished after sending BYTES bytes */
+int popular_transferred( const char *path, uint64_t bytes )
+{
+	popular_t *entry;
+
+	if( popular_table == NULL )
+		return FTP_FAIL;
+
+	entry = find_popular( path, hash_string( path ) % POPULAR_BUCKETS );
+	if( entry == NULL )
+		return FTP_FAIL;
+
+	entry->bytes += bytes;
+
+	return FTP_SUCCESS;
+}
+
+/* Read the statistics saved by a previous run. Every line holds the hits,
+ * the bytes and the path of one file */
+int load_popular_table(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linelen = 0;
+	ssize_t len;
+	int linenum = 0;
+
+	if( config.popular_file == NULL || popular_table == NULL )
+		return FTP_SUCCESS;
+
+	fp = fopen( config.popular_file, "r" );
+	if( fp == NULL )
+	{
+		if( errno == ENOENT )
+			return FTP_SUCCESS;
+		log_warn("Unable to open '%s': %m\n", config.popular_file );
+		return FTP_FAIL;
+	}
+
+	while( (len = getline( &line, &linelen, fp )) != -1 )
+	{
+		unsigned long hits;
+		unsigned long long bytes;
+		char *path;
+		unsigned int bucket;
+		popular_t *entry;
+
+		linenum++;
+
+		if( line[0] == '#' )
+			continue;
+
+		if( len > 0 && line[len-1] == '\n' )
+			line[len-1] = '\0';
+
+		hits = strtoul( line, &path, 10 );
+		bytes = strtoull( path, &path, 10 );
+		if( *path != ' ' || path[1] != '/' )
+		{
+			log_warn("%s: line %d: invalid entry\n",
+					config.popular_file, linenum );
+			continue;
+		}
+		path++;
+
+		bucket = hash_string( path ) % POPULAR_BUCKETS;
+		entry = find_popular( path, bucket );
+		if( entry == NULL )
+			entry = add_popular( path, bucket );
+		if( entry == NULL )
+			break;
+
+		entry->hits += hits;
+		entry->bytes += bytes;
+	}
+
+	free( line );
+	fclose( fp );
+
+	log_info("Loaded statistics of %u files\n", num_popular );
+
+	return FTP_SUCCESS;
+}
+
+/* Write the table to a temporary file first, so a crash never leaves us
+ * with half of it */
+int save_popular_table(void)
+{
+	FILE *fp;
+	char *tmp;
+	unsigned int i;
+	popular_t *entry;
+	int ret = FTP_SUCCESS;
+
+	if( config.popular_file == NULL || popular_table == NULL )
+		return FTP_SUCCESS;
+
+	last_save = time( NULL );
+
+	if( asprintf( &tmp, "%s.tmp", config.popular_file ) == -1 )
+	{
+		FATAL_MEM( strlen( config.popular_file ) + 5 );
+		return FTP_ERROR;
+	}
+
+	fp = fopen( tmp, "w" );
+	if( fp == NULL )
+	{
+		log_warn("Unable to save statistics to '%s': %m\n", tmp );
+		free( tmp );
+		return FTP_FAIL;
+	}
+
+	fprintf( fp, "# hits bytes path\n" );
+
+	for( i = 0; i < POPULAR_BUCKETS; i++ )
+		for( entry = popular_table[i]; entry; entry = entry->next )
+			fprintf( fp, "%lu %llu %s\n", entry->hits,
+				(unsigned long long) entry->bytes,
+				entry->path );
+
+	if( fclose( fp ) == EOF )
+	{
+		log_warn("Unable to save statistics to '%s': %m\n", tmp );
+		unlink( tmp );
+		ret = FTP_FAIL;
+	}
+	else if( rename( tmp, config.popular_file ) == -1 )
+	{
+		log_warn("Unable to rename '%s': %m\n", tmp );
+		unlink( tmp );
+		ret = FTP_FAIL;
+	}
+
+	free( tmp );
+
+	return ret;
+}
+
+/* When popular_tick() has something to do, or -1 if never */
+time_t popular_next_tick(void)
+{
+	if( config.popular_file == NULL || popular_table == NULL )
+		return -1;
+
+	return last_save + POPULAR_SAVE_INTERVAL;
+}
+
+/* Called from the main loop, saves the statistics every now and then */
+int popular_tick(void)
+{
+	if( time( NULL ) - last_save < POPULAR_SAVE_INTERVAL )
+		return FTP_SUCCESS;
+
+	return save_popular_table();
+}
+
+/* Most popular first */
+static int compare_popular( const void *arg1, const void *arg2 )
+{
+	const popular_t *p1 = *(const popular_t * const *) arg1;
+	const popular_t *p2 = *(const popular_t * const *) arg2;
+
+	if( p1->hits != p2->hits )
+		return p1->hits < p2->hits ? 1 : -1;
+	if( p1->bytes != p2->bytes )
+		return p1->bytes < p2->bytes ? 1 : -1;
+	return 0;
+}
+
+/* Fork a process that reads the most popular files into the page cache,
+ * so the first clients after a reboot don't have to wait for the disk */
+int start_page_warmup(void)
+{
+	pid_t pid;
+
+	if( config.warmup_size <= 0 || num_popular == 0 )
+		return FTP_SUCCESS;
+
+	pid = fork();
+	if( pid == -1 )
+	{
+		log_warn("Unable to start page cache warmup: %m\n");
+		return FTP_FAIL;
+	}
+
+	if( pid == 0 )
+		page_warmup();
+
+	warmup_pid = pid;
+
+	return FTP_SUCCESS;
+}
+
+/* Returns true if PID was the warmup process */
+bool page_warmup_reaped( pid_t pid )
+{
+	if( pid == -1 || pid != warmup_pid )
+		return false;
+
+	warmup_pid = -1;
+	log_dbg("Page cache warmup finished\n");
+
+	return true;
+}
+
+static void page_warmup(void)
+{
+	popular_t **sorted, *entry;
+	unsigned int i, n, files = 0;
+	off_t budget, warmed = 0;
+
+	/* Don't outlive the masterserver, and stay out of everyone's way */
+	prctl( PR_SET_PDEATHSIG, SIGTERM );
+	setpriority( PRIO_PROCESS, 0, 19 );
+	if( syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_PRIO_VALUE( IOPRIO_CLASS_IDLE, 0 ) ) == -1 )
+		log_warn("Unable to lower I/O priority: %m\n");
+
+	sorted = malloc( num_popular * sizeof(*sorted) );
+	if( sorted == NULL )
+	{
+		FATAL_MEM( num_popular * sizeof(*sorted) );
+		_exit( 1 );
+	}
+
+	for( i = n = 0; i < POPULAR_BUCKETS; i++ )
+		for( entry = popular_table[i]; entry; entry = entry->next )
+			sorted[n++] = entry;
+
+	qsort( sorted, n, sizeof(*sorted), compare_popular );
+
+	budget = (off_t) config.warmup_size * 1024;
+
+	for( i = 0; i < n && warmed < budget && !signal_flag; i++ )
+	{
+		struct stat st;
+		off_t offset, len;
+		int fd;
+
+		fd = open( sorted[i]->path, O_RDONLY | O_NONBLOCK );
+		if( fd == -1 )
+			continue;
+
+		if( fstat( fd, &st ) == -1 || !S_ISREG( st.st_mode ) )
+		{
+			close( fd );
+			continue;
+		}
+
+		len = st.st_size < budget - warmed ? st.st_size
+				: budget - warmed;
+
+		for( offset = 0; offset < len && !signal_flag;
+				offset += WARMUP_CHUNK_SIZE )
+			readahead( fd, offset, WARMUP_CHUNK_SIZE );
+
+		warmed += len;
+		files++;
+		close( fd );
+	}
+
+	log_info("Warmed up %u files (%llu kB)\n", files,
+			(unsigned long long) warmed / 1024 );
+
+	free( sorted );
+	_exit( 0 );
+}
@@ -0,0 +1,34 @@
+#ifndef __POPULAR_H__
+#define __POPULAR_H__ 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Access statistics of downloaded files, kept by the masterserver */
+typedef struct popular
+{
+	struct popular *next;		/* Hash chain */
+	unsigned long hits;		/* Number of downloads started */
+	uint64_t bytes;			/* Bytes sent */
+	char *path;			/* Real path of the file */
+} popular_t;
+
+extern int init_popular_table(void);
+extern int destroy_popular_table(void);
+extern popular_t *popular_account( const char *path );
+extern int popular_transferred( const char *path, uint64_t bytes );
+
+extern int load_popular_table(void);
+extern int save_popular_table(void);
+extern time_t popular_next_tick(void);
+extern int popular_tick(void);
+
+extern int start_page_warmup(void);
+extern bool page_warmup_reaped( pid_t pid );
+
+#define POPULAR_BUCKETS		1024
+#define POPULAR_MAX_ENTRIES	65536
+#define POPULAR_SAVE_INTERVAL	300	/* Seconds */
+#define WARMUP_CHUNK_SIZE	( 2 * 1024 * 1024 )
+
+#endif
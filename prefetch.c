@@ -0,0 +1,219 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static int find_entry( ftp_listing_t *, const char *name );
+static int prefetch_entry( ftp_listing_t *, int i );
+
+/* Start remembering a new listing of directory DIR */
+int listing_reset( ftp_session_t *session, const char *dir )
+{
+	ftp_listing_t *listing = &session->listing;
+
+	listing->count = 0;
+	listing->names_len = 0;
+	listing->last_index = -1;
+
+	if( config.prefetch_files <= 0 )
+		return FTP_SUCCESS;
+
+	free( listing->dir );
+	listing->dir = strdup( dir );
+	if( listing->dir == NULL )
+	{
+		FATAL_MEM( strlen( dir ) + 1 );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+int listing_add( ftp_session_t *session, const char *name,
+		unsigned char type )
+{
+	ftp_listing_t *listing = &session->listing;
+	size_t len;
+	ftp_listing_entry_t *entry;
+
+	if( config.prefetch_files <= 0 || listing->dir == NULL )
+		return FTP_SUCCESS;
+
+	/* Directories are never retrieved */
+	if( type == DT_DIR )
+		return FTP_SUCCESS;
+
+	len = strlen( name ) + 1;
+
+	if( listing->names_len + len > listing->names_size )
+	{
+		size_t size = listing->names_size ? listing->names_size * 2
+				: 4096;
+		char *names;
+
+		if( size > LISTING_MAX_NAMES )
+			return FTP_FAIL;
+
+		names = realloc( listing->names, size );
+		if( names == NULL )
+		{
+			FATAL_MEM( size );
+			return FTP_ERROR;
+		}
+		listing->names = names;
+		listing->names_size = size;
+	}
+
+	if( listing->count == listing->max_count )
+	{
+		int max = listing->max_count ? listing->max_count * 2 : 64;
+		ftp_listing_entry_t *entries;
+
+		entries = realloc( listing->entries, max * sizeof(*entries) );
+		if( entries == NULL )
+		{
+			FATAL_MEM( max * sizeof(*entries) );
+			return FTP_ERROR;
+		}
+		listing->entries = entries;
+		listing->max_count = max;
+	}
+
+	entry = &listing->entries[listing->count++];
+	entry->name = listing->names_len;
+	entry->type = type;
+	entry->prefetched = false;
+
+	memcpy( listing->names + listing->names_len, name, len );
+	listing->names_len += len;
+
+	return FTP_SUCCESS;
+}
+
+int destroy_listing( ftp_listing_t *listing )
+{
+	free( listing->dir );
+	free( listing->names );
+	free( listing->entries );
+	memset( listing, '\0', sizeof *listing );
+
+	return FTP_SUCCESS;
+}
+
+/* Look for NAME, starting right after the last retrieved file */
+static int find_entry( ftp_listing_t *listing, const char *name )
+{
+	int i, k;
+
+	for( k = 0; k < listing->count; k++ )
+	{
+		i = ( listing->last_index + 1 + k ) % listing->count;
+		if( strcmp( listing->names + listing->entries[i].name, name )
+				== 0 )
+			return i;
+	}
+
+	return -1;
+}
+
+static int prefetch_entry( ftp_listing_t *listing, int i )
+{
+	ftp_listing_entry_t *entry = &listing->entries[i];
+	struct stat st;
+	int fd;
+
+	entry->prefetched = true;
+
+	/* Don't hang on a fifo */
+	fd = vfs_open( listing->dir, listing->names + entry->name,
+			O_RDONLY | O_NONBLOCK );
+	if( fd == -1 )
+		return FTP_FAIL;
+
+	if( fstat( fd, &st ) == -1 || !S_ISREG( st.st_mode ) )
+	{
+		vfs_close( fd );
+		return FTP_FAIL;
+	}
+
+	/* Only starts the reads, unlike readahead() which waits for them */
+	errno = posix_fadvise( fd, vfs_offset( fd ),
+			(off_t) config.prefetch_size * 1024,
+			POSIX_FADV_WILLNEED );
+	if( errno != 0 )
+		log_dbg("posix_fadvise failed: %m\n");
+
+	vfs_close( fd );
+
+	return FTP_SUCCESS;
+}
+
+/* Called before VPATH is retrieved. If the client is walking through
+ * the last listing in order, start reading the next few files from
+ * disk while this one is being transferred. This is on the way to the
+ * transfer, so it opens at most one file each time: walking in order the
+ * window of files read ahead moves by one per file anyway */
+int prefetch_next( ftp_session_t *session, const char *vpath )
+{
+	ftp_listing_t *listing = &session->listing;
+	char path[FTP_MAX_PATH];
+	char *name;
+	size_t dirlen;
+	int i, j, issued;
+	bool sequential;
+
+	if( config.prefetch_files <= 0 || listing->count == 0 )
+		return FTP_SUCCESS;
+
+	strlcpy( path, session->virt_path, FTP_MAX_PATH );
+	if( vfs_chdir( path, vpath ) == -1 )
+		return FTP_FAIL;
+
+	name = strrchr( path, '/' );
+	dirlen = name == path ? 1 : (size_t) ( name - path );
+	name++;
+
+	if( strlen( listing->dir ) != dirlen ||
+	    memcmp( listing->dir, path, dirlen ) != 0 )
+		return FTP_SUCCESS;
+
+	i = find_entry( listing, name );
+	if( i == -1 )
+		return FTP_SUCCESS;
+
+	if( listing->entries[i].prefetched )
+		session->info.prefetch_hits++;
+
+	/* Sequential means no file of the listing was skipped */
+	sequential = i > listing->last_index;
+	for( j = listing->last_index + 1; sequential && j < i; j++ )
+		if( listing->entries[j].type == DT_REG )
+			sequential = false;
+
+	listing->last_index = i;
+
+	if( !sequential )
+		return FTP_SUCCESS;
+
+	for( j = i + 1, issued = 0; j < listing->count &&
+			issued < config.prefetch_files; j++ )
+	{
+		if( listing->entries[j].prefetched )
+		{
+			issued++;
+			continue;
+		}
+
+		if( prefetch_entry( listing, j ) == FTP_SUCCESS )
+			session->info.prefetch_issued++;
+		break;
+	}
+
+	return FTP_SUCCESS;
+}
@@ -0,0 +1,12 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__ 1
+
+extern int listing_reset( ftp_session_t *, const char *dir );
+extern int listing_add( ftp_session_t *, const char *name, unsigned char );
+extern int destroy_listing( ftp_listing_t * );
+extern int prefetch_next( ftp_session_t *, const char *vpath );
+
+/* Don't remember more than this many bytes of names */
+#define LISTING_MAX_NAMES	( 256 * 1024 )
+
+#endif
@@ -0,0 +1,483 @@
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static int parse_policy( const char *name );
+static const replica_rule_t *find_rule( const char *vpath );
+static bool secondary_allowed( const char *path );
+static void queue_repair( const char *primary, const char *secondary );
+static int repair_copy( const char *primary, const char *secondary );
+static __noreturn void replica_repair(void);
+
+static replica_rule_t rules[REPLICA_MAX_RULES];
+static int num_rules = 0;
+static time_t last_repair = 0;
+static pid_t repair_pid = -1;
+
+static int parse_policy( const char *name )
+{
+	if( strcasecmp( name, "fail" ) == 0 )
+		return REPLICA_FAIL;
+	if( strcasecmp( name, "degrade" ) == 0 )
+		return REPLICA_DEGRADE;
+	return -1;
+}
+
+/* Every line of the rules file reads
+ *   <virtual directory> <secondary directory> [fail|degrade]
+ * Without a policy, ReplicationPolicy applies */
+int load_replica_rules(void)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linelen = 0;
+	int linenum = 0, ret = FTP_SUCCESS;
+
+	last_repair = time( NULL );
+
+	if( config.replica_rules == NULL )
+		return FTP_SUCCESS;
+
+	fp = fopen( config.replica_rules, "r" );
+	if( fp == NULL )
+	{
+		log_fatal("Unable to open '%s': %m\n", config.replica_rules );
+		return FTP_ERROR;
+	}
+
+	while( getline( &line, &linelen, fp ) != -1 )
+	{
+		char *dir, *secondary, *policy;
+		replica_rule_t *rule;
+		size_t len;
+
+		linenum++;
+
+		dir = strtok( line, " \t\n" );
+		if( dir == NULL || dir[0] == '#' )
+			continue;
+		secondary = strtok( NULL, " \t\n" );
+		policy = strtok( NULL, " \t\n" );
+
+		if( dir[0] != '/' || secondary == NULL || secondary[0] != '/' )
+		{
+			log_fatal("%s: line %d: invalid rule\n",
+					config.replica_rules, linenum );
+			ret = FTP_ERROR;
+			break;
+		}
+
+		if( num_rules == REPLICA_MAX_RULES )
+		{
+			log_fatal("%s: more than %d rules\n",
+					config.replica_rules, REPLICA_MAX_RULES );
+			ret = FTP_ERROR;
+			break;
+		}
+
+		rule = &rules[num_rules];
+		rule->policy = policy ? parse_policy( policy ) :
+				config.replica_policy;
+		if( rule->policy == -1 )
+		{
+			log_fatal("%s: line %d: unknown policy '%s'\n",
+					config.replica_rules, linenum, policy );
+			ret = FTP_ERROR;
+			break;
+		}
+
+		/* No trailing slashes, "/" itself becomes "" */
+		len = strlen( secondary );
+		while( len > 0 && secondary[len-1] == '/' )
+			secondary[--len] = '\0';
+		len = strlen( dir );
+		while( len > 0 && dir[len-1] == '/' )
+			dir[--len] = '\0';
+
+		rule->dir = strdup( dir );
+		rule->secondary = strdup( secondary );
+		if( rule->dir == NULL || rule->secondary == NULL )
+		{
+			FATAL_MEM( strlen( dir ) + strlen( secondary ) + 2 );
+			free( rule->dir );
+			free( rule->secondary );
+			ret = FTP_ERROR;
+			break;
+		}
+		rule->dir_len = len;
+
+		num_rules++;
+	}
+
+	free( line );
+	fclose( fp );
+
+	if( ret == FTP_SUCCESS )
+		log_info("Loaded %d replication rules\n", num_rules );
+
+	return ret;
+}
+
+void destroy_replica_rules(void)
+{
+	while( num_rules > 0 )
+	{
+		num_rules--;
+		free( rules[num_rules].dir );
+		free( rules[num_rules].secondary );
+	}
+}
+
+/* The most specific rule for the virtual path VPATH */
+static const replica_rule_t *find_rule( const char *vpath )
+{
+	const replica_rule_t *best = NULL;
+	int i;
+
+	for( i = 0; i < num_rules; i++ )
+	{
+		const replica_rule_t *rule = &rules[i];
+
+		if( strncmp( vpath, rule->dir, rule->dir_len ) != 0 ||
+		    vpath[rule->dir_len] != '/' )
+			continue;
+
+		if( best == NULL || rule->dir_len > best->dir_len )
+			best = rule;
+	}
+
+	return best;
+}
+
+/* Copies only ever go below the secondary directory of a rule */
+static bool secondary_allowed( const char *path )
+{
+	int i;
+
+	if( strstr( path, "/../" ) || strcmp( find_basename( path ), ".." ) == 0 )
+		return false;
+
+	for( i = 0; i < num_rules; i++ )
+	{
+		size_t len = strlen( rules[i].secondary );
+
+		if( strncmp( path, rules[i].secondary, len ) == 0 &&
+		    path[len] == '/' )
+			return true;
+	}
+
+	return false;
+}
+
+/* Open the secondary copy of an upload to the virtual path VPATH, if a
+ * rule asks for one. Only fails if the rule says the upload has to */
+int replica_open( replica_t *rep, const char *vpath )
+{
+	const replica_rule_t *rule;
+
+	rep->fd = -1;
+	rep->failed = false;
+	rep->path[0] = '\0';
+
+	rule = find_rule( vpath );
+	if( rule == NULL )
+		return FTP_SUCCESS;
+
+	rep->policy = rule->policy;
+
+	if( snprintf( rep->path, sizeof rep->path, "%s%s", rule->secondary,
+			vpath + rule->dir_len ) >= (int) sizeof rep->path )
+	{
+		errno = ENAMETOOLONG;
+		rep->path[0] = '\0';
+		return replica_failed( rep );
+	}
+
+	rep->fd = open( rep->path, O_WRONLY | O_CREAT | O_TRUNC, 0777 );
+	if( rep->fd == -1 && errno == ENOENT &&
+	    make_parent_dirs( rep->path ) == 0 )
+		rep->fd = open( rep->path, O_WRONLY | O_CREAT | O_TRUNC, 0777 );
+	if( rep->fd == -1 )
+		return replica_failed( rep );
+
+	return FTP_SUCCESS;
+}
+
+/* Writing the secondary copy failed with ERRNO. Depending on the policy
+ * the upload fails, or goes on without the copy */
+int replica_failed( replica_t *rep )
+{
+	log_warn("Unable to write secondary copy '%s': %m\n", rep->path );
+
+	if( rep->fd != -1 )
+	{
+		close( rep->fd );
+		rep->fd = -1;
+	}
+
+	if( rep->policy == REPLICA_FAIL )
+		return FTP_FAIL;
+
+	rep->failed = true;
+
+	return FTP_SUCCESS;
+}
+
+/* Done with the upload, which ended with STATUS. FTP_FAIL means it was
+ * rejected, so the copy goes too. Returns the status the upload ends with,
+ * which is FTP_FAIL if the copy couldn't be synced and the policy doesn't
+ * allow a single copy. So call it before replying. An upload that went
+ * well with FAILED set needs a repair, see replica_queue() */
+int replica_close( replica_t *rep, int status )
+{
+	if( rep->fd != -1 )
+	{
+		if( status == FTP_SUCCESS && config.upload_sync != UPLOAD_SYNC_NONE
+				&& fdatasync( rep->fd ) == -1 )
+			status = replica_failed( rep );
+		else
+			close( rep->fd );
+		rep->fd = -1;
+	}
+
+	if( status == FTP_FAIL && rep->path[0] )
+		unlink( rep->path );
+
+	return status;
+}
+
+/* The masterserver got T_REPAIR for the upload to PRIMARY, at the virtual
+ * path VPATH. The copy goes where the rule for VPATH puts it, not wherever
+ * the child says */
+void replica_queue( const char *primary, const char *vpath )
+{
+	char secondary[FTP_MAX_REAL_PATH];
+	const replica_rule_t *rule;
+
+	rule = find_rule( vpath );
+	if( rule == NULL || primary[0] != '/' ||
+	    snprintf( secondary, sizeof secondary, "%s%s", rule->secondary,
+			vpath + rule->dir_len ) >= (int) sizeof secondary ||
+	    !secondary_allowed( secondary ) )
+	{
+		log_warn("Can't queue repair of '%s'\n", primary );
+		return;
+	}
+
+	queue_repair( primary, secondary );
+}
+
+/* Leave a note for the repair process. Only the masterserver and the repair
+ * process itself write the queue */
+static void queue_repair( const char *primary, const char *secondary )
+{
+	char line[2 * FTP_MAX_REAL_PATH + 2];
+	int fd, len;
+
+	if( config.replica_queue == NULL )
+	{
+		log_warn("No ReplicationQueue, '%s' stays without a copy\n",
+				primary );
+		return;
+	}
+
+	if( strpbrk( primary, "\t\n" ) || strpbrk( secondary, "\t\n" ) )
+	{
+		log_warn("Can't queue repair of '%s'\n", primary );
+		return;
+	}
+
+	len = snprintf( line, sizeof line, "%s\t%s\n", primary, secondary );
+
+	fd = open( config.replica_queue,
+			O_WRONLY | O_APPEND | O_CREAT | O_NOFOLLOW, 0600 );
+	if( fd == -1 || write( fd, line, len ) != len )
+		log_warn("Unable to queue repair of '%s': %m\n", primary );
+	else
+		log_info("Queued repair of '%s'\n", secondary );
+
+	if( fd != -1 )
+		close( fd );
+}
+
+/* Copy PRIMARY next to SECONDARY and rename it into place, so a copy is
+ * either complete or not there */
+static int repair_copy( const char *primary, const char *secondary )
+{
+	char tmp[FTP_MAX_REAL_PATH + 16];
+	struct stat st;
+	off_t offset = 0;
+	int in, out;
+
+	if( snprintf( tmp, sizeof tmp, "%s.repair-XXXXXX", secondary )
+			>= (int) sizeof tmp )
+		return -1;
+
+	in = open( primary, O_RDONLY );
+	if( in == -1 )
+		return errno == ENOENT ? 0 : -1; /* Deleted since */
+
+	if( fstat( in, &st ) == -1 )
+	{
+		close( in );
+		return -1;
+	}
+
+	/* Replaced by something else since */
+	if( !S_ISREG( st.st_mode ) )
+	{
+		close( in );
+		return 0;
+	}
+
+	out = mkstemp( tmp );
+	if( out == -1 && errno == ENOENT && make_parent_dirs( tmp ) == 0 )
+	{
+		snprintf( tmp, sizeof tmp, "%s.repair-XXXXXX", secondary );
+		out = mkstemp( tmp );
+	}
+	if( out == -1 )
+	{
+		close( in );
+		return -1;
+	}
+
+	while( offset < st.st_size )
+		if( sendfile( out, in, &offset, st.st_size - offset ) <= 0 )
+			break;
+
+	close( in );
+
+	/* We run as root, the copy is the primary's owner's */
+	if( offset < st.st_size ||
+	    fchown( out, st.st_uid, st.st_gid ) == -1 ||
+	    fchmod( out, st.st_mode & 07777 ) == -1 ||
+	    fdatasync( out ) == -1 ||
+	    close( out ) == -1 || rename( tmp, secondary ) == -1 )
+	{
+		unlink( tmp );
+		return -1;
+	}
+
+	return 0;
+}
+
+static void replica_repair(void)
+{
+	char *work, *line = NULL;
+	size_t linelen = 0;
+	unsigned int repaired = 0;
+	FILE *fp;
+
+	prctl( PR_SET_PDEATHSIG, SIGTERM );
+	setpriority( PRIO_PROCESS, 0, 19 );
+
+	if( asprintf( &work, "%s.work", config.replica_queue ) == -1 )
+		_exit( 1 );
+
+	/* Whatever a previous repair left behind goes first */
+	if( access( work, F_OK ) == -1 &&
+	    rename( config.replica_queue, work ) == -1 )
+		_exit( errno == ENOENT ? 0 : 1 );
+
+	fp = fopen( work, "r" );
+	if( fp == NULL )
+		_exit( 1 );
+
+	while( getline( &line, &linelen, fp ) != -1 && !signal_flag )
+	{
+		char *primary, *secondary;
+
+		primary = strtok( line, "\t\n" );
+		secondary = strtok( NULL, "\t\n" );
+		if( primary == NULL || secondary == NULL )
+			continue;
+
+		if( !secondary_allowed( secondary ) )
+		{
+			log_warn("No rule puts copies at '%s'\n", secondary );
+			continue;
+		}
+
+		if( repair_copy( primary, secondary ) == 0 )
+			repaired++;
+		else
+		{
+			log_warn("Unable to repair '%s': %m\n", secondary );
+			queue_repair( primary, secondary );
+		}
+	}
+
+	fclose( fp );
+	unlink( work );
+
+	log_info("Repaired %u secondary copies\n", repaired );
+
+	_exit( 0 );
+}
+
+/* When the next repair is due, or -1 while one runs */
+time_t replica_next_tick(void)
+{
+	if( num_rules == 0 || config.replica_queue == NULL ||
+	    repair_pid != -1 )
+		return -1;
+
+	return last_repair + REPLICA_REPAIR_INTERVAL;
+}
+
+/* Called from the main loop, starts a repair every now and then */
+int replica_tick(void)
+{
+	struct stat st;
+	pid_t pid;
+
+	if( num_rules == 0 || config.replica_queue == NULL ||
+	    repair_pid != -1 )
+		return FTP_SUCCESS;
+
+	if( time( NULL ) - last_repair < REPLICA_REPAIR_INTERVAL )
+		return FTP_SUCCESS;
+
+	last_repair = time( NULL );
+
+	if( stat( config.replica_queue, &st ) == -1 || st.st_size == 0 )
+		return FTP_SUCCESS;
+
+	pid = fork();
+	if( pid == -1 )
+	{
+		log_warn("Unable to start repair of secondary copies: %m\n");
+		return FTP_FAIL;
+	}
+
+	if( pid == 0 )
+		replica_repair();
+
+	repair_pid = pid;
+
+	return FTP_SUCCESS;
+}
+
+bool replica_repair_reaped( pid_t pid )
+{
+	if( pid == -1 || pid != repair_pid )
+		return false;
+
+	repair_pid = -1;
+
+	return true;
+}
@@ -0,0 +1,47 @@
+#ifndef __REPLICA_H__
+#define __REPLICA_H__ 1
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+enum replica_policy
+{
+	REPLICA_FAIL,			/* Reject the upload */
+	REPLICA_DEGRADE			/* Keep the upload, repair it later */
+};
+
+/* Uploads below DIR are also stored below SECONDARY */
+typedef struct replica_rule
+{
+	char *dir;			/* Virtual directory */
+	size_t dir_len;
+	char *secondary;		/* Real directory for the copies */
+	int policy;
+} replica_rule_t;
+
+/* The secondary copy of one upload */
+typedef struct replica
+{
+	int fd;				/* -1 if there is no copy */
+	int policy;
+	bool failed;			/* Degraded, needs a repair */
+	char path[FTP_MAX_REAL_PATH];
+} replica_t;
+
+extern int load_replica_rules(void);
+extern void destroy_replica_rules(void);
+
+extern int replica_open( replica_t *, const char *vpath );
+extern int replica_failed( replica_t * );
+extern int replica_close( replica_t *, int status );
+extern void replica_queue( const char *primary, const char *vpath );
+
+extern time_t replica_next_tick(void);
+extern int replica_tick(void);
+extern bool replica_repair_reaped( pid_t pid );
+
+#define REPLICA_MAX_RULES	64
+#define REPLICA_REPAIR_INTERVAL	60	/* Seconds */
+#define REPLICA_PIPE_SIZE	( 1024 * 1024 )
+
+#endif
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>  /* for inet_ntoa, etc.. */
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "ftp.h"
 
@@ -140,6 +141,12 @@ static ftp_session_t *new_session(int sock, int write_pipe)
 		return NULL;
 	}
 	conn.host_addr = sa.sin_addr;
+
+	/* Every reply is written in one go. Without this, the final reply
+	 * of a transfer waits for the client to acknowledge the first one */
+	if( setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+			sizeof(int) ) == -1 )
+		log_warn("Unable to disable Nagle on control connection: %m\n");
 	
 	session->conn = conn;
 
@@ -182,6 +189,31 @@ static ftp_session_t *new_session(int sock, int write_pipe)
 		return NULL;
 	}
 	memset( session->filename, '\0', FTP_MAX_NAME );
+
+	session->filepath = malloc( FTP_MAX_REAL_PATH );
+	if( session->filepath == NULL )
+	{
+		FATAL_MEM( FTP_MAX_REAL_PATH );
+		free( command.line );
+		free( session->virt_path );
+		free( session->filename );
+		free( session );
+		return NULL;
+	}
+	session->filepath[0] = '\0';
+
+	session->virt_filepath = malloc( FTP_MAX_PATH );
+	if( session->virt_filepath == NULL )
+	{
+		FATAL_MEM( FTP_MAX_PATH );
+		free( command.line );
+		free( session->virt_path );
+		free( session->filename );
+		free( session->filepath );
+		free( session );
+		return NULL;
+	}
+	session->virt_filepath[0] = '\0';
 	
 	
 	/* Session attributes */
@@ -195,10 +227,16 @@ static ftp_session_t *new_session(int sock, int write_pipe)
 	info.xfer_len = 0;
 	info.xfer_start = (struct timeval){0,0};
 	info.xfer_status = FTP_SUCCESS;
+	info.upload = false;
 	
 	session->info = info;
 
+	memset( &session->listing, '\0', sizeof session->listing );
+	session->listing.last_index = -1;
+
 	session->restart_pos = 0;
+	session->mode = XFER_MODE_STREAM;
+	session->mlst_facts = MLST_DEFAULT_FACTS;
 	
 	return session;
 }
@@ -207,9 +245,14 @@ static void destroy_session( ftp_session_t *session )
 {
 	if(session->conn.pasv_sock != -1)
 		close(session->conn.pasv_sock);
+	if(session->conn.data_sock >= 0)
+		close(session->conn.data_sock);
 	free(session->command.line);
 	free(session->virt_path);
 	free(session->filename);
+	free(session->filepath);
+	free(session->virt_filepath);
+	destroy_listing(&session->listing);
 	free(session->login.user);
 	free(session);
 	return;
@@ -7,6 +7,7 @@
 #define COMMAND_BUFFER_SIZE	1024
 #define FTP_MAX_PATH		1024
 #define FTP_MAX_NAME		256
+#define FTP_MAX_REAL_PATH	( 2 * FTP_MAX_PATH )
 
 extern int pasv_listen( int, char[] );
 extern int ftp_main(int, int);
@@ -37,7 +38,8 @@ typedef struct ftp_conn
 					 * masterserver */
 	int sock;			/* Socket of control connection */
 	int pasv_sock;			/* Socket of data connection */
-	int data_sock;
+	int data_sock;			/* Kept open between transfers
+					 * in MODE B, -1 if closed */
 	struct in_addr host_addr;	/* Our IP address */
 	struct in_addr client_addr;	/* IP address of client */
 } ftp_conn_t;
@@ -60,12 +62,43 @@ typedef struct ftp_xfer_info
 	uint64_t probe_len;
 
 	int xfer_status;
+	bool upload;
+
+	uint64_t prefetch_issued;	/* Files read ahead */
+	uint64_t prefetch_hits;		/* ... that were retrieved later */
 
 	struct timeval xfer_start;
 	struct timeval xfer_probe;
 } ftp_xfer_info_t;
 
 
+typedef struct ftp_listing_entry
+{
+	size_t name;			/* Offset in the name buffer */
+	unsigned char type;		/* d_type from readdir */
+	bool prefetched;
+} ftp_listing_entry_t;
+
+/* The last directory listing, in the order the client saw it. Mirroring
+ * clients tend to retrieve the files in that same order */
+typedef struct ftp_listing
+{
+	char *dir;			/* Virtual path of the directory */
+	char *names;			/* Nul separated names */
+	size_t names_len, names_size;
+	ftp_listing_entry_t *entries;
+	int count, max_count;
+	int last_index;			/* Last file retrieved */
+} ftp_listing_t;
+
+/* Transmission modes, as set with MODE */
+enum xfer_mode
+{
+	XFER_MODE_STREAM = 'S',
+	XFER_MODE_BLOCK = 'B',		/* Data connection stays open */
+	XFER_MODE_DEFLATE = 'Z',	/* Compressed with deflate */
+};
+
 /* Big session object. It holds all the information the server needs. */
 typedef struct 
 {
@@ -73,10 +106,16 @@ typedef struct
 	ftp_command_t	command;
 	ftp_login_t	login;
 	ftp_xfer_info_t	info;
+	ftp_listing_t	listing;
 
 	char *virt_path;
 	char *filename;
+	char *filepath;			/* Real path of the file being
+					 * transferred */
+	char *virt_filepath;		/* ... and its virtual path */
 	off_t restart_pos;
+	char mode;			/* enum xfer_mode */
+	unsigned int mlst_facts;	/* enum mlst_fact, for MLSD */
 } ftp_session_t;
 
 #endif /* __FTPSERVER_H__ */
@@ -0,0 +1,75 @@
+#include <ctype.h>
+#include <string.h>
+
+#include "ftp.h"
+
+static int dosite_help( ftp_session_t *session );
+
+static const cmd_handler_t site_command_list[] = {
+	/* NAME function needs_login, needs_data, needs_arg */
+	{ "HELP",   &dosite_help,   true,  false, false },
+	{ "LISTCACHE", &dosite_listcache, true, false, false },
+	{ "RDELTA", &dosite_rdelta, true,  true,  true  },
+	{ "RSIG",   &dosite_rsig,   true,  true,  true  },
+	{ "TAR",    &dosite_tar,    true,  true,  true  },
+	{ "TIER",   &dosite_tier,   true,  false, false },
+	{ 0 },
+	};
+
+/* SITE <command> <arguments>
+ * The argument of the SITE command is split, so the handlers of the
+ * subcommands see their own argument just like normal commands do */
+int dosite( ftp_session_t *session )
+{
+	const cmd_handler_t *cmd_def;
+	ftp_conn_t *conn = &session->conn;
+	char *name, *arg;
+
+	name = session->command.arg;
+
+	for( arg = name; *arg && !isblank( *arg ); arg++ )
+		; /* Do nothing */
+	if( *arg )
+		*arg++ = '\0';
+	while( isblank( *arg ) )
+		arg++;
+
+	for( cmd_def = site_command_list; cmd_def->name; cmd_def++ )
+		if( strcasecmp( cmd_def->name, name ) == 0 )
+			break;
+
+	if( cmd_def->name == NULL )
+	{
+		reply( conn, "500 Unknown SITE command\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	if( cmd_def->needs_data && conn->pasv_sock == -1 )
+	{
+		reply( conn, "425 Cannot open data connection\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	if( cmd_def->needs_arg && *arg == '\0' )
+	{
+		reply( conn, "501 Missing argument\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	session->command.arg = arg;
+
+	return cmd_def->handler( session );
+}
+
+static int dosite_help( ftp_session_t *session )
+{
+	const cmd_handler_t *cmd_def;
+	ftp_conn_t *conn = &session->conn;
+
+	reply( conn, "214-The following SITE commands are recognized:\r\n" );
+	for( cmd_def = site_command_list; cmd_def->name; cmd_def++ )
+		reply_format( conn, " %s\r\n", cmd_def->name );
+	reply( conn, "214 End.\r\n" );
+
+	return FTP_SUCCESS;
+}
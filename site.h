@@ -0,0 +1,6 @@
+#ifndef __SITE_H__
+#define __SITE_H__ 1
+
+extern int dosite (ftp_session_t *session);
+
+#endif
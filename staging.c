@@ -0,0 +1,429 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+static int staging_path( const char *real, char *dst, size_t len );
+static bool staging_admit(void);
+static int open_queue( const char *path, int flags );
+static int migrate_file( const char *real );
+static __noreturn void staging_migrate(void);
+
+static time_t last_migrate = 0;
+static pid_t migrate_pid = -1;
+
+/* Uploads to the real path REAL are staged at the same path below the
+ * staging directory. Every user root gets its own subtree that way */
+static int staging_path( const char *real, char *dst, size_t len )
+{
+	if( config.staging_dir == NULL || real[0] != '/' )
+		return -1;
+
+	if( snprintf( dst, len, "%s%s", config.staging_dir, real ) >= (int) len )
+	{
+		dst[0] = '\0';
+		return -1;
+	}
+
+	return 0;
+}
+
+/* There is room for another upload as long as the staged files don't use
+ * up the budget. The size of the upload isn't known in advance, so the
+ * budget is a soft limit */
+static bool staging_admit(void)
+{
+	struct statvfs sv;
+	unsigned long long used;
+
+	if( statvfs( config.staging_dir, &sv ) == -1 )
+	{
+		log_warn("Unable to check staging directory: %m\n");
+		return false;
+	}
+
+	used = (unsigned long long) ( sv.f_blocks - sv.f_bfree ) * sv.f_frsize;
+
+	return used < (unsigned long long) config.staging_size * 1024 * 1024;
+}
+
+/* Stage the upload to REAL, if there is room for it. The staged file stays
+ * locked until the upload is done, so it is never migrated halfway.
+ * Anything staged earlier is removed if this upload goes to REAL directly */
+void staging_open( staging_t *stage, const char *real )
+{
+	struct stat st;
+	int fd;
+
+	stage->fd = -1;
+
+	if( staging_path( real, stage->path, sizeof stage->path ) == -1 )
+		return;
+
+	if( !staging_admit() )
+	{
+		staging_remove( real );
+		return;
+	}
+
+	for(;;)
+	{
+		fd = open( stage->path, O_WRONLY | O_CREAT, 0777 );
+		if( fd == -1 && errno == ENOENT &&
+		    make_parent_dirs( stage->path ) == 0 )
+			fd = open( stage->path, O_WRONLY | O_CREAT, 0777 );
+		if( fd == -1 )
+		{
+			log_warn("Unable to stage '%s': %m\n", stage->path );
+			staging_remove( real );
+			return;
+		}
+
+		while( flock( fd, LOCK_EX ) == -1 && errno == EINTR )
+			; /* Do nothing */
+
+		/* The migrator moved it out of the way while we waited */
+		if( fstat( fd, &st ) == 0 && st.st_nlink > 0 )
+			break;
+
+		close( fd );
+	}
+
+	if( ftruncate( fd, 0 ) == -1 )
+	{
+		log_warn("Unable to truncate '%s': %m\n", stage->path );
+		close( fd );
+		return;
+	}
+
+	stage->fd = fd;
+}
+
+/* The upload ended with STATUS. FTP_FAIL means it was rejected, anything
+ * else leaves the data for the migrator, just like a direct upload would
+ * have left it in place. Returns true if the child has to send T_MIGRATE,
+ * which it does only now: a migrator that finds the file still locked
+ * drops it from the queue */
+bool staging_close( staging_t *stage, int status )
+{
+	if( stage->fd == -1 )
+		return false;
+
+	if( status == FTP_FAIL )
+		unlink( stage->path );
+
+	close( stage->fd );
+	stage->fd = -1;
+
+	return status != FTP_FAIL;
+}
+
+/* Remove the staged copy of REAL, waiting for a running migration of it */
+int staging_remove( const char *real )
+{
+	char path[FTP_MAX_REAL_PATH];
+	struct stat st;
+	int fd, ret = 0;
+
+	if( staging_path( real, path, sizeof path ) == -1 )
+		return 0;
+
+	fd = open( path, O_RDONLY );
+	if( fd == -1 )
+		return errno == ENOENT ? 0 : -1;
+
+	while( flock( fd, LOCK_EX ) == -1 && errno == EINTR )
+		; /* Do nothing */
+
+	if( fstat( fd, &st ) == 0 && st.st_nlink > 0 )
+		ret = unlink( path );
+
+	close( fd );
+
+	return ret;
+}
+
+/* An upload that hasn't been migrated yet leaves an empty file at its real
+ * path. Reads of such a file find the data in the staging directory */
+int staging_stat( const char *real, struct stat *st )
+{
+	char path[FTP_MAX_REAL_PATH];
+
+	if( staging_path( real, path, sizeof path ) == -1 )
+		return -1;
+
+	return stat( path, st );
+}
+
+int staging_open_read( const char *real )
+{
+	char path[FTP_MAX_REAL_PATH];
+
+	if( staging_path( real, path, sizeof path ) == -1 )
+		return -1;
+
+	return open( path, O_RDONLY );
+}
+
+/* Users can write to the staging directory, so the queue has to be ours
+ * and no link */
+static int open_queue( const char *path, int flags )
+{
+	struct stat st;
+	int fd;
+
+	fd = open( path, flags | O_NOFOLLOW, 0600 );
+	if( fd != -1 && ( fstat( fd, &st ) == -1 || st.st_uid != geteuid() ) )
+	{
+		close( fd );
+		errno = EPERM;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* The masterserver got T_MIGRATE for the upload to REAL. Only it and the
+ * migrator write the queue */
+void staging_queue( const char *real )
+{
+	char path[FTP_MAX_REAL_PATH], line[FTP_MAX_REAL_PATH + 1];
+	int fd, len;
+
+	if( config.staging_dir == NULL || real[0] != '/' ||
+	    strchr( real, '\n' ) )
+	{
+		log_warn("Can't queue migration of '%s'\n", real );
+		return;
+	}
+
+	snprintf( path, sizeof path, "%s/%s", config.staging_dir,
+			STAGING_QUEUE );
+	len = snprintf( line, sizeof line, "%s\n", real );
+
+	fd = open_queue( path, O_WRONLY | O_APPEND | O_CREAT );
+	/* Left there by somebody else */
+	if( fd == -1 && ( errno == EPERM || errno == ELOOP ) &&
+	    unlink( path ) == 0 )
+		fd = open_queue( path, O_WRONLY | O_APPEND | O_CREAT );
+	if( fd == -1 || write( fd, line, len ) != len )
+		log_warn("Unable to queue migration of '%s': %m\n", real );
+
+	if( fd != -1 )
+		close( fd );
+}
+
+/* Move the staged copy of REAL into place. Returns 1 if it was moved, 0 if
+ * there was nothing to do, and -1 if it has to be tried again */
+static int migrate_file( const char *real )
+{
+	char staged[FTP_MAX_REAL_PATH], tmp[FTP_MAX_REAL_PATH + 32];
+	const char *basename;
+	struct stat st, target;
+	struct timespec times[2];
+	int in, out;
+
+	if( staging_path( real, staged, sizeof staged ) == -1 )
+		return 0;
+
+	in = open( staged, O_RDONLY | O_NOFOLLOW );
+	if( in == -1 )
+		return errno == ENOENT || errno == ELOOP ? 0 : -1;
+
+	/* Still being uploaded, it's queued again when that's done */
+	if( flock( in, LOCK_EX | LOCK_NB ) == -1 ||
+	    fstat( in, &st ) == -1 || st.st_nlink == 0 )
+	{
+		close( in );
+		return 0;
+	}
+
+	/* Only the empty file an upload left behind is replaced. If it is
+	 * gone or has new contents, the staged copy is out of date */
+	if( lstat( real, &target ) == -1 || !S_ISREG( target.st_mode ) ||
+	    target.st_size != 0 )
+	{
+		unlink( staged );
+		close( in );
+		return 0;
+	}
+
+	/* Both were written by the same upload, anything else was put into
+	 * the staging tree by someone else */
+	if( !S_ISREG( st.st_mode ) || st.st_uid != target.st_uid )
+	{
+		log_warn("Not migrating '%s', it isn't the uploader's\n",
+				staged );
+		close( in );
+		return 0;
+	}
+
+	basename = find_basename( real );
+	snprintf( tmp, sizeof tmp, "%.*s.migrate-XXXXXX",
+			(int) ( basename - real ), real );
+
+	out = mkstemp( tmp );
+	if( out == -1 )
+	{
+		close( in );
+		return -1;
+	}
+
+	/* One contiguous allocation, and the page cache reads ahead */
+	if( st.st_size > 0 )
+		posix_fallocate( out, 0, st.st_size );
+	posix_fadvise( in, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+
+	/* We run as root, the file stays the uploader's */
+	if( copy_file_data( in, out, st.st_size,
+			STAGING_CHUNK_SIZE ) == -1 ||
+	    fchown( out, target.st_uid, target.st_gid ) == -1 ||
+	    fchmod( out, st.st_mode & 07777 ) == -1 ||
+	    futimens( out, times ) == -1 ||
+	    fdatasync( out ) == -1 || close( out ) == -1 ||
+	    rename( tmp, real ) == -1 )
+	{
+		log_warn("Unable to migrate '%s': %m\n", real );
+		unlink( tmp );
+		close( in );
+		return -1;
+	}
+
+	unlink( staged );
+	close( in );
+
+	return 1;
+}
+
+static void staging_migrate(void)
+{
+	char *queue, *work, *line = NULL;
+	size_t linelen = 0;
+	unsigned int total = 0, migrated;
+	FILE *fp;
+	int fd;
+
+	prctl( PR_SET_PDEATHSIG, SIGTERM );
+	setpriority( PRIO_PROCESS, 0, 19 );
+
+	if( asprintf( &queue, "%s/%s", config.staging_dir,
+			STAGING_QUEUE ) == -1 ||
+	    asprintf( &work, "%s.work", queue ) == -1 )
+		_exit( 1 );
+
+	/* Uploads finish while we work, keep going as long as that gets
+	 * files moved */
+	do
+	{
+		migrated = 0;
+
+		/* Whatever a previous migrator left behind goes first */
+		if( access( work, F_OK ) == -1 &&
+		    rename( queue, work ) == -1 )
+			break;
+
+		fd = open_queue( work, O_RDONLY );
+		if( fd == -1 || ( fp = fdopen( fd, "r" ) ) == NULL )
+		{
+			log_warn("Unable to read migration queue: %m\n");
+			if( fd != -1 )
+				close( fd );
+			unlink( work );
+			break;
+		}
+
+		while( getline( &line, &linelen, fp ) != -1 && !signal_flag )
+		{
+			int ret;
+
+			line[strcspn( line, "\n" )] = '\0';
+			if( line[0] == '\0' )
+				continue;
+
+			ret = migrate_file( line );
+			if( ret == 1 )
+				migrated++;
+			else if( ret == -1 )
+				staging_queue( line );
+		}
+
+		fclose( fp );
+		unlink( work );
+
+		total += migrated;
+	} while( migrated > 0 && !signal_flag );
+
+	if( total > 0 )
+		log_info("Migrated %u staged uploads\n", total );
+
+	_exit( 0 );
+}
+
+/* When the migrator should look at the queue again */
+time_t staging_next_tick(void)
+{
+	if( config.staging_dir == NULL || migrate_pid != -1 )
+		return -1;
+
+	return last_migrate + STAGING_MIGRATE_INTERVAL;
+}
+
+/* Called from the main loop, starts the migrator when there is work */
+int staging_tick(void)
+{
+	char queue[FTP_MAX_REAL_PATH];
+	struct stat st;
+	pid_t pid;
+
+	if( config.staging_dir == NULL || migrate_pid != -1 )
+		return FTP_SUCCESS;
+
+	if( time( NULL ) - last_migrate < STAGING_MIGRATE_INTERVAL )
+		return FTP_SUCCESS;
+
+	last_migrate = time( NULL );
+
+	snprintf( queue, sizeof queue, "%s/%s", config.staging_dir,
+			STAGING_QUEUE );
+	if( stat( queue, &st ) == -1 || st.st_size == 0 )
+		return FTP_SUCCESS;
+
+	pid = fork();
+	if( pid == -1 )
+	{
+		log_warn("Unable to start migration of staged uploads: %m\n");
+		return FTP_FAIL;
+	}
+
+	if( pid == 0 )
+		staging_migrate();
+
+	migrate_pid = pid;
+
+	return FTP_SUCCESS;
+}
+
+bool staging_migrate_reaped( pid_t pid )
+{
+	if( pid == -1 || pid != migrate_pid )
+		return false;
+
+	migrate_pid = -1;
+
+	return true;
+}
@@ -0,0 +1,31 @@
+#ifndef __STAGING_H__
+#define __STAGING_H__ 1
+
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* An upload written to the staging directory instead of its real path */
+typedef struct staging
+{
+	int fd;				/* -1 if the upload isn't staged */
+	char path[FTP_MAX_REAL_PATH];
+} staging_t;
+
+extern void staging_open( staging_t *, const char *real );
+extern bool staging_close( staging_t *, int status );
+extern void staging_queue( const char *real );
+extern int staging_remove( const char *real );
+
+extern int staging_stat( const char *real, struct stat *st );
+extern int staging_open_read( const char *real );
+
+extern time_t staging_next_tick(void);
+extern int staging_tick(void);
+extern bool staging_migrate_reaped( pid_t pid );
+
+#define STAGING_QUEUE		".migrate"	/* In the staging directory */
+#define STAGING_CHUNK_SIZE	( 8 * 1024 * 1024 )
+#define STAGING_MIGRATE_INTERVAL 1		/* Seconds */
+
+#endif
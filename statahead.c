@@ -0,0 +1,141 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "ftp.h"
+
+/* On network filesystems every stat is a round trip to the server. For
+ * big listings a few threads of the session keep ListThreads of them
+ * going at the same time, while the listing itself stays in order */
+
+static void *stat_worker( void *arg );
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static pthread_t pool_threads[STAT_POOL_MAX_THREADS];
+static int pool_size = 0;
+static bool pool_quit = false;
+
+static stat_job_t *queue_head = NULL, *queue_tail = NULL;
+
+/* Called by the session when it first needs the pool. Returns FTP_FAIL
+ * when there is none, listings then stat one entry after the other */
+int stat_pool_start(void)
+{
+	sigset_t all, old;
+
+	if( pool_size > 0 )
+		return FTP_SUCCESS;
+
+	if( config.list_threads <= 0 )
+		return FTP_FAIL;
+
+	/* Signals are for the main thread only */
+	sigfillset( &all );
+	pthread_sigmask( SIG_SETMASK, &all, &old );
+
+	pool_quit = false;
+	while( pool_size < config.list_threads &&
+	       pthread_create( &pool_threads[pool_size], NULL, stat_worker,
+			NULL ) == 0 )
+		pool_size++;
+
+	pthread_sigmask( SIG_SETMASK, &old, NULL );
+
+	if( pool_size == 0 )
+	{
+		log_warn("Unable to start stat threads\n");
+		return FTP_FAIL;
+	}
+
+	return FTP_SUCCESS;
+}
+
+void destroy_stat_pool(void)
+{
+	int i;
+
+	if( pool_size == 0 )
+		return;
+
+	pthread_mutex_lock( &pool_lock );
+	pool_quit = true;
+	pthread_cond_broadcast( &pool_work );
+	pthread_mutex_unlock( &pool_lock );
+
+	for( i = 0; i < pool_size; i++ )
+		pthread_join( pool_threads[i], NULL );
+
+	pool_size = 0;
+	queue_head = queue_tail = NULL;
+}
+
+static void *stat_worker( void *arg )
+{
+	stat_job_t *job;
+	int ret;
+
+	(void) arg;
+
+	pthread_mutex_lock( &pool_lock );
+
+	while( !pool_quit )
+	{
+		job = queue_head;
+		if( job == NULL )
+		{
+			pthread_cond_wait( &pool_work, &pool_lock );
+			continue;
+		}
+
+		queue_head = job->next;
+		if( queue_head == NULL )
+			queue_tail = NULL;
+
+		pthread_mutex_unlock( &pool_lock );
+
+		ret = statx( job->dirfd, job->name,
+				AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+				job->mask, &job->stx );
+
+		pthread_mutex_lock( &pool_lock );
+
+		job->err = ret == -1 ? errno : 0;
+		job->done = true;
+		pthread_cond_broadcast( &pool_done );
+	}
+
+	pthread_mutex_unlock( &pool_lock );
+
+	return NULL;
+}
+
+void stat_pool_submit( stat_job_t *job )
+{
+	pthread_mutex_lock( &pool_lock );
+
+	job->next = NULL;
+	job->done = false;
+	if( queue_tail != NULL )
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+
+	pthread_cond_signal( &pool_work );
+	pthread_mutex_unlock( &pool_lock );
+}
+
+void stat_pool_wait( stat_job_t *job )
+{
+	pthread_mutex_lock( &pool_lock );
+
+	while( !job->done )
+		pthread_cond_wait( &pool_done, &pool_lock );
+
+	pthread_mutex_unlock( &pool_lock );
+}
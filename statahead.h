@@ -0,0 +1,29 @@
+#ifndef __STATAHEAD_H__
+#define __STATAHEAD_H__ 1
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+/* One entry of a listing, stat'ed by the pool while the entries before
+ * it are sent */
+typedef struct stat_job
+{
+	struct stat_job *next;		/* Queue of the pool */
+	int dirfd;
+	unsigned int mask;		/* STATX_ fields wanted */
+	unsigned char type;		/* d_type from getdents64 */
+	bool done;
+	int err;			/* errno of statx(), or 0 */
+	struct statx stx;
+	char name[FTP_MAX_NAME];
+} stat_job_t;
+
+extern int stat_pool_start(void);
+extern void destroy_stat_pool(void);
+extern void stat_pool_submit( stat_job_t *job );
+extern void stat_pool_wait( stat_job_t *job );
+
+#define STAT_POOL_MAX_THREADS	64
+#define STAT_AHEAD_WINDOW	256	/* Entries in flight per listing */
+
+#endif
@@ -0,0 +1,154 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+/* GUI clients send SIZE, MDTM, CWD and RETR for the same path right
+ * after each other. The session remembers the answers for a short time,
+ * StatCacheTime milliseconds. Its own changes drop what they touch, the
+ * changes of others show up when the entries expire */
+
+static void drop_entry( stat_entry_t *entry );
+
+static stat_entry_t *stat_cache = NULL;
+
+int init_stat_cache(void)
+{
+	if( config.stat_cache_time <= 0 )
+		return FTP_SUCCESS;
+
+	stat_cache = calloc( STAT_CACHE_SIZE, sizeof *stat_cache );
+	if( stat_cache == NULL )
+	{
+		FATAL_MEM( STAT_CACHE_SIZE * sizeof *stat_cache );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+int destroy_stat_cache(void)
+{
+	if( stat_cache == NULL )
+		return FTP_SUCCESS;
+
+	stat_cache_flush();
+	free( stat_cache );
+	stat_cache = NULL;
+
+	return FTP_SUCCESS;
+}
+
+static void drop_entry( stat_entry_t *entry )
+{
+	free( entry->path );
+	entry->path = NULL;
+}
+
+/* Returns 0 with ST filled in, or -1 with errno set for a path known not
+ * to be there. 1 means the cache doesn't know */
+int stat_cache_lookup( const char *vpath, struct stat *st )
+{
+	stat_entry_t *entry;
+	struct timespec now;
+
+	if( stat_cache == NULL )
+		return 1;
+
+	entry = &stat_cache[hash_string( vpath ) % STAT_CACHE_SIZE];
+	if( entry->path == NULL || strcmp( entry->path, vpath ) != 0 )
+		return 1;
+
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &now );
+	if( now.tv_sec > entry->expires.tv_sec ||
+	    ( now.tv_sec == entry->expires.tv_sec &&
+	      now.tv_nsec >= entry->expires.tv_nsec ) )
+	{
+		drop_entry( entry );
+		return 1;
+	}
+
+	if( entry->err )
+	{
+		errno = entry->err;
+		return -1;
+	}
+
+	*st = entry->st;
+
+	return 0;
+}
+
+/* Remember ST for VPATH, or that it isn't there if ERR is set. Other
+ * errors might go away by themselves, those aren't kept */
+void stat_cache_store( const char *vpath, const struct stat *st, int err )
+{
+	stat_entry_t *entry;
+	long ms = config.stat_cache_time;
+
+	if( stat_cache == NULL || ( err && err != ENOENT && err != ENOTDIR ) )
+		return;
+
+	entry = &stat_cache[hash_string( vpath ) % STAT_CACHE_SIZE];
+	if( entry->path == NULL || strcmp( entry->path, vpath ) != 0 )
+	{
+		drop_entry( entry );
+		entry->path = strdup( vpath );
+		if( entry->path == NULL )
+			return;
+	}
+
+	entry->err = err;
+	if( !err )
+		entry->st = *st;
+
+	clock_gettime( CLOCK_MONOTONIC_COARSE, &entry->expires );
+	entry->expires.tv_sec += ms / 1000;
+	entry->expires.tv_nsec += ( ms % 1000 ) * 1000000;
+	if( entry->expires.tv_nsec >= 1000000000 )
+	{
+		entry->expires.tv_sec++;
+		entry->expires.tv_nsec -= 1000000000;
+	}
+}
+
+/* VPATH changed, and so did the directory it is in */
+void stat_cache_forget( const char *vpath )
+{
+	stat_entry_t *entry;
+	char dir[FTP_MAX_PATH];
+	char *sep;
+
+	if( stat_cache == NULL )
+		return;
+
+	entry = &stat_cache[hash_string( vpath ) % STAT_CACHE_SIZE];
+	if( entry->path && strcmp( entry->path, vpath ) == 0 )
+		drop_entry( entry );
+
+	strlcpy( dir, vpath, sizeof dir );
+	sep = strrchr( dir, '/' );
+	if( sep == NULL )
+		return;
+	sep[ sep == dir ? 1 : 0 ] = '\0';
+
+	entry = &stat_cache[hash_string( dir ) % STAT_CACHE_SIZE];
+	if( entry->path && strcmp( entry->path, dir ) == 0 )
+		drop_entry( entry );
+}
+
+/* For changes to whole trees, like renaming a directory */
+void stat_cache_flush(void)
+{
+	int i;
+
+	if( stat_cache == NULL )
+		return;
+
+	for( i = 0; i < STAT_CACHE_SIZE; i++ )
+		drop_entry( &stat_cache[i] );
+}
@@ -0,0 +1,26 @@
+#ifndef __STATCACHE_H__
+#define __STATCACHE_H__ 1
+
+#include <sys/stat.h>
+#include <time.h>
+
+/* What vfs_stat() said about a path a moment ago */
+typedef struct stat_entry
+{
+	char *path;			/* Canonical virtual path */
+	int err;			/* errno of a path that isn't there */
+	struct stat st;
+	struct timespec expires;
+} stat_entry_t;
+
+extern int init_stat_cache(void);
+extern int destroy_stat_cache(void);
+extern int stat_cache_lookup( const char *vpath, struct stat *st );
+extern void stat_cache_store( const char *vpath, const struct stat *st,
+		int err );
+extern void stat_cache_forget( const char *vpath );
+extern void stat_cache_flush(void);
+
+#define STAT_CACHE_SIZE		256
+
+#endif
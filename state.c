@@ -13,12 +13,15 @@ static int recv_chdir( int read_pipe, ftp_child_t *child );
 static int recv_xfer( int read_pipe, ftp_child_t *child );
 static int recv_xfer_start( int read_pipe, ftp_child_t *child );
 static int recv_xfer_stop( int read_pipe, ftp_child_t *child );
+static int recv_repair( int read_pipe, ftp_child_t *child );
+static int recv_migrate( int read_pipe, ftp_child_t *child );
 
 static int send_login( ftp_session_t *session, void *buf );
 static int send_chdir( ftp_session_t *session, void *buf );
 static int send_xfer( ftp_session_t *session, void *buf );
 static int send_xfer_start( ftp_session_t *session, void *buf );
 static int send_xfer_stop( ftp_session_t *session, void *buf );
+static int send_work( ftp_session_t *session, void *buf );
 
 typedef struct
 {
@@ -26,14 +29,17 @@ typedef struct
 	int (*recv_fun)(int, ftp_child_t *);
 	int (*send_fun)(ftp_session_t *, void *);
 	size_t buf_size;
+	bool need_child;	/* Dropped if the child is gone already */
 } state_ops_t;
 
 static const state_ops_t state_ops[] = {
-{ T_LOGIN,	&recv_login, 	  &send_login,      64 },
-{ T_CHDIR,	&recv_chdir,	  &send_chdir,	    FTP_MAX_PATH },
-{ T_XFER_START,	&recv_xfer_start, &send_xfer_start, FTP_MAX_NAME },
-{ T_XFER,	&recv_xfer, 	  &send_xfer,	   sizeof(ftp_xfer_info_t)},
-{ T_XFER_STOP,	&recv_xfer_stop,  &send_xfer_stop, sizeof(ftp_xfer_info_t)}
+{ T_LOGIN,	&recv_login, 	  &send_login,      64, true },
+{ T_CHDIR,	&recv_chdir,	  &send_chdir,	    FTP_MAX_PATH, true },
+{ T_XFER_START,	&recv_xfer_start, &send_xfer_start, sizeof(ftp_xfer_start_t), true},
+{ T_XFER,	&recv_xfer, 	  &send_xfer,	   sizeof(ftp_xfer_info_t), true},
+{ T_XFER_STOP,	&recv_xfer_stop,  &send_xfer_stop, sizeof(ftp_xfer_info_t), true},
+{ T_REPAIR,	&recv_repair,	  &send_work,	   sizeof(ftp_work_t), false},
+{ T_MIGRATE,	&recv_migrate,	  &send_work,	   sizeof(ftp_work_t), false}
 };
 
 static void *state_pool = NULL;
@@ -102,7 +108,7 @@ int recv_state( int read_pipe, ftp_child_t *head )
 	}
 
 	child = find_client( head, state.pid );
-	if( child == NULL )
+	if( child == NULL && state_ops[i].need_child )
 	{
 		/* We received a message from an unknown client.
 		 * This is not neccessarily a bug, sometimes messages
@@ -158,15 +164,33 @@ static int recv_xfer( int read_pipe, ftp_child_t *child )
 
 static int recv_xfer_start( int read_pipe, ftp_child_t *child )
 {
-	if( read( read_pipe, child->filename, FTP_MAX_NAME ) == -1 )
+	ftp_xfer_start_t start;
+	popular_t *entry;
+
+	if( read( read_pipe, &start, sizeof start ) == -1 )
 	{
 		log_fatal("Couldn't receive transfer info: %m\n");
 		return FTP_ERROR;
 	}
-	child->filename[FTP_MAX_NAME-1] = '\0';
+	start.filename[FTP_MAX_NAME-1] = '\0';
+	start.path[FTP_MAX_REAL_PATH-1] = '\0';
+
+	strlcpy( child->filename, start.filename, FTP_MAX_NAME );
+	strlcpy( child->filepath, start.path, FTP_MAX_REAL_PATH );
 	child->xfer_in_progress = true;
 
-	log_info("Download of %s started\n", child->filename );
+	log_info("%s of %s started\n", start.upload ? "Upload" : "Download",
+			child->filename );
+
+	if( start.upload || start.path[0] == '\0' )
+		return FTP_SUCCESS;
+
+	entry = popular_account( start.path );
+	if( entry != NULL )
+	{
+		hot_cache_consider( entry->path, entry->hits );
+		tier_consider( entry->path, entry->hits );
+	}
 
 	return FTP_SUCCESS;
 
@@ -203,6 +227,10 @@ static int recv_xfer_stop( int read_pipe, ftp_child_t *child )
 
 	child->xfer_in_progress = false;
 
+	if( !child->xfer_info.upload && child->filepath[0] != '\0' )
+		popular_transferred( child->filepath,
+				child->xfer_info.xfer_len );
+
 	/* Calculate the rate at which this download went */
 	gettimeofday( &tv, NULL );
 	diff = msecdiff( &tv, &child->xfer_info.xfer_start ); 
@@ -219,6 +247,45 @@ static int recv_xfer_stop( int read_pipe, ftp_child_t *child )
 	return FTP_SUCCESS;
 }
 
+/* Queued work must not get lost if the child quits right after the upload,
+ * so CHILD may be NULL here */
+static int recv_repair( int read_pipe, ftp_child_t *child )
+{
+	ftp_work_t work;
+
+	(void) child;
+
+	if( read( read_pipe, &work, sizeof work ) == -1 )
+	{
+		log_fatal("Couldn't receive repair: %m\n");
+		return FTP_ERROR;
+	}
+	work.path[FTP_MAX_REAL_PATH-1] = '\0';
+	work.vpath[FTP_MAX_PATH-1] = '\0';
+
+	replica_queue( work.path, work.vpath );
+
+	return FTP_SUCCESS;
+}
+
+static int recv_migrate( int read_pipe, ftp_child_t *child )
+{
+	ftp_work_t work;
+
+	(void) child;
+
+	if( read( read_pipe, &work, sizeof work ) == -1 )
+	{
+		log_fatal("Couldn't receive migration: %m\n");
+		return FTP_ERROR;
+	}
+	work.path[FTP_MAX_REAL_PATH-1] = '\0';
+
+	staging_queue( work.path );
+
+	return FTP_SUCCESS;
+}
+
 int send_state( ftp_session_t *session, int type )
 {
 	ftp_state_t new_state;
@@ -306,14 +373,22 @@ static int send_xfer( ftp_session_t *session, void *buf )
 
 static int send_xfer_start( ftp_session_t *session, void *buf )
 {
+	ftp_xfer_start_t *start = buf;
 	const char *filename = session->filename;
 
-	if(strlcpy( buf, filename, FTP_MAX_NAME ) > FTP_MAX_NAME )
+	if(strlcpy( start->filename, filename, FTP_MAX_NAME ) >= FTP_MAX_NAME )
 	{
 		log_fatal("Filename too long: '%s'\n", filename);
 		return FTP_ERROR;
 	}
 
+	/* An empty path just means the master won't keep statistics */
+	if( strlcpy( start->path, session->filepath, FTP_MAX_REAL_PATH )
+			>= FTP_MAX_REAL_PATH )
+		start->path[0] = '\0';
+
+	start->upload = session->info.upload;
+
 	return FTP_SUCCESS;
 }
 
@@ -324,3 +399,21 @@ static int send_xfer_stop( ftp_session_t *session, void *buf )
 	return FTP_SUCCESS;
 
 }
+
+static int send_work( ftp_session_t *session, void *buf )
+{
+	ftp_work_t *work = buf;
+
+	memset( work, '\0', sizeof *work );
+
+	if( strlcpy( work->path, session->filepath, FTP_MAX_REAL_PATH )
+			>= FTP_MAX_REAL_PATH ||
+	    strlcpy( work->vpath, session->virt_filepath, FTP_MAX_PATH )
+			>= FTP_MAX_PATH )
+	{
+		log_warn("Path too long: %s\n", session->filepath );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
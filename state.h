@@ -13,6 +13,8 @@ enum ftp_statechange_type {
 	T_XFER_START,
 	T_XFER,
 	T_XFER_STOP,
+	T_REPAIR,
+	T_MIGRATE,
 };
 
 typedef struct ftp_state
@@ -22,6 +24,23 @@ typedef struct ftp_state
 	int type;
 } ftp_state_t;
 
+/* Sent along with T_XFER_START. Keep it small enough for the whole
+ * message to be written to the pipe atomically */
+typedef struct ftp_xfer_start
+{
+	bool upload;
+	char filename[FTP_MAX_NAME];
+	char path[FTP_MAX_REAL_PATH];
+} ftp_xfer_start_t;
+
+/* Sent along with T_REPAIR and T_MIGRATE. The helpers doing that work run
+ * as root, so only the masterserver queues it for them */
+typedef struct ftp_work
+{
+	char path[FTP_MAX_REAL_PATH];	/* Real path of the upload */
+	char vpath[FTP_MAX_PATH];	/* Its virtual path */
+} ftp_work_t;
+
 #define STATE_MAGIC	(0xDEADBEEF)
 
 extern int init_state_pool(void);
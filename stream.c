@@ -1,9 +1,15 @@
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#define ZLIB_CONST
+#include <zlib.h>
 
 #include "ftp.h"
 
@@ -72,4 +78,542 @@ ssize_t sendall(int sockfd, const void *buf, size_t len, int flags)
 	return total;
 }
 
+/* Like sendall, but for files at a given offset */
+ssize_t pwriteall(int fd, const void *buf, size_t len, off_t offset)
+{
+	size_t total;
+	ssize_t n;
+	
+	total = 0;
+	while( total < len )
+	{
+		n = pwrite( fd, 
+			(const char *)buf + total, 
+			len - total, 
+			offset + total );
+		if( n == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			else
+				return -1;
+		}
+		
+		total += n;
+	}
+	
+	return total;
+}
+
+/* Read LEN bytes from OFFSET, short only at end of file */
+ssize_t preadall(int fd, void *buf, size_t len, off_t offset)
+{
+	size_t total;
+	ssize_t n;
+
+	total = 0;
+	while( total < len )
+	{
+		n = pread( fd, (char *)buf + total, len - total, offset + total );
+		if( n == -1 )
+		{
+			if( errno == EINTR )
+				continue;
+			else
+				return -1;
+		}
+		if( n == 0 )
+			break;
+
+		total += n;
+	}
+
+	return total;
+}
+
+/* A MODE B block header for a block of LEN bytes. The data follows
+ * right after, so let the kernel put them in the same segment */
+int send_block_header( int fd, int descriptor, size_t len )
+{
+	unsigned char hdr[BLOCK_HEADER_SIZE];
+
+	hdr[0] = descriptor;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+
+	return sendall( fd, hdr, sizeof hdr, MSG_MORE ) == -1 ? -1 : 0;
+}
+
+int outbuf_init( outbuf_t *out, int fd )
+{
+	out->fd = fd;
+	out->len = 0;
+	out->z = NULL;
+	out->block = false;
+	out->copy = NULL;
+	out->copy_len = out->copy_size = out->copy_max = 0;
+	out->limit = 0;
+	out->buf = malloc( STREAM_BUFFER_SIZE );
+	if( out->buf == NULL )
+	{
+		FATAL_MEM( STREAM_BUFFER_SIZE );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Put everything written from now on in blocks, for MODE B. The
+ * connection isn't closed at the end, so cork it until then to keep the
+ * last bits from waiting for an acknowledgement */
+void outbuf_block( outbuf_t *out )
+{
+	out->block = true;
+	setsockopt( out->fd, IPPROTO_TCP, TCP_CORK, &(int){1}, sizeof(int) );
+}
+
+/* Compress everything written from now on, for MODE Z */
+int outbuf_deflate( outbuf_t *out, int level )
+{
+	out->z = calloc( 1, sizeof *out->z );
+	if( out->z == NULL )
+	{
+		FATAL_MEM( sizeof *out->z );
+		return FTP_ERROR;
+	}
+
+	if( deflateInit( out->z, level ) != Z_OK )
+	{
+		log_warn("Unable to initialize compression\n");
+		free( out->z );
+		out->z = NULL;
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Keep a copy of everything written from now on, as long as it stays
+ * below MAX bytes. It is taken before compression and blocking */
+void outbuf_copy( outbuf_t *out, size_t max )
+{
+	out->copy_max = max;
+}
+
+/* Keep everything in the buffer until outbuf_finish, for a reply that
+ * has to go out whole or not at all. Writes past MAX fail with EFBIG */
+void outbuf_limit( outbuf_t *out, size_t max )
+{
+	out->limit = max < STREAM_BUFFER_SIZE ? max : STREAM_BUFFER_SIZE;
+}
+
+/* The copy, or NULL if there is none or it grew too big */
+const char *outbuf_copied( const outbuf_t *out, size_t *len )
+{
+	*len = out->copy_len;
+
+	return out->copy_max > 0 ? out->copy : NULL;
+}
+
+static void outbuf_append( outbuf_t *out, const void *buf, size_t len )
+{
+	if( out->copy_len + len > out->copy_size )
+	{
+		size_t size = out->copy_size ? out->copy_size : STREAM_BUFFER_SIZE;
+		char *copy;
+
+		while( size < out->copy_len + len )
+			size *= 2;
+		if( size > out->copy_max )
+			size = out->copy_max;
+
+		copy = size >= out->copy_len + len ?
+			realloc( out->copy, size ) : NULL;
+		if( copy == NULL )
+		{
+			free( out->copy );
+			out->copy = NULL;
+			out->copy_len = out->copy_size = out->copy_max = 0;
+			return;
+		}
+
+		out->copy = copy;
+		out->copy_size = size;
+	}
+
+	memcpy( out->copy + out->copy_len, buf, len );
+	out->copy_len += len;
+}
+
+static int outbuf_compress( outbuf_t *out, const void *buf, size_t len,
+		int flush )
+{
+	z_stream *z = out->z;
+	int ret;
+
+	z->next_in = buf;
+	z->avail_in = len;
+
+	for( ;; )
+	{
+		if( out->len == STREAM_BUFFER_SIZE && outbuf_flush( out ) == -1 )
+			return -1;
+
+		z->next_out = (Bytef *) out->buf + out->len;
+		z->avail_out = STREAM_BUFFER_SIZE - out->len;
+
+		ret = deflate( z, flush );
+		out->len = STREAM_BUFFER_SIZE - z->avail_out;
+
+		if( ret == Z_STREAM_ERROR )
+		{
+			errno = EINVAL;
+			return -1;
+		}
+
+		if( flush == Z_FINISH ? ret == Z_STREAM_END : z->avail_in == 0 )
+			return 0;
+	}
+}
+
+/* Send LEN bytes of BUF, with block headers in MODE B */
+static int outbuf_send( outbuf_t *out, const char *buf, size_t len )
+{
+	while( len > 0 )
+	{
+		size_t n = len;
+
+		if( out->block )
+		{
+			if( n > BLOCK_MAX_SIZE )
+				n = BLOCK_MAX_SIZE;
+			if( send_block_header( out->fd, 0, n ) == -1 )
+				return -1;
+		}
+
+		if( sendall( out->fd, buf, n, 0 ) == -1 )
+			return -1;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Returns -1 on failure, like sendall. The buffer is filled up all the
+ * way before it goes out, so every write is a full one */
+int outbuf_write( outbuf_t *out, const void *buf, size_t len )
+{
+	const char *data = buf;
+
+	if( out->limit > 0 && out->len + len > out->limit )
+	{
+		errno = EFBIG;
+		return -1;
+	}
+
+	if( out->copy_max > 0 )
+		outbuf_append( out, buf, len );
+
+	if( out->z )
+		return outbuf_compress( out, buf, len, Z_NO_FLUSH );
+
+	while( out->len + len > STREAM_BUFFER_SIZE )
+	{
+		size_t n = STREAM_BUFFER_SIZE - out->len;
+
+		/* Too big to bother copying */
+		if( out->len == 0 )
+			return outbuf_send( out, data, len );
 
+		memcpy( out->buf + out->len, data, n );
+		out->len += n;
+		data += n;
+		len -= n;
+
+		if( outbuf_flush( out ) == -1 )
+			return -1;
+	}
+
+	memcpy( out->buf + out->len, data, len );
+	out->len += len;
+
+	return 0;
+}
+
+/* Send what is buffered. In MODE Z the compressor can hold back some
+ * more, only outbuf_finish gets that out */
+int outbuf_flush( outbuf_t *out )
+{
+	if( out->len == 0 )
+		return 0;
+
+	if( outbuf_send( out, out->buf, out->len ) == -1 )
+		return -1;
+
+	out->len = 0;
+
+	return 0;
+}
+
+/* End of the data */
+int outbuf_finish( outbuf_t *out )
+{
+	if( out->z && outbuf_compress( out, NULL, 0, Z_FINISH ) == -1 )
+		return -1;
+
+	if( outbuf_flush( out ) == -1 )
+		return -1;
+
+	/* In MODE B the connection stays open, so the end needs a marker */
+	if( out->block )
+	{
+		static const char eof[BLOCK_HEADER_SIZE] = { BLOCK_EOF, 0, 0 };
+
+		if( sendall( out->fd, eof, sizeof eof, 0 ) == -1 )
+			return -1;
+
+		/* Out it goes */
+		return setsockopt( out->fd, IPPROTO_TCP, TCP_CORK, &(int){0},
+				sizeof(int) );
+	}
+
+	return 0;
+}
+
+void outbuf_free( outbuf_t *out )
+{
+	if( out->z )
+	{
+		deflateEnd( out->z );
+		free( out->z );
+		out->z = NULL;
+	}
+
+	free( out->copy );
+	out->copy = NULL;
+	out->copy_len = out->copy_size = out->copy_max = 0;
+
+	free( out->buf );
+	out->buf = NULL;
+}
+
+int inbuf_init( inbuf_t *in, int fd )
+{
+	in->fd = fd;
+	in->pos = in->len = 0;
+	in->z = NULL;
+	in->eof = false;
+	in->block = in->block_last = false;
+	in->block_left = 0;
+	in->buf = malloc( STREAM_BUFFER_SIZE );
+	if( in->buf == NULL )
+	{
+		FATAL_MEM( STREAM_BUFFER_SIZE );
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Read everything from now on as blocks, for MODE B */
+void inbuf_block( inbuf_t *in )
+{
+	in->block = true;
+}
+
+/* Decompress everything read from now on, for MODE Z */
+int inbuf_inflate( inbuf_t *in )
+{
+	in->z = calloc( 1, sizeof *in->z );
+	if( in->z == NULL )
+	{
+		FATAL_MEM( sizeof *in->z );
+		return FTP_ERROR;
+	}
+
+	if( inflateInit( in->z ) != Z_OK )
+	{
+		log_warn("Unable to initialize decompression\n");
+		free( in->z );
+		in->z = NULL;
+		return FTP_ERROR;
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Refill the buffer. Returns the number of bytes read, 0 at the end of
+ * the data or -1 on failure */
+static ssize_t inbuf_fill( inbuf_t *in )
+{
+	ssize_t ret;
+
+	do
+		ret = read( in->fd, in->buf, STREAM_BUFFER_SIZE );
+	while( ret == -1 && errno == EINTR );
+
+	if( ret == -1 )
+		return -1;
+
+	in->pos = 0;
+	in->len = ret;
+	in->eof = ( ret == 0 );
+
+	return ret;
+}
+
+static ssize_t inbuf_decompress( inbuf_t *in, void *buf, size_t len )
+{
+	z_stream *z = in->z;
+	int ret;
+
+	z->next_out = buf;
+	z->avail_out = len;
+
+	while( z->avail_out > 0 && !in->eof )
+	{
+		/* The connection closing before the end of the compressed
+		 * data means the upload was cut short */
+		if( in->pos == in->len && inbuf_fill( in ) <= 0 )
+		{
+			if( in->eof )
+				errno = EPIPE;
+			return -1;
+		}
+
+		z->next_in = (Bytef *) in->buf + in->pos;
+		z->avail_in = in->len - in->pos;
+
+		ret = inflate( z, Z_NO_FLUSH );
+		in->pos = in->len - z->avail_in;
+
+		if( ret == Z_STREAM_END )
+			in->eof = true;
+		else if( ret != Z_OK && ret != Z_BUF_ERROR )
+		{
+			errno = EBADMSG;
+			return -1;
+		}
+	}
+
+	return len - z->avail_out;
+}
+
+static ssize_t inbuf_copy( inbuf_t *in, void *buf, size_t len )
+{
+	size_t total = 0;
+
+	while( total < len )
+	{
+		size_t n;
+
+		if( in->pos == in->len && inbuf_fill( in ) <= 0 )
+		{
+			if( in->eof )
+				break;
+			return -1;
+		}
+
+		n = in->len - in->pos;
+		if( n > len - total )
+			n = len - total;
+
+		memcpy( (char *) buf + total, in->buf + in->pos, n );
+		in->pos += n;
+		total += n;
+	}
+
+	return total;
+}
+
+/* Take the data out of the blocks. The block with the EOF flag is the
+ * last one, the connection itself stays open */
+static ssize_t inbuf_unblock( inbuf_t *in, void *buf, size_t len )
+{
+	unsigned char hdr[BLOCK_HEADER_SIZE];
+	size_t total = 0;
+	ssize_t ret;
+
+	while( total < len )
+	{
+		size_t n;
+
+		if( in->block_left == 0 )
+		{
+			if( in->block_last )
+				break;
+
+			/* The connection closing before the block with the
+			 * EOF flag means the upload was cut short */
+			ret = inbuf_copy( in, hdr, sizeof hdr );
+			if( ret == -1 )
+				return -1;
+			if( ret < (ssize_t) sizeof hdr )
+			{
+				errno = EPIPE;
+				return -1;
+			}
+
+			in->block_left = hdr[1] << 8 | hdr[2];
+			in->block_last = hdr[0] & BLOCK_EOF;
+
+			/* Restart markers aren't data */
+			while( ( hdr[0] & BLOCK_RESTART ) && in->block_left > 0 )
+			{
+				ret = inbuf_copy( in, hdr, 1 );
+				if( ret != 1 )
+				{
+					if( ret == 0 )
+						errno = EPIPE;
+					return -1;
+				}
+				in->block_left--;
+			}
+			continue;
+		}
+
+		n = len - total < in->block_left ? len - total : in->block_left;
+
+		ret = inbuf_copy( in, (char *) buf + total, n );
+		if( ret == -1 )
+			return -1;
+
+		total += ret;
+		in->block_left -= ret;
+		if( (size_t) ret < n )
+		{
+			errno = EPIPE;
+			return -1;
+		}
+	}
+
+	return total;
+}
+
+/* Read exactly LEN bytes, unless the data ends first.
+ * Returns the number of bytes read or -1 on failure */
+ssize_t inbuf_read( inbuf_t *in, void *buf, size_t len )
+{
+	if( in->z )
+		return inbuf_decompress( in, buf, len );
+
+	if( in->block )
+		return inbuf_unblock( in, buf, len );
+
+	return inbuf_copy( in, buf, len );
+}
+
+void inbuf_free( inbuf_t *in )
+{
+	if( in->z )
+	{
+		inflateEnd( in->z );
+		free( in->z );
+		in->z = NULL;
+	}
+
+	free( in->buf );
+	in->buf = NULL;
+}
@@ -13,7 +13,66 @@ typedef struct stream
 	int type;
 } stream_t;
 
+struct z_stream_s;
+
+/* Buffered output, to keep many small writes from becoming as many
+ * system calls */
+typedef struct outbuf
+{
+	int fd;
+	size_t len;
+	char *buf;
+	struct z_stream_s *z;		/* Compressor for MODE Z */
+	bool block;			/* MODE B */
+	char *copy;			/* What was written, for the listing
+					 * cache. Dropped beyond copy_max */
+	size_t copy_len, copy_size, copy_max;
+	size_t limit;			/* Held back until outbuf_finish,
+					 * and no more than this, or 0 */
+} outbuf_t;
+
+typedef struct inbuf
+{
+	int fd;
+	size_t pos, len;
+	char *buf;
+	struct z_stream_s *z;		/* Decompressor for MODE Z */
+	bool eof;
+	bool block, block_last;		/* MODE B */
+	size_t block_left;		/* Data left in the current block */
+} inbuf_t;
+
+#define STREAM_BUFFER_SIZE	65536
+
+/* MODE B block headers, from RFC 959 */
+#define BLOCK_HEADER_SIZE	3
+#define BLOCK_MAX_SIZE		65535
+#define BLOCK_EOR		0x80
+#define BLOCK_EOF		0x40
+#define BLOCK_ERRORS		0x20
+#define BLOCK_RESTART		0x10
+
 extern ssize_t splice_stream(stream_t , off_t *, stream_t , off_t *, size_t);
 extern ssize_t sendall(int , const void *, size_t , int );
+extern ssize_t pwriteall(int , const void *, size_t , off_t );
+extern ssize_t preadall(int , void *, size_t , off_t );
+extern int send_block_header( int fd, int descriptor, size_t len );
+
+extern int outbuf_init( outbuf_t *, int fd );
+extern int outbuf_write( outbuf_t *, const void *, size_t );
+extern int outbuf_flush( outbuf_t * );
+extern void outbuf_block( outbuf_t * );
+extern int outbuf_deflate( outbuf_t *, int level );
+extern void outbuf_copy( outbuf_t *, size_t max );
+extern void outbuf_limit( outbuf_t *, size_t max );
+extern const char *outbuf_copied( const outbuf_t *, size_t *len );
+extern int outbuf_finish( outbuf_t * );
+extern void outbuf_free( outbuf_t * );
+
+extern int inbuf_init( inbuf_t *, int fd );
+extern void inbuf_block( inbuf_t * );
+extern int inbuf_inflate( inbuf_t * );
+extern ssize_t inbuf_read( inbuf_t *, void *, size_t );
+extern void inbuf_free( inbuf_t * );
 
 #endif
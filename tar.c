@@ -0,0 +1,404 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+typedef struct tar_dir
+{
+	vfs_dir_t *list;
+	size_t path_len;		/* Length of its path in the archive */
+	size_t vpath_len;		/* ... and of its virtual path */
+} tar_dir_t;
+
+/* The directories being walked, from the top of the archive down. This
+ * is all the state there is, so memory use depends on the depth of the
+ * tree and not on its size */
+typedef struct tar_stream
+{
+	ftp_session_t *session;
+	outbuf_t out;
+	tar_dir_t stack[TAR_MAX_DEPTH];
+	int depth;
+	char path[FTP_MAX_PATH];	/* Path of the current entry */
+	char vpath[FTP_MAX_PATH];	/* Its virtual path */
+} tar_stream_t;
+
+static void tar_number( char *field, size_t width, uint64_t value );
+static void tar_fill( char *hdr, const char *name, const struct stat *st,
+		uint64_t size, char type );
+static int tar_write( tar_stream_t *ts, const void *buf, size_t len );
+static int tar_pad( tar_stream_t *ts, uint64_t size );
+static int tar_long_name( tar_stream_t *ts, const struct stat *st,
+		char type, const char *name );
+static int tar_header( tar_stream_t *ts, const struct stat *st, char type );
+static int tar_file( tar_stream_t *ts );
+static int tar_entry( tar_stream_t *ts, const struct dirent *next );
+static int tar_walk( tar_stream_t *ts );
+
+/* Numbers too big for the octal field are stored in base 256, like
+ * GNU tar does */
+static void tar_number( char *field, size_t width, uint64_t value )
+{
+	size_t i;
+
+	if( value < (uint64_t) 1 << ( 3 * ( width - 1 ) ) )
+	{
+		snprintf( field, width, "%0*llo", (int) width - 1,
+				(unsigned long long) value );
+		return;
+	}
+
+	for( i = width - 1; i > 0; i-- )
+	{
+		field[i] = value & 0xff;
+		value >>= 8;
+	}
+	field[0] = (char) 0x80;
+}
+
+static void tar_fill( char *hdr, const char *name, const struct stat *st,
+		uint64_t size, char type )
+{
+	unsigned int sum = 0;
+	size_t i;
+
+	memset( hdr, '\0', TAR_BLOCK_SIZE );
+
+	/* Long names went ahead in their own entry, so cutting is fine */
+	memcpy( hdr, name, strnlen( name, TAR_NAME_SIZE ) );
+	tar_number( hdr + 100, 8, st->st_mode & 07777 );
+	tar_number( hdr + 108, 8, st->st_uid );
+	tar_number( hdr + 116, 8, st->st_gid );
+	tar_number( hdr + 124, 12, size );
+	tar_number( hdr + 136, 12, st->st_mtime > 0 ? st->st_mtime : 0 );
+	memset( hdr + 148, ' ', 8 );
+	hdr[156] = type;
+	memcpy( hdr + 257, "ustar  ", 8 );
+
+	for( i = 0; i < TAR_BLOCK_SIZE; i++ )
+		sum += (unsigned char) hdr[i];
+	snprintf( hdr + 148, 7, "%06o", sum );
+}
+
+static int tar_write( tar_stream_t *ts, const void *buf, size_t len )
+{
+	if( outbuf_write( &ts->out, buf, len ) == -1 )
+	{
+		if( errno == EPIPE || errno == ECONNRESET )
+			return FTP_ABOR;
+		log_warn("Error sending archive: %m\n");
+		return FTP_ERROR;
+	}
+
+	ts->session->info.xfer_len  += len;
+	ts->session->info.probe_len += len;
+
+	return FTP_SUCCESS;
+}
+
+/* Every entry fills a whole number of blocks */
+static int tar_pad( tar_stream_t *ts, uint64_t size )
+{
+	static const char zeros[TAR_BLOCK_SIZE];
+	size_t pad = ( TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE ) %
+			TAR_BLOCK_SIZE;
+
+	return pad ? tar_write( ts, zeros, pad ) : FTP_SUCCESS;
+}
+
+static int tar_long_name( tar_stream_t *ts, const struct stat *st,
+		char type, const char *name )
+{
+	char hdr[TAR_BLOCK_SIZE];
+	size_t len = strlen( name ) + 1;
+	int ret;
+
+	tar_fill( hdr, "././@LongLink", st, len, type );
+
+	ret = tar_write( ts, hdr, sizeof hdr );
+	if( ret == FTP_SUCCESS )
+		ret = tar_write( ts, name, len );
+	if( ret == FTP_SUCCESS )
+		ret = tar_pad( ts, len );
+
+	return ret;
+}
+
+/* The header of the current entry */
+static int tar_header( tar_stream_t *ts, const struct stat *st, char type )
+{
+	char hdr[TAR_BLOCK_SIZE];
+	uint64_t size = ( type == TAR_REGULAR ) ? (uint64_t) st->st_size : 0;
+	int ret;
+
+	if( strlen( ts->path ) >= TAR_NAME_SIZE &&
+	    (ret = tar_long_name( ts, st, TAR_LONGNAME, ts->path ))
+			!= FTP_SUCCESS )
+		return ret;
+
+	tar_fill( hdr, ts->path, st, size, type );
+
+	return tar_write( ts, hdr, sizeof hdr );
+}
+
+/* The header goes through the buffer, the contents go out with sendfile.
+ * Opened like RETR opens it, so a staged upload isn't archived as the empty
+ * file it left behind */
+static int tar_file( tar_stream_t *ts )
+{
+	struct stat st;
+	stream_t file;
+	int ret;
+
+	/* Files we can't read are left out */
+	file.fd = vfs_open( "/", ts->vpath, O_RDONLY );
+	if( file.fd == -1 )
+		return FTP_SUCCESS;
+	file.type = S_FILE;
+
+	/* The header has to promise exactly what follows */
+	if( vfs_fstat( file.fd, &st ) == -1 || !S_ISREG( st.st_mode ) )
+	{
+		vfs_close( file.fd );
+		return FTP_SUCCESS;
+	}
+
+	posix_fadvise( file.fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+	ret = tar_header( ts, &st, TAR_REGULAR );
+	if( ret == FTP_SUCCESS )
+		ret = send_file( ts->session, &ts->out, file,
+				vfs_offset( file.fd ), st.st_size,
+				st.st_blocks * 512 < st.st_size );
+	if( ret == FTP_SUCCESS )
+		ret = tar_pad( ts, st.st_size );
+
+	vfs_close( file.fd );
+
+	return ret;
+}
+
+/* NEXT is the entry of the directory on top that was read last. Links are
+ * followed where the session would follow them, but never into a directory,
+ * which could lead back up the tree */
+static int tar_entry( tar_stream_t *ts, const struct dirent *next )
+{
+	tar_dir_t *top = &ts->stack[ts->depth - 1];
+	const char *name = next->d_name;
+	vfs_dir_t *list;
+	struct stat st;
+	int ret;
+
+	/* Leave room for the slash of a directory */
+	if( strlcpy( ts->path + top->path_len, name,
+			sizeof ts->path - top->path_len )
+			>= sizeof ts->path - top->path_len - 1 ||
+	    snprintf( ts->vpath + top->vpath_len,
+			sizeof ts->vpath - top->vpath_len, "/%s", name )
+			>= (int) ( sizeof ts->vpath - top->vpath_len ) )
+	{
+		log_info("Name too long for archive: %s\n", name );
+		return FTP_SUCCESS;
+	}
+
+	/* It might be gone already */
+	if( vfs_statlist( top->list, "/", ts->vpath, STATX_BASIC_STATS,
+				&st ) == -1 )
+		return FTP_SUCCESS;
+
+	if( S_ISREG( st.st_mode ) )
+		return tar_file( ts );
+
+	if( !S_ISDIR( st.st_mode ) )
+		return FTP_SUCCESS;
+
+	strcat( ts->path, "/" );
+
+	ret = tar_header( ts, &st, TAR_DIRECTORY );
+	if( ret != FTP_SUCCESS || ts->depth == TAR_MAX_DEPTH ||
+	    !( next->d_type == DT_DIR ||
+	       ( next->d_type == DT_UNKNOWN && !config.allow_links ) ) )
+		return ret;
+
+	list = vfs_openlist( "/", ts->vpath );
+	if( list == NULL )
+		return FTP_SUCCESS;
+
+	vfs_statahead( list, STATX_BASIC_STATS );
+
+	top = &ts->stack[ts->depth++];
+	top->list = list;
+	top->path_len = strlen( ts->path );
+	top->vpath_len = strlen( ts->vpath );
+
+	return FTP_SUCCESS;
+}
+
+/* Depth first, in the order the VFS lists the entries */
+static int tar_walk( tar_stream_t *ts )
+{
+	struct dirent *next;
+	int ret = FTP_SUCCESS;
+
+	while( ts->depth > 0 && ret == FTP_SUCCESS )
+	{
+		tar_dir_t *top = &ts->stack[ts->depth - 1];
+
+		next = vfs_readlist( top->list );
+		if( next == NULL )
+		{
+			vfs_closelist( top->list );
+			ts->depth--;
+			continue;
+		}
+
+		if( strcmp( next->d_name, "." ) == 0 ||
+		    strcmp( next->d_name, ".." ) == 0 )
+			continue;
+
+		ret = tar_entry( ts, next );
+
+		throttle_pause( ts->session );
+
+		if( signal_flag && server_handle_signal() )
+			ret = FTP_QUIT;
+	}
+
+	while( ts->depth > 0 )
+		vfs_closelist( ts->stack[--ts->depth].list );
+
+	return ret;
+}
+
+/* Send the directory PATH and everything below it as a single tar
+ * archive, so a whole tree costs one data connection instead of one for
+ * every file */
+int send_tar( ftp_session_t *session, const char *path )
+{
+	static const char trailer[2 * TAR_BLOCK_SIZE];
+	ftp_conn_t *conn = &session->conn;
+	const char *basename;
+	tar_stream_t ts;
+	struct stat st;
+	vfs_dir_t *list;
+	int ret;
+
+	if( vfs_stat( session->virt_path, path, &st ) == -1 ||
+	    vfs_virtual( session->virt_path, path, ts.vpath,
+			sizeof ts.vpath ) == -1 )
+		return failed_vfs_reply( conn );
+
+	list = vfs_openlist( session->virt_path, path );
+	if( list == NULL )
+		return failed_vfs_reply( conn );
+
+	vfs_statahead( list, STATX_BASIC_STATS );
+
+	/* The root has no name, so the entries get no double slash */
+	if( strcmp( ts.vpath, "/" ) == 0 )
+		ts.vpath[0] = '\0';
+
+	conn->data_sock = accept_data_conn( conn );
+	if( conn->data_sock < 0 )
+	{
+		vfs_closelist( list );
+		return conn->data_sock == -2 ? FTP_QUIT : FTP_SUCCESS;
+	}
+
+	if( data_outbuf( session, &ts.out, conn->data_sock ) != FTP_SUCCESS )
+	{
+		vfs_closelist( list );
+		close_data_conn( session, FTP_ERROR );
+		reply( conn, "451 Local error in processing\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	ts.session = session;
+	ts.stack[0].list = list;
+	ts.depth = 1;
+
+	/* Everything goes in a directory named after the one requested */
+	basename = find_basename( path );
+	if( *basename && strcmp( basename, "." ) != 0 &&
+	    strcmp( basename, ".." ) != 0 &&
+	    strlen( basename ) < sizeof ts.path - 1 )
+		sprintf( ts.path, "%s/", basename );
+	else
+		ts.path[0] = '\0';
+	ts.stack[0].path_len = strlen( ts.path );
+	ts.stack[0].vpath_len = strlen( ts.vpath );
+
+	reply( conn, "125 Data connection OK, sending archive\r\n" );
+	session->info.xfer_status = 0;
+	session->info.upload = false;
+	session->filepath[0] = '\0';
+
+	send_state( session, T_XFER_START );
+
+	gettimeofday( &session->info.xfer_start, NULL );
+	session->info.xfer_probe = session->info.xfer_start;
+	session->info.xfer_len = session->info.probe_len = 0;
+
+	ret = FTP_SUCCESS;
+	if( ts.path[0] )
+		ret = tar_header( &ts, &st, TAR_DIRECTORY );
+	if( ret == FTP_SUCCESS )
+		ret = tar_walk( &ts );
+	else
+		vfs_closelist( list );
+
+	if( ret == FTP_SUCCESS )
+		ret = tar_write( &ts, trailer, sizeof trailer );
+
+	if( ret == FTP_SUCCESS && outbuf_finish( &ts.out ) == -1 )
+		ret = ( errno == EPIPE || errno == ECONNRESET ) ?
+			FTP_ABOR : FTP_ERROR;
+
+	switch( ret )
+	{
+	case FTP_SUCCESS:
+		reply( conn, "226 Archive sent OK\r\n" );
+		break;
+	case FTP_ABOR:
+		reply( conn, "426 Transfer aborted\r\n" );
+		break;
+	case FTP_QUIT:
+		break;
+	case FTP_ERROR:
+	default:
+		reply( conn, "450 Error during write to data connection\r\n" );
+		break;
+	}
+
+	session->info.total_down += session->info.xfer_len;
+	session->restart_pos = 0;
+	session->info.xfer_status = ret;
+
+	send_state( session, T_XFER_STOP );
+
+	outbuf_free( &ts.out );
+	close_data_conn( session, ret );
+
+	return ret == FTP_QUIT ? FTP_QUIT : FTP_SUCCESS;
+}
+
+/* SITE TAR <directory> */
+int dosite_tar( ftp_session_t *session )
+{
+	const char *path = session->command.arg;
+
+	if( strlcpy( session->filename, find_basename( path ),
+			FTP_MAX_NAME - 1 ) >= FTP_MAX_NAME )
+	{
+		reply( &session->conn, "550 Filename too long\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	return send_tar( session, path );
+}
@@ -0,0 +1,21 @@
+#ifndef __TAR_H__
+#define __TAR_H__ 1
+
+extern int send_tar (ftp_session_t *session, const char *path);
+extern int dosite_tar (ftp_session_t *session);
+
+#define TAR_BLOCK_SIZE		512
+#define TAR_MAX_DEPTH		32	/* Anything deeper is left out */
+#define TAR_NAME_SIZE		100
+
+/* Entry types */
+#define TAR_OLDREGULAR		'\0'
+#define TAR_REGULAR		'0'
+#define TAR_SYMLINK		'2'
+#define TAR_DIRECTORY		'5'
+#define TAR_CONTIGUOUS		'7'
+#define TAR_LONGLINK		'K'	/* GNU: long link target of the next entry */
+#define TAR_LONGNAME		'L'	/* GNU: long name of the next entry */
+#define TAR_PAX			'x'	/* Extended header of the next entry */
+
+#endif
@@ -0,0 +1,682 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+/* Serves the files of an uncompressed tar archive as a read-only tree.
+ * Only the headers are read at login, from a mapping of the archive.
+ * The contents are sent straight from the archive, every open file is
+ * a descriptor of it with the offset of the contents on the side */
+
+static int tarfs_init( const char *archive );
+static void tarfs_destroy(void);
+static int tarfs_stat( const char *vpath, struct stat *st );
+static int tarfs_open( const char *vpath, int flags );
+static int tarfs_close( int fd );
+static int tarfs_fstat( int fd, struct stat *st );
+static off_t tarfs_offset( int fd );
+static vfs_dir_t *tarfs_openlist( const char *vpath );
+static struct dirent *tarfs_readlist( vfs_dir_t *list );
+static int tarfs_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st );
+static int tarfs_closelist( vfs_dir_t *list );
+
+static int tar_octal( const unsigned char *field, size_t width,
+		uint64_t *value );
+static bool tar_checksum( const unsigned char *hdr );
+static char *tar_pax_path( const char *data, size_t len, uint64_t *size );
+static int add_entry( const char *name, size_t len, char type,
+		const unsigned char *hdr, off_t offset, off_t size );
+static int add_parents(void);
+static int compare_entries( const void *p1, const void *p2 );
+static tarfs_entry_t *find_entry( const char *path );
+static size_t first_below( const char *path, size_t len );
+static void entry_stat( const tarfs_entry_t *entry, struct stat *st );
+
+const vfs_ops_t tarfs_ops = {
+	.name		= "archive",
+	.init		= tarfs_init,
+	.destroy	= tarfs_destroy,
+	.stat		= tarfs_stat,
+	.open		= tarfs_open,
+	.close		= tarfs_close,
+	.fstat		= tarfs_fstat,
+	.offset		= tarfs_offset,
+	.openlist	= tarfs_openlist,
+	.readlist	= tarfs_readlist,
+	.statlist	= tarfs_statlist,
+	.closelist	= tarfs_closelist,
+};
+
+static int archive_fd = -1;
+static struct stat archive_st;
+
+/* Sorted by path, so a directory is followed by everything below it */
+static tarfs_entry_t *entries = NULL;
+static size_t num_entries = 0, max_entries = 0;
+
+static struct
+{
+	int fd;
+	const tarfs_entry_t *entry;
+} open_files[TARFS_MAX_OPEN];
+
+/* Numbers too big for the octal field are in base 256 */
+static int tar_octal( const unsigned char *field, size_t width,
+		uint64_t *value )
+{
+	size_t i;
+
+	*value = 0;
+
+	if( field[0] & 0x80 )
+	{
+		for( i = 1; i < width; i++ )
+			*value = ( *value << 8 ) | field[i];
+		return 0;
+	}
+
+	for( i = 0; i < width && field[i] == ' '; i++ )
+		; /* Do nothing */
+
+	for( ; i < width && field[i] >= '0' && field[i] <= '7'; i++ )
+		*value = ( *value << 3 ) | ( field[i] - '0' );
+
+	if( i < width && field[i] != '\0' && field[i] != ' ' )
+		return -1;
+
+	return 0;
+}
+
+static bool tar_checksum( const unsigned char *hdr )
+{
+	unsigned int sum = 0;
+	uint64_t stored;
+	size_t i;
+
+	for( i = 0; i < TAR_BLOCK_SIZE; i++ )
+		sum += ( i >= 148 && i < 156 ) ? ' ' : hdr[i];
+
+	return tar_octal( hdr + 148, 8, &stored ) == 0 && stored == sum;
+}
+
+/* The path, and maybe the size, of a pax extended header. Records look
+ * like "<length> <key>=<value>\n" */
+static char *tar_pax_path( const char *data, size_t len, uint64_t *size )
+{
+	char *path = NULL;
+	size_t pos = 0;
+
+	while( pos < len )
+	{
+		const char *rec = data + pos, *key, *value;
+		unsigned long reclen = 0;
+		size_t i;
+
+		for( i = 0; pos + i < len && rec[i] >= '0' && rec[i] <= '9'; i++ )
+			reclen = reclen * 10 + ( rec[i] - '0' );
+
+		if( reclen == 0 || reclen > len - pos || rec[i] != ' ' ||
+		    rec[reclen - 1] != '\n' )
+			break;
+
+		key = rec + i + 1;
+		value = memchr( key, '=', rec + reclen - key );
+		if( value != NULL )
+		{
+			size_t keylen = value - key;
+			size_t vallen = rec + reclen - 1 - ++value;
+
+			if( keylen == 4 && memcmp( key, "path", 4 ) == 0 )
+			{
+				free( path );
+				path = strndup( value, vallen );
+			}
+			else if( keylen == 4 && memcmp( key, "size", 4 ) == 0 )
+				*size = strtoull( value, NULL, 10 );
+		}
+
+		pos += reclen;
+	}
+
+	return path;
+}
+
+/* NAME is the path in the archive, which becomes /NAME without any
+ * ./ or trailing slashes. Entries with .. in them are left out */
+static int add_entry( const char *name, size_t len, char type,
+		const unsigned char *hdr, off_t offset, off_t size )
+{
+	tarfs_entry_t *entry;
+	char path[FTP_MAX_PATH];
+	const char *start, *end;
+	size_t dst = 0;
+	uint64_t value;
+
+	for( start = name; start < name + len; start = end + 1 )
+	{
+		size_t seglen;
+
+		end = memchr( start, '/', name + len - start );
+		if( end == NULL )
+			end = name + len;
+		seglen = end - start;
+
+		if( seglen == 0 || ( seglen == 1 && start[0] == '.' ) )
+			continue;
+		if( seglen == 2 && start[0] == '.' && start[1] == '.' )
+			return FTP_SUCCESS;
+		if( memchr( start, '\0', seglen ) != NULL )
+			break;
+
+		if( dst + seglen + 2 > sizeof path )
+		{
+			log_warn("Path too long in archive, skipping it\n");
+			return FTP_SUCCESS;
+		}
+
+		path[dst++] = '/';
+		memcpy( path + dst, start, seglen );
+		dst += seglen;
+	}
+
+	/* The top directory of the archive, ./ usually */
+	if( dst == 0 )
+		path[dst++] = '/';
+	path[dst] = '\0';
+
+	if( num_entries == max_entries )
+	{
+		size_t max = max_entries ? max_entries * 2 : 1024;
+		tarfs_entry_t *tmp;
+
+		tmp = realloc( entries, max * sizeof *entries );
+		if( tmp == NULL )
+		{
+			FATAL_MEM( max * sizeof *entries );
+			return FTP_ERROR;
+		}
+		entries = tmp;
+		max_entries = max;
+	}
+
+	entry = &entries[num_entries];
+	entry->path = strdup( path );
+	if( entry->path == NULL )
+	{
+		FATAL_MEM( dst + 1 );
+		return FTP_ERROR;
+	}
+
+	entry->offset = offset;
+	entry->size = type == TAR_DIRECTORY ? 0 : size;
+	entry->seq = (long) num_entries;
+
+	if( hdr != NULL )
+	{
+		tar_octal( hdr + 100, 8, &value );
+		entry->mode = value & 07777;
+		tar_octal( hdr + 108, 8, &value );
+		entry->uid = value;
+		tar_octal( hdr + 116, 8, &value );
+		entry->gid = value;
+		tar_octal( hdr + 136, 12, &value );
+		entry->mtime = value;
+	} else {
+		/* A directory the archive only has files in */
+		entry->mode = 0755;
+		entry->uid = archive_st.st_uid;
+		entry->gid = archive_st.st_gid;
+		entry->mtime = archive_st.st_mtime;
+		entry->seq = -1;
+	}
+
+	entry->mode |= type == TAR_DIRECTORY ? S_IFDIR : S_IFREG;
+	num_entries++;
+
+	return FTP_SUCCESS;
+}
+
+/* Every directory of a path gets an entry, the archive need not have
+ * one. Run before sorting, so the entries added are sorted too */
+static int add_parents(void)
+{
+	size_t i, count = num_entries;
+
+	if( add_entry( "/", 1, TAR_DIRECTORY, NULL, 0, 0 ) != FTP_SUCCESS )
+		return FTP_ERROR;
+
+	for( i = 0; i < count; i++ )
+	{
+		const char *path = entries[i].path, *sep;
+		const char *prev = i > 0 ? entries[i - 1].path : "";
+
+		for( sep = strchr( path + 1, '/' ); sep;
+		     sep = strchr( sep + 1, '/' ) )
+		{
+			size_t len = sep - path;
+
+			/* The entry before was in there as well */
+			if( strncmp( prev, path, len ) == 0 &&
+			    ( prev[len] == '/' || prev[len] == '\0' ) )
+				continue;
+
+			if( add_entry( path, len, TAR_DIRECTORY, NULL, 0, 0 )
+					!= FTP_SUCCESS )
+				return FTP_ERROR;
+		}
+	}
+
+	return FTP_SUCCESS;
+}
+
+static int compare_entries( const void *p1, const void *p2 )
+{
+	const tarfs_entry_t *e1 = p1, *e2 = p2;
+	int ret;
+
+	ret = strcmp( e1->path, e2->path );
+	if( ret != 0 )
+		return ret;
+
+	return ( e1->seq > e2->seq ) - ( e1->seq < e2->seq );
+}
+
+static int tarfs_init( const char *archive )
+{
+	const unsigned char *base;
+	void *map;
+	char *long_name = NULL;
+	uint64_t pax_size = 0;
+	off_t pos;
+	size_t i, j;
+	int ret = FTP_SUCCESS;
+
+	for( i = 0; i < TARFS_MAX_OPEN; i++ )
+		open_files[i].fd = -1;
+
+	archive_fd = open( archive, O_RDONLY );
+	if( archive_fd == -1 || fstat( archive_fd, &archive_st ) == -1 )
+	{
+		log_warn("Unable to open archive '%s': %m\n", archive );
+		tarfs_destroy();
+		return FTP_ERROR;
+	}
+
+	map = archive_st.st_size == 0 ? NULL :
+		mmap( NULL, archive_st.st_size, PROT_READ, MAP_SHARED,
+				archive_fd, 0 );
+	if( map == MAP_FAILED )
+	{
+		log_warn("Unable to map archive '%s': %m\n", archive );
+		tarfs_destroy();
+		return FTP_ERROR;
+	}
+	base = map;
+
+	/* Only the headers are read, scattered over the whole archive */
+	if( map != NULL )
+		madvise( map, archive_st.st_size, MADV_RANDOM );
+
+	for( pos = 0; pos + TAR_BLOCK_SIZE <= archive_st.st_size &&
+			ret == FTP_SUCCESS; )
+	{
+		const unsigned char *hdr = base + pos;
+		const char *name = (const char *) hdr;
+		size_t name_len;
+		uint64_t size;
+		off_t data = pos + TAR_BLOCK_SIZE;
+		char prefixed[155 + 1 + TAR_NAME_SIZE + 1];
+		char type;
+
+		if( hdr[0] == '\0' )
+			break;	/* The end of the archive */
+
+		if( !tar_checksum( hdr ) || tar_octal( hdr + 124, 12, &size )
+				== -1 )
+		{
+			log_warn("Bad header in archive '%s' at %lld\n",
+					archive, (long long) pos );
+			break;
+		}
+
+		if( pax_size )
+			size = pax_size;
+		if( size > (uint64_t) ( archive_st.st_size - data ) )
+		{
+			log_warn("Archive '%s' is truncated\n", archive );
+			break;
+		}
+
+		name_len = strnlen( name, TAR_NAME_SIZE );
+		if( memcmp( hdr + 257, "ustar\0", 6 ) == 0 && hdr[345] )
+		{
+			snprintf( prefixed, sizeof prefixed, "%.155s/%.100s",
+					(const char *) hdr + 345, name );
+			name = prefixed;
+			name_len = strlen( prefixed );
+		}
+
+		switch( hdr[156] )
+		{
+		case TAR_LONGNAME:
+			free( long_name );
+			long_name = strndup( (const char *) base + data, size );
+			break;
+		case TAR_PAX:
+			free( long_name );
+			long_name = tar_pax_path( (const char *) base + data,
+					size, &pax_size );
+			break;
+		case TAR_OLDREGULAR:
+		case TAR_REGULAR:
+		case TAR_CONTIGUOUS:
+		case TAR_DIRECTORY:
+			if( long_name != NULL )
+			{
+				name = long_name;
+				name_len = strlen( long_name );
+			}
+			type = hdr[156] == TAR_DIRECTORY ? TAR_DIRECTORY :
+				TAR_REGULAR;
+			ret = add_entry( name, name_len, type, hdr, data,
+					size );
+			/* Fall through */
+		default:
+			/* Links and special files aren't served */
+			free( long_name );
+			long_name = NULL;
+			pax_size = 0;
+			break;
+		}
+
+		pos = data + ( size + TAR_BLOCK_SIZE - 1 ) / TAR_BLOCK_SIZE *
+			TAR_BLOCK_SIZE;
+	}
+
+	free( long_name );
+	if( map != NULL )
+		munmap( map, archive_st.st_size );
+
+	if( ret == FTP_SUCCESS )
+		ret = add_parents();
+	if( ret != FTP_SUCCESS )
+	{
+		tarfs_destroy();
+		return FTP_ERROR;
+	}
+
+	/* Keep the last entry of every path, like extracting would */
+	qsort( entries, num_entries, sizeof *entries, compare_entries );
+	for( i = j = 0; i < num_entries; i++ )
+	{
+		if( i + 1 < num_entries &&
+		    strcmp( entries[i].path, entries[i + 1].path ) == 0 )
+		{
+			free( entries[i].path );
+			continue;
+		}
+		entries[j++] = entries[i];
+	}
+	num_entries = j;
+
+	log_dbg("Serving %zu entries of archive '%s'\n", num_entries,
+			archive );
+
+	return FTP_SUCCESS;
+}
+
+static void tarfs_destroy(void)
+{
+	size_t i;
+
+	for( i = 0; i < TARFS_MAX_OPEN; i++ )
+		if( open_files[i].fd != -1 )
+			tarfs_close( open_files[i].fd );
+
+	for( i = 0; i < num_entries; i++ )
+		free( entries[i].path );
+	free( entries );
+	entries = NULL;
+	num_entries = max_entries = 0;
+
+	if( archive_fd != -1 )
+		close( archive_fd );
+	archive_fd = -1;
+}
+
+static tarfs_entry_t *find_entry( const char *path )
+{
+	size_t lo = 0, hi = num_entries;
+
+	while( lo < hi )
+	{
+		size_t mid = lo + ( hi - lo ) / 2;
+		int cmp = strcmp( entries[mid].path, path );
+
+		if( cmp == 0 )
+			return &entries[mid];
+		else if( cmp < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	errno = ENOENT;
+
+	return NULL;
+}
+
+/* The first entry whose path starts with the LEN bytes of PATH */
+static size_t first_below( const char *path, size_t len )
+{
+	size_t lo = 0, hi = num_entries;
+
+	while( lo < hi )
+	{
+		size_t mid = lo + ( hi - lo ) / 2;
+
+		if( strncmp( entries[mid].path, path, len ) < 0 )
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int tarfs_stat( const char *vpath, struct stat *st )
+{
+	tarfs_entry_t *entry;
+
+	entry = find_entry( vpath );
+	if( entry == NULL )
+		return -1;
+
+	entry_stat( entry, st );
+
+	return 0;
+}
+
+static void entry_stat( const tarfs_entry_t *entry, struct stat *st )
+{
+	/* Device 0 keeps them apart from real files, in the hot cache */
+	memset( st, 0, sizeof *st );
+	st->st_ino = entry - entries + 1;
+	st->st_mode = entry->mode;
+	st->st_nlink = S_ISDIR( entry->mode ) ? 2 : 1;
+	st->st_uid = entry->uid;
+	st->st_gid = entry->gid;
+	st->st_size = entry->size;
+	st->st_blksize = archive_st.st_blksize;
+	st->st_blocks = ( entry->size + 511 ) / 512;
+	st->st_mtime = st->st_ctime = st->st_atime = entry->mtime;
+}
+
+static int tarfs_open( const char *vpath, int flags )
+{
+	tarfs_entry_t *entry;
+	int i, fd;
+
+	if( ( flags & O_ACCMODE ) != O_RDONLY || ( flags & O_TRUNC ) )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	entry = find_entry( vpath );
+	if( entry == NULL )
+		return -1;
+
+	if( S_ISDIR( entry->mode ) )
+	{
+		errno = EISDIR;
+		return -1;
+	}
+
+	for( i = 0; i < TARFS_MAX_OPEN; i++ )
+		if( open_files[i].fd == -1 )
+			break;
+
+	if( i == TARFS_MAX_OPEN )
+	{
+		errno = EMFILE;
+		return -1;
+	}
+
+	fd = dup( archive_fd );
+	if( fd == -1 )
+		return -1;
+
+	open_files[i].fd = fd;
+	open_files[i].entry = entry;
+
+	return fd;
+}
+
+static int tarfs_close( int fd )
+{
+	int i;
+
+	for( i = 0; i < TARFS_MAX_OPEN; i++ )
+		if( open_files[i].fd == fd )
+			open_files[i].fd = -1;
+
+	return close( fd );
+}
+
+/* The descriptor is the archive's, the size is the entry's */
+static int tarfs_fstat( int fd, struct stat *st )
+{
+	int i;
+
+	for( i = 0; i < TARFS_MAX_OPEN; i++ )
+		if( open_files[i].fd == fd )
+		{
+			entry_stat( open_files[i].entry, st );
+			return 0;
+		}
+
+	return fstat( fd, st );
+}
+
+static off_t tarfs_offset( int fd )
+{
+	int i;
+
+	for( i = 0; i < TARFS_MAX_OPEN; i++ )
+		if( open_files[i].fd == fd )
+			return open_files[i].entry->offset;
+
+	return 0;
+}
+
+static vfs_dir_t *tarfs_openlist( const char *vpath )
+{
+	tarfs_entry_t *entry;
+	vfs_dir_t *list;
+
+	entry = find_entry( vpath );
+	if( entry == NULL )
+		return NULL;
+
+	if( !S_ISDIR( entry->mode ) )
+	{
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	list = malloc( sizeof *list );
+	if( list == NULL )
+	{
+		FATAL_MEM( sizeof *list );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* Everything below the directory comes right after it */
+	list->num = 0;
+	list->data = entry;
+	list->cur = (int) first_below( entry->path, strlen( entry->path ) );
+
+	return list;
+}
+
+static struct dirent *tarfs_readlist( vfs_dir_t *list )
+{
+	const tarfs_entry_t *dir = list->data;
+	size_t len = dir->path[1] ? strlen( dir->path ) : 0;
+
+	while( (size_t) list->cur < num_entries )
+	{
+		const tarfs_entry_t *entry = &entries[list->cur];
+		const char *name = entry->path + len + 1;
+
+		if( strncmp( entry->path, dir->path, len ) != 0 )
+			break;
+
+		list->cur++;
+
+		/* The directory itself, something further down, or a
+		 * sibling whose name starts with the same letters */
+		if( entry == dir || entry->path[len] != '/' ||
+		    strchr( name, '/' ) != NULL )
+			continue;
+
+		memset( &list->entry, 0, sizeof list->entry );
+		list->entry.d_ino = entry - entries + 1;
+		list->entry.d_type = S_ISDIR( entry->mode ) ? DT_DIR : DT_REG;
+		strlcpy( list->entry.d_name, name, sizeof list->entry.d_name );
+
+		return &list->entry;
+	}
+
+	return NULL;
+}
+
+/* readlist() leaves CUR right after the entry it returned */
+static int tarfs_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st )
+{
+	(void) mask;
+
+	entry_stat( &entries[list->cur - 1], st );
+
+	return 0;
+}
+
+static int tarfs_closelist( vfs_dir_t *list )
+{
+	free( list );
+
+	return 0;
+}
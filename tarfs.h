@@ -0,0 +1,24 @@
+#ifndef __TARFS_H__
+#define __TARFS_H__ 1
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A file or directory inside of the archive */
+typedef struct tarfs_entry
+{
+	char *path;			/* Virtual path */
+	off_t offset;			/* Of the contents in the archive */
+	off_t size;
+	mode_t mode;
+	uid_t uid;
+	gid_t gid;
+	time_t mtime;
+	long seq;			/* Later entries replace earlier ones */
+} tarfs_entry_t;
+
+extern const vfs_ops_t tarfs_ops;
+
+#define TARFS_MAX_OPEN		16	/* Files open at the same time */
+
+#endif
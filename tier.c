@@ -0,0 +1,497 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/ioprio.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "ftp.h"
+
+static int tier_path( const char *real, char *dst, size_t len );
+static int remove_entry( const char *path, const struct stat *st, int flag,
+		struct FTW *ftw );
+static tier_file_t *find_tier_file( const char *path, unsigned int bucket );
+static void lru_unlink( tier_file_t *file );
+static void lru_push( tier_file_t *file );
+static void drop_tier_file( tier_file_t *file, bool evicted );
+static bool is_queued( const char *path );
+static int make_room( off_t size );
+static __noreturn void promote_file( const char *path, off_t size );
+
+static tier_file_t **tier_table = NULL;
+static tier_file_t *newest = NULL, *oldest = NULL;
+static tier_stats_t *tier_stats = NULL;
+
+/* Files waiting to be copied, and the one being copied right now */
+static char *queue[TIER_QUEUE_SIZE];
+static unsigned int queue_head = 0, queue_len = 0;
+static tier_file_t *promoting = NULL;
+static pid_t promote_pid = -1;
+
+/* The copy of REAL sits at the same path below the cache tier */
+static int tier_path( const char *real, char *dst, size_t len )
+{
+	if( config.tier_dir == NULL || real[0] != '/' )
+		return -1;
+
+	if( snprintf( dst, len, "%s%s", config.tier_dir, real ) >= (int) len )
+	{
+		dst[0] = '\0';
+		return -1;
+	}
+
+	return 0;
+}
+
+static int remove_entry( const char *path, const struct stat *st, int flag,
+		struct FTW *ftw )
+{
+	(void) st;
+	(void) flag;
+
+	if( ftw->level > 0 && remove( path ) == -1 )
+		log_warn("Unable to remove '%s': %m\n", path );
+
+	return 0;
+}
+
+int init_tiers(void)
+{
+	if( config.tier_dir == NULL || config.tier_size <= 0 )
+		return FTP_SUCCESS;
+
+	tier_table = calloc( TIER_BUCKETS, sizeof(*tier_table) );
+	if( tier_table == NULL )
+	{
+		FATAL_MEM( TIER_BUCKETS * sizeof(*tier_table) );
+		return FTP_ERROR;
+	}
+
+	/* The children only read these */
+	tier_stats = mmap( NULL, sizeof *tier_stats, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+	if( tier_stats == MAP_FAILED )
+	{
+		log_fatal("Unable to map tier statistics: %m\n");
+		tier_stats = NULL;
+		free( tier_table );
+		tier_table = NULL;
+		return FTP_ERROR;
+	}
+
+	/* Nothing tells which copies of the last run are still good, so
+	 * start with an empty cache tier */
+	if( nftw( config.tier_dir, remove_entry, 16,
+			FTW_DEPTH | FTW_PHYS ) == -1 )
+		log_warn("Unable to clean cache tier '%s': %m\n",
+				config.tier_dir );
+
+	log_dbg("Initializing cache tier %s (%d MB)\n", config.tier_dir,
+			config.tier_size );
+
+	return FTP_SUCCESS;
+}
+
+int destroy_tiers(void)
+{
+	unsigned int i;
+
+	if( tier_table == NULL )
+		return FTP_SUCCESS;
+
+	while( oldest )
+	{
+		tier_file_t *file = oldest;
+
+		lru_unlink( file );
+		free( file->path );
+		free( file );
+	}
+
+	for( i = 0; i < queue_len; i++ )
+		free( queue[( queue_head + i ) % TIER_QUEUE_SIZE] );
+	queue_len = 0;
+
+	if( promoting )
+	{
+		free( promoting->path );
+		free( promoting );
+		promoting = NULL;
+	}
+
+	munmap( tier_stats, sizeof *tier_stats );
+	tier_stats = NULL;
+	free( tier_table );
+	tier_table = NULL;
+
+	return FTP_SUCCESS;
+}
+
+static tier_file_t *find_tier_file( const char *path, unsigned int bucket )
+{
+	tier_file_t *file;
+
+	for( file = tier_table[bucket]; file; file = file->next )
+		if( strcmp( file->path, path ) == 0 )
+			return file;
+
+	return NULL;
+}
+
+static void lru_unlink( tier_file_t *file )
+{
+	if( file->newer )
+		file->newer->older = file->older;
+	else
+		newest = file->older;
+
+	if( file->older )
+		file->older->newer = file->newer;
+	else
+		oldest = file->newer;
+
+	file->newer = file->older = NULL;
+}
+
+static void lru_push( tier_file_t *file )
+{
+	file->newer = NULL;
+	file->older = newest;
+
+	if( newest )
+		newest->newer = file;
+	else
+		oldest = file;
+
+	newest = file;
+}
+
+/* Forget about FILE and remove its copy */
+static void drop_tier_file( tier_file_t *file, bool evicted )
+{
+	char path[FTP_MAX_REAL_PATH];
+	tier_file_t **link;
+
+	for( link = &tier_table[hash_string( file->path ) % TIER_BUCKETS];
+			*link; link = &(*link)->next )
+		if( *link == file )
+		{
+			*link = file->next;
+			break;
+		}
+
+	lru_unlink( file );
+
+	/* Children that have it open keep reading the unlinked copy */
+	if( tier_path( file->path, path, sizeof path ) == 0 )
+		unlink( path );
+
+	tier_stats->used -= file->size;
+	tier_stats->files--;
+	if( evicted )
+		tier_stats->evictions++;
+
+	free( file->path );
+	free( file );
+}
+
+static bool is_queued( const char *path )
+{
+	unsigned int i;
+
+	if( promoting && strcmp( promoting->path, path ) == 0 )
+		return true;
+
+	for( i = 0; i < queue_len; i++ )
+		if( strcmp( queue[( queue_head + i ) % TIER_QUEUE_SIZE],
+				path ) == 0 )
+			return true;
+
+	return false;
+}
+
+/* Called by the masterserver each time a download of PATH starts. Counts
+ * a hit if the cache tier has a current copy, and queues files that are
+ * popular enough for promotion */
+int tier_consider( const char *path, unsigned long hits )
+{
+	tier_file_t *file;
+	struct stat st;
+
+	if( tier_table == NULL || path[0] == '\0' )
+		return FTP_SUCCESS;
+
+	file = find_tier_file( path, hash_string( path ) % TIER_BUCKETS );
+	if( file != NULL )
+	{
+		if( stat( path, &st ) == 0 && st.st_size == file->size &&
+		    st.st_mtim.tv_sec  == file->mtime.tv_sec &&
+		    st.st_mtim.tv_nsec == file->mtime.tv_nsec )
+		{
+			tier_stats->hits++;
+			lru_unlink( file );
+			lru_push( file );
+			return FTP_SUCCESS;
+		}
+
+		/* Changed since it was copied */
+		drop_tier_file( file, false );
+	}
+
+	tier_stats->misses++;
+
+	if( hits < (unsigned long) config.tier_threshold ||
+	    queue_len == TIER_QUEUE_SIZE || is_queued( path ) )
+		return FTP_SUCCESS;
+
+	queue[( queue_head + queue_len ) % TIER_QUEUE_SIZE] = strdup( path );
+	if( queue[( queue_head + queue_len ) % TIER_QUEUE_SIZE] == NULL )
+	{
+		FATAL_MEM( strlen( path ) + 1 );
+		return FTP_ERROR;
+	}
+	queue_len++;
+
+	return FTP_SUCCESS;
+}
+
+/* Evict the least recently used copies until SIZE more bytes fit */
+static int make_room( off_t size )
+{
+	uint64_t budget = (uint64_t) config.tier_size * 1024 * 1024;
+
+	if( (uint64_t) size > budget )
+		return FTP_FAIL;
+
+	while( oldest && ( tier_stats->files >= TIER_MAX_FILES ||
+			tier_stats->used + size > budget ) )
+	{
+		log_dbg("Evicting %s from the cache tier\n", oldest->path );
+		drop_tier_file( oldest, true );
+	}
+
+	return FTP_SUCCESS;
+}
+
+/* Copy PATH to the cache tier, under a temporary name first so children
+ * never see half a copy */
+static void promote_file( const char *path, off_t size )
+{
+	char dst[FTP_MAX_REAL_PATH], tmp[FTP_MAX_REAL_PATH + 8];
+	struct timespec times[2];
+	struct stat st;
+	int in, out;
+
+	prctl( PR_SET_PDEATHSIG, SIGTERM );
+	setpriority( PRIO_PROCESS, 0, 19 );
+	if( syscall( SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			IOPRIO_PRIO_VALUE( IOPRIO_CLASS_IDLE, 0 ) ) == -1 )
+		log_warn("Unable to lower I/O priority: %m\n");
+
+	if( tier_path( path, dst, sizeof dst ) == -1 ||
+	    snprintf( tmp, sizeof tmp, "%s.tmp", dst ) >= (int) sizeof tmp )
+		_exit( 1 );
+
+	in = open( path, O_RDONLY );
+	if( in == -1 || fstat( in, &st ) == -1 || st.st_size != size )
+		_exit( 1 );
+
+	/* Only opened after the original, which does the permission check */
+	out = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+	if( out == -1 && errno == ENOENT && make_parent_dirs( tmp ) == 0 )
+		out = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+	if( out == -1 )
+	{
+		log_warn("Unable to create '%s': %m\n", tmp );
+		_exit( 1 );
+	}
+
+	posix_fadvise( in, 0, 0, POSIX_FADV_SEQUENTIAL );
+
+	/* The mtime tells the children whether the copy is still current */
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+
+	/* We run as root, the copy is the original's owner's */
+	if( copy_file_data( in, out, size, TIER_CHUNK_SIZE ) == -1 ||
+	    fchown( out, st.st_uid, st.st_gid ) == -1 ||
+	    fchmod( out, st.st_mode & 07777 ) == -1 ||
+	    futimens( out, times ) == -1 || close( out ) == -1 ||
+	    rename( tmp, dst ) == -1 )
+	{
+		log_warn("Unable to promote '%s': %m\n", path );
+		unlink( tmp );
+		_exit( 1 );
+	}
+
+	/* The capacity tier won't be asked for it again soon */
+	posix_fadvise( in, 0, 0, POSIX_FADV_DONTNEED );
+
+	_exit( 0 );
+}
+
+/* Right away while files wait to be promoted */
+time_t tier_next_tick(void)
+{
+	if( tier_table == NULL || promote_pid != -1 || queue_len == 0 )
+		return -1;
+
+	return 0;
+}
+
+/* Called from the main loop, promotes the next queued file */
+int tier_tick(void)
+{
+	tier_file_t *file;
+	struct stat st;
+	char *path;
+	pid_t pid;
+
+	if( tier_table == NULL || promote_pid != -1 || queue_len == 0 )
+		return FTP_SUCCESS;
+
+	path = queue[queue_head];
+	queue_head = ( queue_head + 1 ) % TIER_QUEUE_SIZE;
+	queue_len--;
+
+	if( stat( path, &st ) == -1 || !S_ISREG( st.st_mode ) ||
+	    find_tier_file( path,
+			hash_string( path ) % TIER_BUCKETS ) != NULL ||
+	    make_room( st.st_size ) != FTP_SUCCESS )
+	{
+		free( path );
+		return FTP_SUCCESS;
+	}
+
+	file = malloc( sizeof *file );
+	if( file == NULL )
+	{
+		FATAL_MEM( sizeof *file );
+		free( path );
+		return FTP_ERROR;
+	}
+
+	file->path = path;
+	file->size = st.st_size;
+	file->mtime = st.st_mtim;
+	file->next = file->newer = file->older = NULL;
+
+	pid = fork();
+	if( pid == -1 )
+	{
+		log_warn("Unable to start promotion of '%s': %m\n", path );
+		free( file->path );
+		free( file );
+		return FTP_FAIL;
+	}
+
+	if( pid == 0 )
+		promote_file( file->path, file->size );
+
+	/* The space is taken until we know how it went */
+	promoting = file;
+	promote_pid = pid;
+	tier_stats->used += file->size;
+
+	return FTP_SUCCESS;
+}
+
+bool tier_promote_reaped( pid_t pid, int status )
+{
+	tier_file_t *file = promoting;
+	unsigned int bucket;
+
+	if( pid == -1 || pid != promote_pid )
+		return false;
+
+	promote_pid = -1;
+	promoting = NULL;
+	tier_stats->used -= file->size;
+
+	if( !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 ||
+	    make_room( file->size ) != FTP_SUCCESS )
+	{
+		free( file->path );
+		free( file );
+		return true;
+	}
+
+	bucket = hash_string( file->path ) % TIER_BUCKETS;
+	file->next = tier_table[bucket];
+	tier_table[bucket] = file;
+	lru_push( file );
+
+	tier_stats->used += file->size;
+	tier_stats->files++;
+	tier_stats->promotions++;
+
+	log_dbg("Promoted %s to the cache tier\n", file->path );
+
+	return true;
+}
+
+/* Open the copy of REAL on the cache tier, if there is one that matches
+ * ST, the stat of REAL itself. Returns -1 if there isn't */
+int tier_open( const char *real, const struct stat *st )
+{
+	char path[FTP_MAX_REAL_PATH];
+	struct stat copy;
+	int fd;
+
+	if( tier_stats == NULL || tier_path( real, path, sizeof path ) == -1 )
+		return -1;
+
+	fd = open( path, O_RDONLY );
+	if( fd == -1 )
+		return -1;
+
+	if( fstat( fd, &copy ) == -1 || copy.st_size != st->st_size ||
+	    copy.st_mtim.tv_sec  != st->st_mtim.tv_sec ||
+	    copy.st_mtim.tv_nsec != st->st_mtim.tv_nsec )
+	{
+		close( fd );
+		return -1;
+	}
+
+	return fd;
+}
+
+/* SITE TIER
+ * Usage and hit ratio of the cache tier */
+int dosite_tier( ftp_session_t *session )
+{
+	ftp_conn_t *conn = &session->conn;
+	unsigned long lookups;
+
+	if( tier_stats == NULL )
+	{
+		reply( conn, "502 No cache tier configured\r\n" );
+		return FTP_SUCCESS;
+	}
+
+	lookups = tier_stats->hits + tier_stats->misses;
+
+	reply( conn, "211-Cache tier status:\r\n" );
+	reply_format( conn, " Files: %lu (%llu of %d MB)\r\n",
+			tier_stats->files,
+			(unsigned long long) tier_stats->used / ( 1024 * 1024 ),
+			config.tier_size );
+	reply_format( conn, " Hits: %lu Misses: %lu Ratio: %lu%%\r\n",
+			tier_stats->hits, tier_stats->misses,
+			lookups ? tier_stats->hits * 100 / lookups : 0 );
+	reply_format( conn, " Promotions: %lu Evictions: %lu\r\n",
+			tier_stats->promotions, tier_stats->evictions );
+	reply( conn, "211 End.\r\n" );
+
+	return FTP_SUCCESS;
+}
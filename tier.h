@@ -0,0 +1,46 @@
+#ifndef __TIER_H__
+#define __TIER_H__ 1
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* A file with a copy on the cache tier, kept by the masterserver */
+typedef struct tier_file
+{
+	struct tier_file *next;		/* Hash chain */
+	struct tier_file *newer;	/* LRU list */
+	struct tier_file *older;
+	off_t size;			/* Of the original */
+	struct timespec mtime;
+	char *path;			/* Real path of the original */
+} tier_file_t;
+
+/* Counters the masterserver keeps in shared memory for SITE TIER */
+typedef struct tier_stats
+{
+	unsigned long hits;		/* Downloads served by the cache tier */
+	unsigned long misses;
+	unsigned long promotions;
+	unsigned long evictions;
+	unsigned long files;
+	uint64_t used;			/* Bytes on the cache tier */
+} tier_stats_t;
+
+extern int init_tiers(void);
+extern int destroy_tiers(void);
+extern int tier_consider( const char *path, unsigned long hits );
+extern time_t tier_next_tick(void);
+extern int tier_tick(void);
+extern bool tier_promote_reaped( pid_t pid, int status );
+
+extern int tier_open( const char *real, const struct stat *st );
+extern int dosite_tier( ftp_session_t *session );
+
+#define TIER_BUCKETS		1024
+#define TIER_MAX_FILES		65536
+#define TIER_QUEUE_SIZE		64	/* Files waiting for promotion */
+#define TIER_CHUNK_SIZE		( 8 * 1024 * 1024 )
+
+#endif
@@ -7,65 +7,54 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 
 #include "ftp.h"
 
-static bool is_leap( int year );
+static bool is_leap( long long year );
 
-static bool is_leap( int year )
+static bool is_leap( long long year )
 {
-	if( year % 400 )
-		return true;
-	else if( year % 100 )
-		return false;
-	else if( year % 4 )
-		return true;
+	return ( year % 4 == 0 && year % 100 != 0 ) || year % 400 == 0;
 }
 
-struct tm *convert_time( time_t *timep, struct tm *dest )
+/* A gmtime() without the locking and the time zone file. The days since
+ * 1970 become a date without looping over the years: counted from March 1
+ * in 400 year eras, every era has the same 146097 days and the leap day is
+ * the last day of a year */
+struct tm *convert_time( const time_t *timep, struct tm *dest )
 {
-	static const int days_in_month[] = 
-		{ 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
-	time_t time;
-	int days, month, year;
+	long long days, secs, era, doe, yoe, doy, mp, year;
 
-	time = *timep;
+	days = *timep / 86400;
+	secs = *timep % 86400;
+	if( secs < 0 )
+	{
+		secs += 86400;
+		days--;
+	}
 
-	dest->tm_hour = ( time / 3600 ) % 24;
-	dest->tm_min  = ( time / 60 ) % 60;
-	dest->tm_sec  = time % 60;
+	dest->tm_hour = secs / 3600;
+	dest->tm_min  = ( secs / 60 ) % 60;
+	dest->tm_sec  = secs % 60;
 
-	/* 86400 seconds in a day */
-	days = time / 86400;
 	/* January 1, 1970 was a thursday */
-	dest->tm_wday = (days + 4) % 7;
-
-	year = 1970;
+	dest->tm_wday = ( days % 7 + 11 ) % 7;
 
-	while( days >= ( is_leap( year ) ? 366 : 365 ) )
-	{
-		days -= is_leap( year ) ? 366 : 365;
-		year++;
-	}
+	/* March 1 of the year 0 */
+	days += 719468;
+	era = ( days >= 0 ? days : days - 146096 ) / 146097;
+	doe = days - era * 146097;
+	yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365;
+	doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 );
+	mp = ( 5 * doy + 2 ) / 153;
+	year = yoe + era * 400 + ( mp >= 10 );
 
+	dest->tm_mday = doy - ( 153 * mp + 2 ) / 5 + 1;
+	dest->tm_mon  = mp < 10 ? mp + 2 : mp - 10;
 	dest->tm_year = year - 1900;
-	dest->tm_yday = days;
-
-	month = 0;
-	while( 1 )
-	{
-		int i = days_in_month[month];
-		if( month == 1 && is_leap(year) )
-			i++; /* Februari of course sometimes has 29 days */
-		if( days < i )
-			break;
-		days -= i;
-		month++;
-	}
-
-	dest->tm_mon  = month;
-	dest->tm_mday = days + 1;
+	dest->tm_yday = mp >= 10 ? doy - 306 : doy + 59 + is_leap( year );
 	dest->tm_isdst = 0; /* I hate DST */
 
 	return dest;
@@ -169,6 +158,10 @@ int accept_data_conn( ftp_conn_t *conn )
 {
 	int data_sock;
 
+	/* MODE B left the last one open */
+	if( conn->data_sock >= 0 )
+		return conn->data_sock;
+
 	while( ( data_sock = accept( conn->pasv_sock, NULL, NULL )) == -1 )
 	{
 		if( errno == EINTR && server_handle_signal() )
@@ -193,4 +186,87 @@ const char *find_basename( const char *path )
 	return sep ? sep + 1 : path;
 }
 
+/* Create the missing directories above the file PATH */
+int make_parent_dirs( char *path )
+{
+	char *sep;
+
+	for( sep = strchr( path + 1, '/' ); sep; sep = strchr( sep + 1, '/' ) )
+	{
+		int ret;
+
+		*sep = '\0';
+		ret = mkdir( path, 0777 );
+		*sep = '/';
+
+		if( ret == -1 && errno != EEXIST )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Copy SIZE bytes from the start of IN to OUT in pieces of CHUNK bytes,
+ * with copy_file_range() if the kernel can do it between the two
+ * filesystems, with sendfile() otherwise */
+int copy_file_data( int in, int out, off_t size, size_t chunk_size )
+{
+	off_t offset = 0;
+	bool fallback = false;
 
+	while( offset < size )
+	{
+		size_t chunk = size - offset < (off_t) chunk_size ?
+				(size_t) ( size - offset ) : chunk_size;
+		ssize_t ret;
+
+		if( !fallback )
+		{
+			ret = copy_file_range( in, &offset, out, NULL, chunk, 0 );
+			if( ret == -1 && ( errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP ) )
+			{
+				fallback = true;
+				continue;
+			}
+		}
+		else
+			ret = sendfile( out, in, &offset, chunk );
+
+		if( ret == -1 && errno == EINTR )
+			continue;
+		if( ret <= 0 )
+			return -1;
+	}
+
+	return 0;
+}
+
+/* FNV-1a, good enough for path names */
+uint32_t hash_string( const char *str )
+{
+	uint32_t hash = 2166136261u;
+
+	while( *str )
+	{
+		hash ^= (unsigned char) *str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+/* True if the LEN bytes in BUF are all zero. If the first 16 bytes are
+ * zero and every byte equals the one 16 bytes before it, they all are.
+ * That lets the vectorized memcmp of the C library do the work */
+bool is_zero_block( const void *buf, size_t len )
+{
+	static const char zeros[16];
+	const char *p = buf;
+
+	if( len <= 16 )
+		return memcmp( p, zeros, len ) == 0;
+
+	return memcmp( p, zeros, 16 ) == 0 &&
+		memcmp( p, p + 16, len - 16 ) == 0;
+}
@@ -2,7 +2,7 @@
 #define __FTPUTIL_H__ 1
 #include "server.h"
 
-extern struct tm *convert_time( time_t *timep, struct tm *dest );
+extern struct tm *convert_time( const time_t *timep, struct tm *dest );
 extern size_t strlcpy( char *, const char *, size_t );
 extern __must_check char *trim_whitespace(char *);
 extern int seek_pipe( int pipefd, size_t offset );
@@ -10,6 +10,10 @@ extern int msecdiff( struct timeval *t1, struct timeval *t2 );
 extern char get_modechar( mode_t mode );
 extern int accept_data_conn( ftp_conn_t * );
 extern const char *find_basename( const char *path );
+extern int make_parent_dirs( char *path );
+extern int copy_file_data( int in, int out, off_t size, size_t chunk_size );
+extern __pure bool is_zero_block( const void *buf, size_t len );
+extern __pure uint32_t hash_string( const char *str );
 
 #define FATAL_MEM(n)	(log_fatal("No memory for %ld bytes\n", (long) (n)))
 
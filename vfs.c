@@ -2,49 +2,553 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
+#include <unistd.h>
+#include <linux/openat2.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
 
 #include "ftp.h"
 
 static ssize_t vfs_realpath( const char *, const char *);
+static void posix_path( const char *vpath );
+static void use_root( int i );
+static int open_beneath( int dirfd, const char *path, int flags,
+		mode_t mode );
+static const char *path_name(void);
+static void close_dirs(void);
+static int dir_fd( int i );
+static int open_path( int i, int flags, mode_t mode );
+static int find_root( struct stat *st );
+static bool parent_in_root( int i );
+static unsigned long root_load( int i );
+static int place_root(void);
+static void statx_stat( const struct statx *stx, struct stat *st );
+static unsigned int statx_mask( unsigned int mask );
+static struct dirent *next_entry( vfs_dir_t *list );
+static int fall_back(void);
+
+/* Entries of a listing read ahead, with their stats under way in the
+ * pool. Indexes keep counting up, the slot is the index modulo the size */
+struct stat_ahead
+{
+	stat_job_t jobs[STAT_AHEAD_WINDOW];
+	unsigned int head;		/* Handed out next */
+	unsigned int tail;		/* Read next */
+	unsigned int mask;
+	bool handed;			/* jobs[head] is out already */
+};
+
+static int posix_init( const char *root_dir );
+static void posix_destroy(void);
+static int posix_resolve( const char *vpath, char *dst, size_t len );
+static int posix_stat( const char *vpath, struct stat *st );
+static int posix_creat( const char *vpath, mode_t mode );
+static int posix_open( const char *vpath, int flags );
+static int posix_mkdir( const char *vpath, mode_t mode );
+static int posix_rmdir( const char *vpath );
+static vfs_dir_t *posix_openlist( const char *vpath );
+static struct dirent *posix_readlist( vfs_dir_t *list );
+static int posix_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st );
+static void posix_statahead( vfs_dir_t *list, unsigned int mask );
+static int posix_closelist( vfs_dir_t *list );
+static int posix_unlink( const char *vpath );
+static int posix_mkstemp( char *vpath );
+static int posix_rename( const char *from, const char *to );
+
+static const vfs_ops_t posix_ops = {
+	.name		= "posix",
+	.init		= posix_init,
+	.destroy	= posix_destroy,
+	.resolve	= posix_resolve,
+	.stat		= posix_stat,
+	.creat		= posix_creat,
+	.open		= posix_open,
+	.mkdir		= posix_mkdir,
+	.rmdir		= posix_rmdir,
+	.openlist	= posix_openlist,
+	.readlist	= posix_readlist,
+	.statlist	= posix_statlist,
+	.statahead	= posix_statahead,
+	.closelist	= posix_closelist,
+	.unlink		= posix_unlink,
+	.mkstemp	= posix_mkstemp,
+	.rename		= posix_rename,
+};
+
+/* The backend is picked by a prefix of the root directory the session
+ * gets at login. Anything else is a directory, or several of them */
+static const struct
+{
+	const char *prefix;
+	const vfs_ops_t *ops;
+} backends[] = {
+	{ "mem:",	&memfs_ops },
+	{ "tar:",	&tarfs_ops },
+	{ "index:",	&indexfs_ops },
+	{ "",		&posix_ops },
+};
+
+#define NUM_BACKENDS ( sizeof backends / sizeof *backends )
+
+static const vfs_ops_t *ops = NULL;
+
+/* Space the POSIX backend needs in front of the virtual path for the
+ * longest root */
+static size_t root_space = 0;
+
 static char *real_path = NULL;
 static char *virt_path = NULL;
+static char *path_buf = NULL;
+
+/* The real roots merged into the virtual one. Earlier roots hide files
+ * with the same name in later ones */
+static vfs_root_t roots[VFS_MAX_ROOTS];
+static int num_roots = 0;
+
+/* The directory the dir_fd of the roots are open on. Most of the time
+ * that's the working directory, or the one being listed */
+static char dir_path[FTP_MAX_PATH];
+
+/* Kernels before 5.6 don't have openat2() */
+static bool have_openat2 = true;
+
+/* Where the last new file resolved by vfs_resolve() is to be created */
+static char placed_path[FTP_MAX_PATH];
+static int placed_root = 0;
 
 int init_vfs_pool( const char *root_dir )
 {
-	char *buf;
-	size_t rootlen;
+	unsigned int i;
+
+	for( i = 0; i < NUM_BACKENDS; i++ )
+		if( strncmp( root_dir, backends[i].prefix,
+				strlen( backends[i].prefix ) ) == 0 )
+			break;
+
+	ops = backends[i].ops;
+	root_space = 0;
 
-	rootlen = strlen( root_dir );
+	if( ops->init( root_dir + strlen( backends[i].prefix ) ) !=
+			FTP_SUCCESS && fall_back() == -1 )
+	{
+		ops = NULL;
+		return FTP_ERROR;
+	}
 
-	buf = malloc( FTP_MAX_PATH + rootlen );
-	if( buf == NULL )
+	if( init_stat_cache() != FTP_SUCCESS )
 	{
-		FATAL_MEM( FTP_MAX_PATH );
+		destroy_vfs_pool();
 		return FTP_ERROR;
 	}
 
-	strlcpy( buf, root_dir, rootlen + 1 );
+	path_buf = malloc( FTP_MAX_PATH + root_space );
+	if( path_buf == NULL )
+	{
+		FATAL_MEM( FTP_MAX_PATH + root_space );
+		destroy_vfs_pool();
+		return FTP_ERROR;
+	}
 
-	real_path = buf;
-	virt_path = buf + rootlen;
+	/* The root in use goes right in front of the virtual path */
+	virt_path = path_buf + root_space;
 
 	memset( virt_path, '\0', FTP_MAX_PATH );
 	virt_path[0] = '/';
 
+	if( ops == &posix_ops )
+		use_root( 0 );
+
 	return FTP_SUCCESS;
 }
 
+/* A backend that finds out it is out of date fails with ESTALE. The
+ * POSIX backend takes over then, on the real directory it names */
+static int fall_back(void)
+{
+	char dir[FTP_MAX_REAL_PATH];
+	char *buf;
+
+	if( errno != ESTALE || ops->fallback == NULL ||
+	    ops->fallback( dir, sizeof dir ) == -1 )
+		return -1;
+
+	log_warn("The %s backend is out of date, serving %s instead\n",
+			ops->name, dir );
+
+	if( posix_init( dir ) != FTP_SUCCESS )
+		return -1;
+
+	/* In the middle of a session, the current path has to move to
+	 * make room for the root in front of it */
+	if( path_buf != NULL )
+	{
+		buf = malloc( FTP_MAX_PATH + root_space );
+		if( buf == NULL )
+		{
+			FATAL_MEM( FTP_MAX_PATH + root_space );
+			posix_destroy();
+			return -1;
+		}
+
+		memcpy( buf + root_space, virt_path, FTP_MAX_PATH );
+		free( path_buf );
+		path_buf = buf;
+		virt_path = path_buf + root_space;
+	}
+
+	ops->destroy();
+	ops = &posix_ops;
+	stat_cache_flush();
+
+	if( path_buf != NULL )
+		use_root( 0 );
+
+	return 0;
+}
+
 int destroy_vfs_pool(void)
 {
-	free( real_path );
-	real_path = virt_path = NULL;
+	if( ops != NULL )
+		ops->destroy();
+	ops = NULL;
+
+	destroy_stat_cache();
+	destroy_stat_pool();
+
+	free( path_buf );
+	path_buf = real_path = virt_path = NULL;
+	return FTP_SUCCESS;
+}
+
+/* ROOT_DIR is a single directory, or a list of them separated by colons
+ * for a union of several disks */
+static int posix_init( const char *root_dir )
+{
+	size_t maxlen = 0;
+	const char *start, *end;
+	struct stat st;
+
+	for( start = root_dir; *start; start = *end ? end + 1 : end )
+	{
+		vfs_root_t *root = &roots[num_roots];
+		char sysfs[64];
+
+		end = strchrnul( start, ':' );
+		if( end == start )
+			continue;
+
+		if( num_roots == VFS_MAX_ROOTS )
+		{
+			log_warn("More than %d roots, ignoring the rest\n",
+					VFS_MAX_ROOTS );
+			break;
+		}
+
+		root->len = end - start;
+		root->dir = strndup( start, root->len );
+		if( root->dir == NULL )
+		{
+			FATAL_MEM( root->len + 1 );
+			posix_destroy();
+			return FTP_ERROR;
+		}
+
+		/* A root that isn't there just has no files */
+		root->fd = open( root->dir, O_PATH | O_DIRECTORY );
+		if( root->fd == -1 )
+			log_warn("Unable to open root '%s': %m\n", root->dir );
+		root->dir_fd = -1;
+		root->dir_err = 0;
+
+		/* The write load of the disk, where the kernel has one */
+		root->load_path = NULL;
+		if( num_roots > 0 || strchr( end, ':' ) )
+		{
+			if( stat( root->dir, &st ) == 0 && major( st.st_dev ) != 0 )
+			{
+				snprintf( sysfs, sizeof sysfs,
+						"/sys/dev/block/%u:%u/inflight",
+						major( st.st_dev ),
+						minor( st.st_dev ) );
+				if( access( sysfs, R_OK ) == 0 )
+					root->load_path = strdup( sysfs );
+			}
+		}
+
+		if( root->len > maxlen )
+			maxlen = root->len;
+		num_roots++;
+	}
+
+	if( num_roots == 0 )
+	{
+		log_warn("No root directory\n");
+		return FTP_ERROR;
+	}
+
+	root_space = maxlen;
+	placed_path[0] = '\0';
+	dir_path[0] = '\0';
+
 	return FTP_SUCCESS;
 }
 
+static void posix_destroy(void)
+{
+	close_dirs();
+
+	while( num_roots > 0 )
+	{
+		num_roots--;
+		if( roots[num_roots].fd != -1 )
+			close( roots[num_roots].fd );
+		free( roots[num_roots].dir );
+		free( roots[num_roots].load_path );
+	}
+}
+
+/* The POSIX backend works on the path in virt_path, with the real root
+ * copied in front of it. VPATH is usually virt_path itself already */
+static void posix_path( const char *vpath )
+{
+	if( vpath != virt_path )
+		strlcpy( virt_path, vpath, FTP_MAX_PATH );
+
+	if( num_roots > 1 )
+		use_root( 0 );
+}
+
+static void use_root( int i )
+{
+	real_path = virt_path - roots[i].len;
+	memcpy( real_path, roots[i].dir, roots[i].len );
+}
+
+/* Open PATH below the directory DIRFD. The kernel makes sure the path
+ * doesn't leave it, through .. or symlinks, and only follows symlinks at
+ * all if they're allowed. Older kernels only get the last one checked */
+static int open_beneath( int dirfd, const char *path, int flags,
+		mode_t mode )
+{
+	struct open_how how;
+	int ret;
+
+	if( have_openat2 )
+	{
+		memset( &how, 0, sizeof how );
+		how.flags = flags;
+		how.mode = ( flags & O_CREAT ) ? mode : 0;
+		how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+		if( !config.allow_links )
+			how.resolve |= RESOLVE_NO_SYMLINKS;
+
+		ret = syscall( SYS_openat2, dirfd, path, &how, sizeof how );
+		if( ret != -1 || errno != ENOSYS )
+		{
+			/* Same answer as for a link vfs_stat() refuses */
+			if( ret == -1 && ( errno == EXDEV ||
+			    ( errno == ELOOP && !config.allow_links ) ) )
+				errno = EACCES;
+			return ret;
+		}
+
+		have_openat2 = false;
+	}
+
+	if( !config.allow_links )
+		flags |= O_NOFOLLOW;
+
+	return openat( dirfd, path, flags, mode );
+}
+
+/* The last part of the current path, which is looked up in dir_fd() */
+static const char *path_name(void)
+{
+	const char *name = strrchr( virt_path, '/' ) + 1;
+
+	return *name ? name : ".";
+}
+
+static void close_dirs(void)
+{
+	int i;
+
+	for( i = 0; i < num_roots; i++ )
+	{
+		if( roots[i].dir_fd != -1 )
+			close( roots[i].dir_fd );
+		roots[i].dir_fd = -1;
+		roots[i].dir_err = 0;
+	}
+
+	dir_path[0] = '\0';
+}
+
+/* The directory the current path is in, on root I. It stays open for as
+ * long as paths are in that directory, so the kernel doesn't walk down
+ * to it over and over. Sets errno and returns -1 if it's not there */
+static int dir_fd( int i )
+{
+	const char *sep = strrchr( virt_path, '/' );
+	size_t len = sep - virt_path;
+
+	use_root( i );
+
+	if( len == 0 )
+	{
+		if( roots[i].fd == -1 )
+			errno = ENOENT;
+		return roots[i].fd;
+	}
+
+	if( strncmp( dir_path, virt_path, len ) != 0 || dir_path[len] != '\0' )
+	{
+		close_dirs();
+		memcpy( dir_path, virt_path, len );
+		dir_path[len] = '\0';
+	}
+
+	if( roots[i].dir_fd == -1 && roots[i].dir_err == 0 )
+	{
+		roots[i].dir_fd = roots[i].fd == -1 ? -1 :
+			open_beneath( roots[i].fd, dir_path + 1,
+					O_PATH | O_DIRECTORY, 0 );
+		if( roots[i].dir_fd == -1 )
+			roots[i].dir_err = roots[i].fd == -1 ? ENOENT : errno;
+	}
+
+	if( roots[i].dir_fd == -1 )
+		errno = roots[i].dir_err;
+
+	return roots[i].dir_fd;
+}
+
+/* Select the first root that has the current path, and store what it is
+ * in ST. Returns its index, or -1 with root 0 selected */
+static int find_root( struct stat *st )
+{
+	int i, fd, err = ENOENT;
+
+	for( i = 0; i < num_roots; i++ )
+	{
+		fd = dir_fd( i );
+		if( fd != -1 && fstatat( fd, path_name(), st,
+				AT_SYMLINK_NOFOLLOW ) == 0 )
+			return i;
+
+		/* Report why the only root failed */
+		if( num_roots == 1 )
+			err = errno;
+	}
+
+	use_root( 0 );
+	errno = err;
+
+	return -1;
+}
+
+/* Does root I have the directory the current path is in */
+static bool parent_in_root( int i )
+{
+	return dir_fd( i ) != -1;
+}
+
+/* Writes the disk of root I has in flight right now */
+static unsigned long root_load( int i )
+{
+	unsigned long reads, writes;
+	FILE *fp;
+
+	if( roots[i].load_path == NULL )
+		return 0;
+
+	fp = fopen( roots[i].load_path, "r" );
+	if( fp == NULL )
+		return 0;
+
+	if( fscanf( fp, "%lu %lu", &reads, &writes ) != 2 )
+		writes = 0;
+
+	fclose( fp );
+
+	return writes;
+}
+
+/* Pick the root for a new file at the current path: the disk with the
+ * fewest writes in flight among those with enough free space, or the one
+ * with the most space if none has enough */
+static int place_root(void)
+{
+	unsigned long long min_free, best_free = 0;
+	unsigned long best_load = 0;
+	bool best_fits = false;
+	int i, best = -1;
+
+	if( num_roots == 1 )
+		return 0;
+
+	/* vfs_resolve() already decided */
+	if( strcmp( placed_path, virt_path ) == 0 )
+	{
+		use_root( placed_root );
+		return placed_root;
+	}
+
+	min_free = (unsigned long long) config.union_min_free * 1024 * 1024;
+
+	for( i = 0; i < num_roots; i++ )
+	{
+		struct statvfs sv;
+		unsigned long long avail;
+		unsigned long load;
+		bool fits;
+
+		if( roots[i].fd == -1 || fstatvfs( roots[i].fd, &sv ) == -1 )
+			continue;
+
+		avail = (unsigned long long) sv.f_bavail * sv.f_frsize;
+		fits = ( avail >= min_free );
+		load = fits ? root_load( i ) : 0;
+
+		if( best != -1 )
+		{
+			if( fits != best_fits )
+			{
+				if( !fits )
+					continue;
+			}
+			else if( fits && load != best_load )
+			{
+				if( load > best_load )
+					continue;
+			}
+			else if( avail <= best_free )
+				continue;
+		}
+
+		best = i;
+		best_fits = fits;
+		best_load = load;
+		best_free = avail;
+	}
+
+	if( best == -1 )
+		best = 0;
+
+	strlcpy( placed_path, virt_path, FTP_MAX_PATH );
+	placed_root = best;
+	use_root( best );
+
+	return best;
+}
+
 int failed_vfs_reply( ftp_conn_t *conn )
 {
 	switch(errno)
@@ -58,6 +562,9 @@ int failed_vfs_reply( ftp_conn_t *conn )
 	case ELOOP:
 	case EUSERS:
 	case EDQUOT:
+	case EROFS:
+	case EISDIR:
+	case EOPNOTSUPP:
 		reply_format(conn, "550 %m\r\n");
 		break;
 	default:
@@ -76,7 +583,7 @@ static ssize_t vfs_realpath( const char *cwd, const char *path )
 	char *dst;
 	const char *start, *end;
 	
-	assert( real_path != NULL && virt_path != NULL );
+	assert( virt_path != NULL );
 
 	/* If it's an absolute path, we don't need the cwd */
 	if( path[0] == '/' )
@@ -146,58 +653,123 @@ static ssize_t vfs_realpath( const char *cwd, const char *path )
 	return 0;
 }
 
-int vfs_stat( const char *cwd, const char *vpath, struct stat *st )
+
+/* Store the real path of VPATH in DST, for code outside of the VFS that
+ * needs to know which file it is dealing with. Files of backends without
+ * real paths get an empty one */
+int vfs_resolve( const char *cwd, const char *vpath, char *dst, size_t len )
 {
-	int statret;
-	struct stat tmp;
+	dst[0] = '\0';
 
 	if( vfs_realpath( cwd, vpath ) == -1 )
 		return -1;
 
-	statret = lstat( real_path, &tmp );
+	if( ops->resolve == NULL )
+	{
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	return ops->resolve( virt_path, dst, len );
+}
 
-	if( statret == -1 )
+/* Store the canonical virtual path of VPATH in DST */
+int vfs_virtual( const char *cwd, const char *vpath, char *dst, size_t len )
+{
+	if( vfs_realpath( cwd, vpath ) == -1 )
 		return -1;
-	else if( S_ISLNK( tmp.st_mode ) && !config.allow_links )
+
+	if( strlcpy( dst, virt_path, len ) >= len )
 	{
-		errno = EACCES;
+		dst[0] = '\0';
+		errno = ENAMETOOLONG;
 		return -1;
 	}
-	
-	statret = stat( real_path, st );
 
-	return statret;
+	return 0;
 }
 
-int vfs_creat( const char *cwd, const char *vpath, mode_t mode )
+int vfs_stat( const char *cwd, const char *vpath, struct stat *st )
 {
-	int ret;
+	int ret, err;
 
 	if( vfs_realpath( cwd, vpath ) == -1 )
 		return -1;
 
-	ret = creat( real_path, mode );
+	ret = stat_cache_lookup( virt_path, st );
+	if( ret != 1 )
+		return ret;
+
+	ret = ops->stat( virt_path, st );
+	err = ret == -1 ? errno : 0;
+
+	stat_cache_store( virt_path, st, err );
+	errno = err;
 
 	return ret;
 }
 
+int vfs_creat( const char *cwd, const char *vpath, mode_t mode )
+{
+	if( vfs_realpath( cwd, vpath ) == -1 )
+		return -1;
+
+	if( ops->creat == NULL )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	stat_cache_forget( virt_path );
+
+	return ops->creat( virt_path, mode );
+}
+
 int vfs_open( const char *cwd, const char *vpath, int flags )
 {
-	int ret;
+	int fd;
 
 	if( vfs_realpath( cwd, vpath ) == -1 )
 		return -1;
 
-	ret = open( real_path, flags );
+	if( ( flags & O_ACCMODE ) != O_RDONLY || ( flags & O_TRUNC ) )
+		stat_cache_forget( virt_path );
 
-	return ret;
+	fd = ops->open( virt_path, flags );
+	if( fd == -1 && fall_back() == 0 )
+		fd = ops->open( virt_path, flags );
+
+	return fd;
 }
 
 int vfs_close( int fd )
 {
+	if( ops != NULL && ops->close != NULL )
+		return ops->close( fd );
+
 	return close(fd);
 }
 
+/* What vfs_stat() would say about the file open as FD, but from the file
+ * itself and not from the stat cache. So it is what reading FD gets */
+int vfs_fstat( int fd, struct stat *st )
+{
+	if( ops != NULL && ops->fstat != NULL )
+		return ops->fstat( fd, st );
+
+	return fstat( fd, st );
+}
+
+/* Where the contents of the file open as FD start. Files inside of an
+ * archive share its descriptor */
+off_t vfs_offset( int fd )
+{
+	if( ops == NULL || ops->offset == NULL )
+		return 0;
+
+	return ops->offset( fd );
+}
+
 int vfs_chdir( char *cwd, const char *path )
 {
 	if( vfs_realpath( cwd, path ) == -1 )
@@ -210,45 +782,775 @@ int vfs_chdir( char *cwd, const char *path )
 
 int vfs_mkdir( const char *cwd, const char *pathname, mode_t mode )
 {
-	int ret;
-
 	if( vfs_realpath( cwd, pathname ) == -1 )
 		return -1;
 
-	ret = mkdir( real_path, mode );
+	if( ops->mkdir == NULL )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	stat_cache_forget( virt_path );
 
-	return ret;
+	return ops->mkdir( virt_path, mode );
 }
 
 int vfs_rmdir( const char *cwd, const char *pathname )
 {
-	int ret;
-
 	if( vfs_realpath( cwd, pathname ) == -1 )
 		return -1;
 
-	ret = rmdir( real_path );
+	if( ops->rmdir == NULL )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	stat_cache_forget( virt_path );
 
-	return ret;
+	return ops->rmdir( virt_path );
 }
 
-DIR *vfs_opendir( const char *cwd, const char *path )
+vfs_dir_t *vfs_openlist( const char *cwd, const char *path )
 {
 	if( vfs_realpath( cwd, path ) == -1 )
 		return NULL;
-	
-	return opendir( real_path );
+
+	return ops->openlist( virt_path );
 }
 
-int vfs_closedir( DIR *dirp )
+struct dirent *vfs_readlist( vfs_dir_t *list )
 {
-	return closedir( dirp );
+	return ops->readlist( list );
 }
 
-int vfs_unlink( const char *cwd, const char *path )
+/* Stat NAME, the entry vfs_readlist() returned last, in the directory DIR
+ * being listed. Backends can mostly do that from the open listing, without
+ * looking up the path again. MASK has the STATX_ fields the caller needs,
+ * backends may fill in more */
+int vfs_statlist( vfs_dir_t *list, const char *dir, const char *name,
+		unsigned int mask, struct stat *st )
 {
-	if( vfs_realpath( cwd, path ) == -1 )
-		return -1;
+	int ret = 1;
+
+	if( ops->statlist != NULL )
+		ret = ops->statlist( list, mask, st );
+
+	if( ret == 1 )
+		ret = vfs_stat( dir, name, st );
+
+	return ret;
+}
 
-	return unlink( real_path );
+/* The caller is going to stat every entry of LIST with MASK, so backends
+ * may start on the next ones early. Must come before vfs_readlist() */
+void vfs_statahead( vfs_dir_t *list, unsigned int mask )
+{
+	if( ops->statahead != NULL )
+		ops->statahead( list, mask );
+}
+
+/* The line of LIST for the entry vfs_readlist() returned last, from
+ * backends that have it rendered already. NULL for the others */
+const char *vfs_listline( vfs_dir_t *list, size_t *len )
+{
+	if( ops->listline == NULL )
+		return NULL;
+
+	return ops->listline( list, len );
+}
+
+int vfs_closelist( vfs_dir_t *list )
+{
+	return ops->closelist( list );
+}
+
+/* Directories of several roots are listed together */
+bool vfs_merged(void)
+{
+	return num_roots > 1;
+}
+
+/* Listings of these need no stat calls at all */
+bool vfs_prerendered(void)
+{
+	return ops->listline != NULL;
+}
+
+/* Backends without creat() are read-only */
+bool vfs_writable(void)
+{
+	return ops->creat != NULL;
+}
+
+int vfs_unlink( const char *cwd, const char *path )
+{
+	if( vfs_realpath( cwd, path ) == -1 )
+		return -1;
+
+	if( ops->unlink == NULL )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	stat_cache_forget( virt_path );
+
+	return ops->unlink( virt_path );
+}
+
+/* Create a new, unique file from the template VPATH, which has to end in
+ * XXXXXX. Like mkstemp(3), the X's are replaced with the name it got */
+int vfs_mkstemp( const char *cwd, char *vpath )
+{
+	int fd;
+	size_t len;
+
+	len = strlen( vpath );
+	if( len < 6 || strcmp( vpath + len - 6, "XXXXXX" ) != 0 )
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if( vfs_realpath( cwd, vpath ) == -1 )
+		return -1;
+
+	if( ops->mkstemp == NULL )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	fd = ops->mkstemp( virt_path );
+	if( fd == -1 )
+		return -1;
+
+	stat_cache_forget( virt_path );
+
+	memcpy( vpath + len - 6, virt_path + strlen( virt_path ) - 6, 6 );
+
+	return fd;
+}
+
+int vfs_rename( const char *cwd, const char *from, const char *to )
+{
+	char virt_from[FTP_MAX_PATH];
+
+	if( vfs_virtual( cwd, from, virt_from, sizeof virt_from ) == -1 )
+		return -1;
+
+	if( vfs_realpath( cwd, to ) == -1 )
+		return -1;
+
+	if( ops->rename == NULL )
+	{
+		errno = EROFS;
+		return -1;
+	}
+
+	/* Everything below a directory moves along */
+	stat_cache_flush();
+
+	return ops->rename( virt_from, virt_path );
+}
+
+/* Open the current path on root I */
+static int open_path( int i, int flags, mode_t mode )
+{
+	int fd, ret;
+
+	fd = dir_fd( i );
+	if( fd == -1 )
+		return -1;
+
+	ret = open_beneath( fd, path_name(), flags, mode );
+
+	/* A link out of the directory might still stay inside of the root */
+	if( ret == -1 && errno == EACCES && config.allow_links )
+		ret = open_beneath( roots[i].fd, virt_path + 1, flags, mode );
+
+	return ret;
+}
+
+static int posix_resolve( const char *vpath, char *dst, size_t len )
+{
+	struct stat st;
+
+	posix_path( vpath );
+
+	/* A new file, decide now where it will go */
+	if( num_roots > 1 && find_root( &st ) == -1 )
+		place_root();
+
+	if( strlcpy( dst, real_path, len ) >= len )
+	{
+		dst[0] = '\0';
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* One fstatat() in the directory that is open already. Only links need
+ * more work */
+static int posix_stat( const char *vpath, struct stat *st )
+{
+	struct stat tmp;
+	int root, fd, ret;
+
+	posix_path( vpath );
+
+	root = find_root( st );
+	if( root == -1 )
+		return -1;
+
+	if( S_ISLNK( st->st_mode ) )
+	{
+		if( !config.allow_links )
+		{
+			errno = EACCES;
+			return -1;
+		}
+
+		fd = open_path( root, O_PATH, 0 );
+		if( fd == -1 )
+			return -1;
+
+		ret = fstat( fd, st );
+		close( fd );
+		if( ret == -1 )
+			return -1;
+	}
+
+	/* Maybe an upload that is still in the staging directory */
+	if( S_ISREG( st->st_mode ) && st->st_size == 0 &&
+	    staging_stat( real_path, &tmp ) == 0 )
+		*st = tmp;
+
+	return 0;
+}
+
+static int posix_creat( const char *vpath, mode_t mode )
+{
+	struct stat st;
+	int ret, root;
+
+	posix_path( vpath );
+
+	root = find_root( &st );
+
+	/* Truncating a file that shares its contents with others through
+	 * the dedup store would change them all */
+	if( root != -1 && config.dedup_dir != NULL && S_ISREG( st.st_mode ) &&
+	    st.st_nlink > 1 )
+		unlinkat( dir_fd( root ), path_name(), 0 );
+
+	if( root == -1 )
+		root = place_root();
+
+	ret = open_path( root, O_WRONLY | O_CREAT | O_TRUNC, mode );
+
+	/* The directory exists, just not on the disk picked for the file */
+	if( ret == -1 && errno == ENOENT && num_roots > 1 )
+	{
+		int i;
+
+		for( i = 0; i < num_roots; i++ )
+			if( parent_in_root( i ) )
+				break;
+
+		use_root( root );
+		if( i < num_roots && make_parent_dirs( real_path ) == 0 )
+		{
+			roots[root].dir_err = 0;
+			ret = open_path( root, O_WRONLY | O_CREAT | O_TRUNC,
+					mode );
+		}
+		else
+			errno = ENOENT;
+	}
+
+	return ret;
+}
+
+static int posix_open( const char *vpath, int flags )
+{
+	struct stat st;
+	int ret, copy, root = 0;
+
+	posix_path( vpath );
+
+	if( num_roots > 1 && ( root = find_root( &st ) ) == -1 )
+		root = 0;
+
+	ret = open_path( root, flags, 0 );
+
+	if( ret == -1 || ( flags & O_ACCMODE ) != O_RDONLY ||
+	    ( config.staging_dir == NULL && config.tier_dir == NULL ) ||
+	    fstat( ret, &st ) == -1 || !S_ISREG( st.st_mode ) )
+		return ret;
+
+	/* An upload that is still in the staging directory, or a popular
+	 * file with a copy on the cache tier */
+	if( st.st_size == 0 )
+		copy = staging_open_read( real_path );
+	else
+		copy = tier_open( real_path, &st );
+
+	if( copy != -1 )
+	{
+		close( ret );
+		ret = copy;
+	}
+
+	return ret;
+}
+
+/* A new directory is made on every disk that has its parent, so files
+ * can be placed below it on any of them */
+static int posix_mkdir( const char *vpath, mode_t mode )
+{
+	struct stat st;
+	int ret, i, fd, made = 0;
+
+	posix_path( vpath );
+
+	if( num_roots == 1 )
+	{
+		fd = dir_fd( 0 );
+		return fd == -1 ? -1 : mkdirat( fd, path_name(), mode );
+	}
+
+	if( find_root( &st ) != -1 )
+	{
+		errno = EEXIST;
+		return -1;
+	}
+
+	for( i = num_roots - 1; i >= 0; i-- )
+	{
+		fd = dir_fd( i );
+		if( fd != -1 && mkdirat( fd, path_name(), mode ) == 0 )
+			made++;
+	}
+
+	ret = made > 0 ? 0 : -1;
+	if( ret == -1 )
+		errno = ENOENT;
+
+	return ret;
+}
+
+static int posix_rmdir( const char *vpath )
+{
+	struct stat st;
+	int ret = 0, i, fd, found = 0;
+	size_t len;
+
+	posix_path( vpath );
+
+	for( i = 0; i < num_roots; i++ )
+	{
+		fd = dir_fd( i );
+		if( num_roots > 1 && ( fd == -1 || fstatat( fd, path_name(),
+				&st, AT_SYMLINK_NOFOLLOW ) == -1 ) )
+			continue;
+
+		found++;
+		if( fd == -1 ||
+		    unlinkat( fd, path_name(), AT_REMOVEDIR ) == -1 )
+			ret = -1;
+	}
+
+	if( found == 0 )
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* The directory kept open might have been this one */
+	len = strlen( virt_path );
+	if( strncmp( dir_path, virt_path, len ) == 0 &&
+	    ( dir_path[len] == '/' || dir_path[len] == '\0' ) )
+		close_dirs();
+
+	return ret;
+}
+
+/* Open the directory VPATH on every root that has it, for a listing that
+ * merges them all */
+static vfs_dir_t *posix_openlist( const char *vpath )
+{
+	vfs_dir_t *list;
+	int i, fd;
+
+	posix_path( vpath );
+
+	list = malloc( sizeof *list );
+	if( list == NULL )
+	{
+		FATAL_MEM( sizeof *list );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	list->num = list->cur = 0;
+	list->data = NULL;
+	list->pos = list->len = 0;
+	list->ahead = NULL;
+
+	/* Huge directories are read in a few big gulps */
+	list->buf = malloc( VFS_LIST_BUFFER_SIZE );
+	if( list->buf == NULL )
+	{
+		FATAL_MEM( VFS_LIST_BUFFER_SIZE );
+		free( list );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for( i = 0; i < num_roots; i++ )
+	{
+		fd = open_path( i, O_RDONLY | O_DIRECTORY, 0 );
+		if( fd == -1 && errno == ENOENT )
+			continue;
+		else if( fd == -1 )
+			break;
+
+		list->fds[list->num++] = fd;
+	}
+
+	if( list->num == 0 || i < num_roots )
+	{
+		int err = list->num == 0 && i == num_roots ? ENOENT : errno;
+
+		posix_closelist( list );
+		errno = err;
+		return NULL;
+	}
+
+	return list;
+}
+
+/* The next entry of the merged listing. With stats done ahead, it comes
+ * out of the window, which is filled up again first */
+static struct dirent *posix_readlist( vfs_dir_t *list )
+{
+	struct stat_ahead *ahead = list->ahead;
+	struct dirent *entry;
+	stat_job_t *job;
+
+	if( ahead == NULL )
+		return next_entry( list );
+
+	/* The slot can only be used again once the pool is done with it,
+	 * even if the caller skipped the entry */
+	if( ahead->handed )
+	{
+		stat_pool_wait( &ahead->jobs[ahead->head % STAT_AHEAD_WINDOW] );
+		ahead->head++;
+		ahead->handed = false;
+	}
+
+	while( ahead->tail - ahead->head < STAT_AHEAD_WINDOW &&
+	       (entry = next_entry( list )) != NULL )
+	{
+		job = &ahead->jobs[ahead->tail++ % STAT_AHEAD_WINDOW];
+		job->dirfd = list->fds[list->cur];
+		job->mask = ahead->mask;
+		job->type = entry->d_type;
+		strlcpy( job->name, entry->d_name, sizeof job->name );
+		stat_pool_submit( job );
+	}
+
+	if( ahead->head == ahead->tail )
+		return NULL;
+
+	job = &ahead->jobs[ahead->head % STAT_AHEAD_WINDOW];
+	ahead->handed = true;
+
+	memset( &list->entry, 0, sizeof list->entry );
+	list->entry.d_type = job->type;
+	strlcpy( list->entry.d_name, job->name, sizeof list->entry.d_name );
+
+	return &list->entry;
+}
+
+/* Names a root hides behind an earlier one are left out, just like
+ * vfs_stat() doesn't see them. The records of getdents64() are laid out
+ * like struct dirent with 64 bit offsets, so they are handed out right
+ * from the buffer */
+static struct dirent *next_entry( vfs_dir_t *list )
+{
+	struct dirent *entry;
+	ssize_t ret;
+
+	while( list->cur < list->num )
+	{
+		int i;
+
+		if( list->pos >= list->len )
+		{
+			ret = getdents64( list->fds[list->cur], list->buf,
+					VFS_LIST_BUFFER_SIZE );
+			if( ret <= 0 )
+			{
+				if( ret == -1 )
+					log_warn("Unable to read directory: %m\n");
+				list->cur++;
+				continue;
+			}
+
+			list->pos = 0;
+			list->len = ret;
+		}
+
+		entry = (struct dirent *) ( list->buf + list->pos );
+		list->pos += entry->d_reclen;
+
+		for( i = 0; i < list->cur; i++ )
+		{
+			struct stat st;
+
+			if( fstatat( list->fds[i], entry->d_name, &st,
+					AT_SYMLINK_NOFOLLOW ) == 0 )
+				break;
+		}
+
+		if( i == list->cur )
+		{
+			list->data = entry;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* The entry just read, relative to the directory it came from. Links and
+ * maybe staged uploads are left to posix_stat(), returning 1 */
+static int posix_statlist( vfs_dir_t *list, unsigned int mask,
+		struct stat *st )
+{
+	const struct dirent *entry = list->data;
+	struct stat_ahead *ahead = list->ahead;
+	struct statx stx;
+	stat_job_t *job;
+
+	if( ahead != NULL )
+	{
+		job = &ahead->jobs[ahead->head % STAT_AHEAD_WINDOW];
+		stat_pool_wait( job );
+		if( job->err )
+		{
+			errno = job->err;
+			return -1;
+		}
+
+		statx_stat( &job->stx, st );
+	}
+	else
+	{
+		if( statx( list->fds[list->cur], entry->d_name,
+				AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+				statx_mask( mask ), &stx ) == -1 )
+			return -1;
+
+		statx_stat( &stx, st );
+	}
+
+	if( S_ISLNK( st->st_mode ) || ( config.staging_dir != NULL &&
+	    S_ISREG( st->st_mode ) && st->st_size == 0 ) )
+		return 1;
+
+	return 0;
+}
+
+/* Stat the entries with the thread pool, a window of them ahead of the
+ * one being listed */
+static void posix_statahead( vfs_dir_t *list, unsigned int mask )
+{
+	struct stat_ahead *ahead;
+
+	if( list->ahead != NULL || stat_pool_start() != FTP_SUCCESS )
+		return;
+
+	ahead = malloc( sizeof *ahead );
+	if( ahead == NULL )
+	{
+		FATAL_MEM( sizeof *ahead );
+		return;
+	}
+
+	ahead->head = ahead->tail = 0;
+	ahead->mask = statx_mask( mask );
+	ahead->handed = false;
+
+	list->ahead = ahead;
+}
+
+/* posix_statlist() needs the type, and the size to find staged files */
+static unsigned int statx_mask( unsigned int mask )
+{
+	mask |= STATX_TYPE;
+	if( config.staging_dir != NULL )
+		mask |= STATX_SIZE;
+
+	return mask;
+}
+
+/* Fields statx() wasn't asked for are whatever the filesystem had at
+ * hand, or zero */
+static void statx_stat( const struct statx *stx, struct stat *st )
+{
+	memset( st, 0, sizeof *st );
+	st->st_dev = makedev( stx->stx_dev_major, stx->stx_dev_minor );
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev( stx->stx_rdev_major, stx->stx_rdev_minor );
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+static int posix_closelist( vfs_dir_t *list )
+{
+	int i;
+
+	/* The pool might still be working on the window */
+	if( list->ahead != NULL )
+	{
+		struct stat_ahead *ahead = list->ahead;
+
+		for( ; ahead->head != ahead->tail; ahead->head++ )
+			stat_pool_wait( &ahead->jobs[ahead->head %
+					STAT_AHEAD_WINDOW] );
+		free( ahead );
+	}
+
+	for( i = 0; i < list->num; i++ )
+		close( list->fds[i] );
+
+	free( list->buf );
+	free( list );
+
+	return 0;
+}
+
+static int posix_unlink( const char *vpath )
+{
+	struct stat st;
+	int root = 0, fd;
+
+	posix_path( vpath );
+
+	if( num_roots > 1 && ( root = find_root( &st ) ) == -1 )
+		return -1;
+
+	fd = dir_fd( root );
+	if( fd == -1 )
+		return -1;
+
+	if( staging_remove( real_path ) == -1 )
+		log_warn("Unable to remove staged copy of '%s': %m\n",
+				real_path );
+
+	return unlinkat( fd, path_name(), 0 );
+}
+
+static int posix_mkstemp( char *vpath )
+{
+	static const char chars[] =
+		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+	char *x;
+	int i, dfd, fd, tries;
+
+	posix_path( vpath );
+
+	/* Next to the file it will probably be renamed over */
+	for( i = 0; i < num_roots - 1; i++ )
+		if( parent_in_root( i ) )
+			break;
+
+	dfd = dir_fd( i );
+	if( dfd == -1 )
+		return -1;
+
+	/* The X's of virt_path, real_path ends in it */
+	x = virt_path + strlen( virt_path ) - 6;
+
+	for( tries = 0; tries < 100; tries++ )
+	{
+		int j;
+
+		for( j = 0; j < 6; j++ )
+			x[j] = chars[( random() ^ getpid() ) %
+				( sizeof chars - 1 )];
+
+		fd = open_beneath( dfd, path_name(),
+				O_RDWR | O_CREAT | O_EXCL, 0600 );
+		if( fd != -1 || errno != EEXIST )
+			return fd;
+	}
+
+	return -1;
+}
+
+/* Both names are on the disk FROM is on. Files called TO on the other
+ * disks are removed, they would hide the new one or show up again */
+static int posix_rename( const char *from, const char *to )
+{
+	char virt_to[FTP_MAX_PATH], name_from[FTP_MAX_PATH];
+	struct stat st;
+	int root, i, from_fd, fd, ret;
+
+	strlcpy( virt_to, to, sizeof virt_to );
+
+	posix_path( from );
+
+	root = find_root( &st );
+	if( root == -1 )
+		return -1;
+
+	/* Its own descriptor, the kept one moves on to the directory of TO */
+	fd = dir_fd( root );
+	if( fd == -1 || ( from_fd = dup( fd ) ) == -1 )
+		return -1;
+	strlcpy( name_from, path_name(), sizeof name_from );
+
+	posix_path( virt_to );
+
+	for( i = 0; i < num_roots && num_roots > 1; i++ )
+	{
+		struct stat tmp;
+
+		fd = dir_fd( i );
+		if( i != root && fd != -1 && fstatat( fd, path_name(), &tmp,
+				AT_SYMLINK_NOFOLLOW ) == 0 &&
+		    !S_ISDIR( tmp.st_mode ) )
+			unlinkat( fd, path_name(), 0 );
+	}
+
+	fd = dir_fd( root );
+	ret = fd == -1 ? -1 :
+		renameat( from_fd, name_from, fd, path_name() );
+	close( from_fd );
+
+	/* The directory kept open may have been moved along */
+	if( ret == 0 && S_ISDIR( st.st_mode ) )
+		close_dirs();
+
+	return ret;
 }
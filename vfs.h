@@ -5,19 +5,90 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#define VFS_MAX_ROOTS		16
+#define VFS_LIST_BUFFER_SIZE	( 256 * 1024 )
+
+/* One of the real directories merged into the virtual root */
+typedef struct vfs_root
+{
+	char *dir;
+	size_t len;
+	char *load_path;		/* sysfs file with the I/O in flight */
+	int fd;				/* Everything is looked up below it */
+	int dir_fd;			/* The directory in use on this root */
+	int dir_err;			/* Why it couldn't be opened */
+} vfs_root_t;
+
+/* A directory listed on every root that has it */
+typedef struct vfs_dir
+{
+	int fds[VFS_MAX_ROOTS];
+	int num;
+	int cur;			/* The one being read */
+	char *buf;			/* getdents64() records of it */
+	size_t pos, len;
+	struct stat_ahead *ahead;	/* Entries read ahead, being stat'ed */
+	const void *data;		/* Position of the other backends,
+					 * the last entry for POSIX */
+	struct dirent entry;		/* Returned by the other backends */
+} vfs_dir_t;
+
+/* The operations of a backend. Paths are canonical virtual paths, always
+ * starting with a slash. Operations left NULL aren't supported */
+typedef struct vfs_ops
+{
+	const char *name;
+	int (*init)( const char *root );
+	void (*destroy)(void);
+	int (*resolve)( const char *vpath, char *dst, size_t len );
+	int (*stat)( const char *vpath, struct stat *st );
+	int (*creat)( const char *vpath, mode_t mode );
+	int (*open)( const char *vpath, int flags );
+	int (*close)( int fd );
+	int (*fstat)( int fd, struct stat *st );
+	off_t (*offset)( int fd );
+	int (*mkdir)( const char *vpath, mode_t mode );
+	int (*rmdir)( const char *vpath );
+	vfs_dir_t *(*openlist)( const char *vpath );
+	struct dirent *(*readlist)( vfs_dir_t *list );
+	int (*statlist)( vfs_dir_t *list, unsigned int mask,
+			struct stat *st );
+	void (*statahead)( vfs_dir_t *list, unsigned int mask );
+	const char *(*listline)( vfs_dir_t *list, size_t *len );
+	int (*closelist)( vfs_dir_t *list );
+	int (*unlink)( const char *vpath );
+	int (*mkstemp)( char *vpath );
+	int (*rename)( const char *from, const char *to );
+	int (*fallback)( char *dir, size_t len );
+} vfs_ops_t;
+
 extern int init_vfs_pool(const char *);
 extern int destroy_vfs_pool(void);
 extern int failed_vfs_reply( ftp_conn_t *conn );
 
+extern int vfs_resolve( const char *, const char *, char *, size_t );
+extern int vfs_virtual( const char *, const char *, char *, size_t );
 extern int vfs_stat(const char *, const char *, struct stat * );
 extern int vfs_creat( const char *cwd, const char *vpath, mode_t );
 extern int vfs_open(const char *, const char *, int );
 extern int vfs_close( int );
+extern int vfs_fstat( int fd, struct stat *st );
+extern off_t vfs_offset( int fd );
 extern int vfs_chdir( char *cwd, const char *path );
 extern int vfs_mkdir( const char *, const char *, mode_t );
 extern int vfs_rmdir( const char *cwd, const char *pathname );
-extern __must_check DIR *vfs_opendir( const char *cwd, const char *path );
-extern int vfs_closedir( DIR *dirp );
+extern __must_check vfs_dir_t *vfs_openlist( const char *cwd, const char *path );
+extern struct dirent *vfs_readlist( vfs_dir_t *list );
+extern int vfs_statlist( vfs_dir_t *list, const char *dir, const char *name,
+		unsigned int mask, struct stat *st );
+extern void vfs_statahead( vfs_dir_t *list, unsigned int mask );
+extern const char *vfs_listline( vfs_dir_t *list, size_t *len );
+extern int vfs_closelist( vfs_dir_t *list );
 extern int vfs_unlink( const char *, const char * );
+extern int vfs_mkstemp( const char *cwd, char *vpath );
+extern int vfs_rename( const char *cwd, const char *from, const char *to );
+extern bool vfs_writable(void);
+extern bool vfs_merged(void);
+extern bool vfs_prerendered(void);
 
 #endif
@@ -0,0 +1,252 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ftp.h"
+
+/* Uploads to one filesystem waiting for the same syncfs() */
+typedef struct sync_group
+{
+	dev_t dev;			/* 0 if the slot is unused */
+	pid_t leader;			/* Process running syncfs() */
+	unsigned long requested;	/* Last ticket handed out */
+	unsigned long completed;	/* Tickets up to here are on disk */
+	pthread_cond_t done;
+} sync_group_t;
+
+/* Lives in shared memory, so every child can join a group commit */
+typedef struct group_commit
+{
+	pthread_mutex_t lock;
+	sync_group_t groups[GROUP_COMMIT_SLOTS];
+} group_commit_t;
+
+static int group_lock(void);
+static sync_group_t *find_group( dev_t dev );
+static int group_sync( int fd );
+
+static group_commit_t *group_commit = NULL;
+
+int init_writeback(void)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	int i;
+
+	if( config.upload_sync != UPLOAD_SYNC_CLOSE || !config.group_commit )
+		return FTP_SUCCESS;
+
+	log_dbg("Initializing upload group commit\n");
+
+	group_commit = mmap( NULL, sizeof *group_commit,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0 );
+	if( group_commit == MAP_FAILED )
+	{
+		log_fatal("Unable to map group commit area: %m\n");
+		group_commit = NULL;
+		return FTP_ERROR;
+	}
+
+	memset( group_commit, '\0', sizeof *group_commit );
+
+	/* A child can get killed while holding the lock */
+	pthread_mutexattr_init( &mattr );
+	pthread_mutexattr_setpshared( &mattr, PTHREAD_PROCESS_SHARED );
+	pthread_mutexattr_setrobust( &mattr, PTHREAD_MUTEX_ROBUST );
+	pthread_mutex_init( &group_commit->lock, &mattr );
+	pthread_mutexattr_destroy( &mattr );
+
+	pthread_condattr_init( &cattr );
+	pthread_condattr_setpshared( &cattr, PTHREAD_PROCESS_SHARED );
+	for( i = 0; i < GROUP_COMMIT_SLOTS; i++ )
+		pthread_cond_init( &group_commit->groups[i].done, &cattr );
+	pthread_condattr_destroy( &cattr );
+
+	return FTP_SUCCESS;
+}
+
+int destroy_writeback(void)
+{
+	if( group_commit != NULL )
+		munmap( group_commit, sizeof *group_commit );
+	group_commit = NULL;
+
+	return FTP_SUCCESS;
+}
+
+void writeback_begin( writeback_t *wb, off_t offset )
+{
+	wb->start = wb->flushed = wb->waited = offset;
+}
+
+/* The upload wrote everything up to OFFSET. With write-behind, start
+ * writing back the last window and wait for the one before it, so an
+ * upload never has more than two windows of dirty pages */
+int writeback_written( writeback_t *wb, int fd, off_t offset )
+{
+	off_t interval;
+
+	if( config.upload_sync != UPLOAD_SYNC_WRITEBEHIND )
+		return FTP_SUCCESS;
+
+	interval = (off_t) config.upload_sync_interval * 1024 * 1024;
+	if( offset - wb->flushed < interval )
+		return FTP_SUCCESS;
+
+	if( sync_file_range( fd, wb->flushed, offset - wb->flushed,
+			SYNC_FILE_RANGE_WRITE ) == -1 )
+		log_dbg("sync_file_range failed: %m\n");
+
+	if( wb->flushed > wb->waited )
+	{
+		sync_file_range( fd, wb->waited, wb->flushed - wb->waited,
+				SYNC_FILE_RANGE_WAIT_BEFORE |
+				SYNC_FILE_RANGE_WRITE |
+				SYNC_FILE_RANGE_WAIT_AFTER );
+
+		/* Nobody is going to read this soon */
+		posix_fadvise( fd, wb->waited, wb->flushed - wb->waited,
+				POSIX_FADV_DONTNEED );
+		wb->waited = wb->flushed;
+	}
+
+	wb->flushed = offset;
+
+	return FTP_SUCCESS;
+}
+
+/* The upload is complete. Returns FTP_ERROR if the data didn't make it
+ * to disk */
+int writeback_finish( writeback_t *wb, int fd, off_t offset )
+{
+	int ret;
+
+	switch( config.upload_sync )
+	{
+	case UPLOAD_SYNC_WRITEBEHIND:
+		if( offset > wb->flushed )
+			sync_file_range( fd, wb->flushed, 0,
+					SYNC_FILE_RANGE_WRITE );
+		return FTP_SUCCESS;
+	case UPLOAD_SYNC_CLOSE:
+		if( group_commit != NULL )
+			ret = group_sync( fd );
+		else
+			ret = fdatasync( fd );
+
+		if( ret == -1 )
+		{
+			log_warn("Unable to sync upload: %m\n");
+			return FTP_ERROR;
+		}
+		return FTP_SUCCESS;
+	case UPLOAD_SYNC_NONE:
+	default:
+		return FTP_SUCCESS;
+	}
+}
+
+static int group_lock(void)
+{
+	int ret;
+
+	ret = pthread_mutex_lock( &group_commit->lock );
+	if( ret == EOWNERDEAD )
+		ret = pthread_mutex_consistent( &group_commit->lock );
+
+	return ret;
+}
+
+/* Call with the lock held */
+static sync_group_t *find_group( dev_t dev )
+{
+	int i;
+	sync_group_t *free_slot = NULL;
+
+	for( i = 0; i < GROUP_COMMIT_SLOTS; i++ )
+	{
+		if( group_commit->groups[i].dev == dev )
+			return &group_commit->groups[i];
+		if( free_slot == NULL && group_commit->groups[i].dev == 0 )
+			free_slot = &group_commit->groups[i];
+	}
+
+	if( free_slot != NULL )
+		free_slot->dev = dev;
+
+	return free_slot;
+}
+
+/* Make FD durable together with every other upload to the same
+ * filesystem. The first one in becomes the leader and runs syncfs(),
+ * which covers everyone that asked before it started. Whoever arrives
+ * while it runs waits for the next round */
+static int group_sync( int fd )
+{
+	struct stat st;
+	sync_group_t *group;
+	unsigned long ticket;
+
+	if( fstat( fd, &st ) == -1 || group_lock() != 0 )
+		return fdatasync( fd );
+
+	group = find_group( st.st_dev );
+	if( group == NULL )
+	{
+		pthread_mutex_unlock( &group_commit->lock );
+		return fdatasync( fd );
+	}
+
+	ticket = ++group->requested;
+
+	while( group->completed < ticket )
+	{
+		struct timespec ts;
+
+		/* The leader could have been killed halfway */
+		if( group->leader == 0 || ( kill( group->leader, 0 ) == -1 &&
+				errno == ESRCH ) )
+		{
+			unsigned long target = group->requested;
+			int ret, err;
+
+			group->leader = getpid();
+			pthread_mutex_unlock( &group_commit->lock );
+
+			ret = syncfs( fd );
+			err = errno;
+
+			group_lock();
+			group->leader = 0;
+			if( ret == 0 && target > group->completed )
+				group->completed = target;
+			pthread_cond_broadcast( &group->done );
+
+			if( ret == -1 )
+			{
+				pthread_mutex_unlock( &group_commit->lock );
+				errno = err;
+				return -1;
+			}
+			continue;
+		}
+
+		clock_gettime( CLOCK_REALTIME, &ts );
+		ts.tv_sec++;
+		if( pthread_cond_timedwait( &group->done, &group_commit->lock,
+				&ts ) == EOWNERDEAD )
+			pthread_mutex_consistent( &group_commit->lock );
+	}
+
+	pthread_mutex_unlock( &group_commit->lock );
+
+	return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __WRITEBACK_H__
+#define __WRITEBACK_H__ 1
+
+#include <sys/types.h>
+
+/* Writeback state of one upload */
+typedef struct writeback
+{
+	off_t start;			/* Offset of the first byte written */
+	off_t flushed;			/* Writeback started up to here */
+	off_t waited;			/* Written back and dropped from
+					 * the page cache up to here */
+} writeback_t;
+
+extern int init_writeback(void);
+extern int destroy_writeback(void);
+extern void writeback_begin( writeback_t *, off_t offset );
+extern int writeback_written( writeback_t *, int fd, off_t offset );
+extern int writeback_finish( writeback_t *, int fd, off_t offset );
+
+/* Uploads that can share one syncfs() at the same time */
+#define GROUP_COMMIT_SLOTS	8
+
+#endif